@@ -0,0 +1,664 @@
+#include <raft-kv/common/dict.h>
+#include <algorithm>
+#include <thread>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/crc.hpp>
+
+namespace kv {
+
+static const size_t kMinBuckets = 4;
+// the empty buckets a rehash step skips before it returns
+static const size_t kRehashEmptyVisits = 10;
+
+// An image is a header, the entries and the buckets, an array of the offsets of
+// the first entry of each bucket. Every entry holds the offset of the next one of
+// its bucket, 0 ends a bucket. Entries are aligned on 8 bytes. The header holds
+// the crc32 of the entries and the buckets.
+static const uint32_t kImageMagic = 0x4d49564b; // "KVIM"
+static const uint32_t kImageVersion = 1;
+static const char* kImageHashCheck = "kvd dict image";
+static const uint64_t kImageWriteSize = 1024 * 1024; // written between two calls to the rate limiter
+
+#pragma pack(1)
+struct ImageHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t hash_check; // hash of kImageHashCheck, the image is only valid with the same hash function
+  uint64_t file_len;
+  uint64_t bucket_count;
+  uint64_t entry_count;
+  uint64_t buckets_offset;
+  uint32_t crc32;
+  uint32_t reserved;
+};
+
+struct Dict::ImageRecord {
+  uint64_t next;
+  uint64_t hash;
+  uint64_t id; // position of the entry in Image::shadowed
+  uint32_t key_len;
+  uint32_t value_len;
+};
+#pragma pack()
+
+struct Dict::Image {
+  explicit Image()
+      : data(nullptr),
+        len(0),
+        mask(0),
+        buckets(nullptr),
+        live(0) {
+  }
+
+  ~Image() {
+    if (data) {
+      munmap(const_cast<char*>(data), len);
+    }
+  }
+
+  // record returns the entry at offset, nullptr at the end of a bucket or if the
+  // entry does not lie within the file
+  const ImageRecord* record(uint64_t offset) const {
+    if (offset == 0 || offset % 8 != 0 || offset + sizeof(ImageRecord) > len) {
+      return nullptr;
+    }
+    const ImageRecord* r = (const ImageRecord*) (data + offset);
+    if (offset + sizeof(ImageRecord) + r->key_len + r->value_len > len || r->id >= shadowed.size()) {
+      return nullptr;
+    }
+    return r;
+  }
+
+  // next follows an entry, offsets only grow within a bucket
+  const ImageRecord* next(const ImageRecord* r) const {
+    return r->next > uint64_t((const char*) r - data) ? record(r->next) : nullptr;
+  }
+
+  const ImageRecord* first(uint64_t bucket) const {
+    return record(buckets[bucket & mask]);
+  }
+
+  static size_t record_size(size_t key_len, size_t value_len) {
+    return (sizeof(ImageRecord) + key_len + value_len + 7) & ~size_t(7);
+  }
+
+  static const char* key(const ImageRecord* r) {
+    return (const char*) (r + 1);
+  }
+
+  static const char* value(const ImageRecord* r) {
+    return key(r) + r->key_len;
+  }
+
+  const char* data;
+  size_t len;
+  uint64_t mask;
+  const uint64_t* buckets;
+  std::vector<bool> shadowed; // entries copied to the heap or erased
+  size_t live;                // entries not shadowed
+};
+
+
+static uint64_t reverse_bits(uint64_t v) {
+  v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+  v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+  v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return __builtin_bswap64(v);
+}
+
+// next_cursor increments the reversed cursor, the high bits masked out of it are
+// the buckets a larger table splits this one into
+static uint64_t next_cursor(uint64_t cursor, uint64_t mask) {
+  cursor |= ~mask;
+  cursor = reverse_bits(cursor);
+  ++cursor;
+  return reverse_bits(cursor);
+}
+
+Dict::Dict()
+    : mask_(0),
+      rehash_mask_(0),
+      rehash_index_(0),
+      size_(0) {
+}
+
+Dict::~Dict() {
+  clear();
+}
+
+std::string* Dict::find(const std::string& key, uint64_t hash) {
+  if (buckets_.empty()) {
+    return nullptr;
+  }
+  for (Entry* entry = bucket(hash); entry; entry = entry->next) {
+    if (entry->hash == hash && entry->key == key) {
+      return &entry->value;
+    }
+  }
+  if (image_) {
+    Entry* entry = fault_in(key, hash);
+    return entry ? &entry->value : nullptr;
+  }
+  return nullptr;
+}
+
+const Dict::ImageRecord* Dict::find_image(const std::string& key, uint64_t hash) const {
+  for (const ImageRecord* r = image_->first(hash); r; r = image_->next(r)) {
+    if (r->hash == hash && r->key_len == key.size() && !image_->shadowed[r->id]
+        && memcmp(Image::key(r), key.data(), key.size()) == 0) {
+      return r;
+    }
+  }
+  return nullptr;
+}
+
+Dict::Entry* Dict::fault_in(const std::string& key, uint64_t hash) {
+  const ImageRecord* r = find_image(key, hash);
+  if (!r) {
+    return nullptr;
+  }
+
+  // the entry moves from the image to the heap, the size does not change
+  Entry* entry = new Entry{key, std::string(Image::value(r), r->value_len), hash, nullptr};
+  Entry*& head = bucket(hash);
+  entry->next = head;
+  head = entry;
+  image_->shadowed[r->id] = true;
+  --image_->live;
+  return entry;
+}
+
+std::pair<std::string*, bool> Dict::emplace(std::string key, std::string value) {
+  uint64_t h = hash(key);
+  std::string* exist = find(key, h);
+  if (exist) {
+    return std::make_pair(exist, false);
+  }
+
+  if (!rehashing() && size_ >= buckets_.size()) {
+    start_rehash(std::max(kMinBuckets, buckets_.size() * 2));
+  }
+  if (rehashing()) {
+    rehash_step();
+  }
+
+  Entry* entry = new Entry{std::move(key), std::move(value), h, nullptr};
+  Entry*& head = bucket(h);
+  entry->next = head;
+  head = entry;
+  ++size_;
+  return std::make_pair(&entry->value, true);
+}
+
+bool Dict::erase(const std::string& key) {
+  if (buckets_.empty()) {
+    return false;
+  }
+
+  if (rehashing()) {
+    rehash_step();
+  }
+
+  uint64_t h = hash(key);
+  for (Entry** link = &bucket(h); *link; link = &(*link)->next) {
+    Entry* entry = *link;
+    if (entry->hash == h && entry->key == key) {
+      *link = entry->next;
+      delete entry;
+      --size_;
+      return true;
+    }
+  }
+  const ImageRecord* r = image_ ? find_image(key, h) : nullptr;
+  if (r) {
+    image_->shadowed[r->id] = true;
+    --image_->live;
+    --size_;
+    return true;
+  }
+  return false;
+}
+
+void Dict::clear() {
+  for (std::vector<Entry*>* table : {&buckets_, &rehash_buckets_}) {
+    for (Entry* entry : *table) {
+      while (entry) {
+        Entry* next = entry->next;
+        delete entry;
+        entry = next;
+      }
+    }
+    table->clear();
+    table->shrink_to_fit();
+  }
+  mask_ = 0;
+  rehash_mask_ = 0;
+  rehash_index_ = 0;
+  size_ = 0;
+  image_.reset();
+}
+
+uint64_t Dict::release(uint64_t cursor, size_t count) {
+  // the cursor walks the buckets of the old table, then those of the new one
+  size_t total = buckets_.size() + rehash_buckets_.size();
+  size_t n = 0;
+  for (; cursor < total && (n < count || n == 0); ++cursor) {
+    Entry*& head = cursor < buckets_.size() ? buckets_[cursor] : rehash_buckets_[cursor - buckets_.size()];
+    Entry* entry = head;
+    head = nullptr;
+    while (entry) {
+      Entry* next = entry->next;
+      delete entry;
+      entry = next;
+      --size_;
+      ++n;
+    }
+  }
+  if (cursor < total) {
+    return cursor;
+  }
+  clear();
+  return 0;
+}
+
+void Dict::swap(Dict& other) {
+  buckets_.swap(other.buckets_);
+  std::swap(mask_, other.mask_);
+  rehash_buckets_.swap(other.rehash_buckets_);
+  std::swap(rehash_mask_, other.rehash_mask_);
+  std::swap(rehash_index_, other.rehash_index_);
+  std::swap(size_, other.size_);
+  image_.swap(other.image_);
+}
+
+void Dict::reserve(size_t n) {
+  size_t count = kMinBuckets;
+  while (count < n) {
+    count *= 2;
+  }
+  if (count > bucket_count()) {
+    rehash(count);
+  }
+}
+
+void Dict::rehash(size_t bucket_count) {
+  while (rehashing()) {
+    rehash_step();
+  }
+
+  std::vector<Entry*> buckets(bucket_count, nullptr);
+  uint64_t mask = bucket_count - 1;
+  for (Entry* entry : buckets_) {
+    while (entry) {
+      Entry* next = entry->next;
+      Entry*& head = buckets[entry->hash & mask];
+      entry->next = head;
+      head = entry;
+      entry = next;
+    }
+  }
+  buckets_.swap(buckets);
+  mask_ = mask;
+}
+
+void Dict::start_rehash(size_t bucket_count) {
+  assert(!rehashing() && bucket_count > buckets_.size());
+  rehash_buckets_.assign(bucket_count, nullptr);
+  rehash_mask_ = bucket_count - 1;
+  rehash_index_ = 0;
+}
+
+void Dict::rehash_step() {
+  size_t empty_visits = kRehashEmptyVisits;
+  while (rehash_index_ < buckets_.size()) {
+    Entry* entry = buckets_[rehash_index_];
+    buckets_[rehash_index_++] = nullptr;
+    if (!entry) {
+      if (--empty_visits == 0) {
+        break;
+      }
+      continue;
+    }
+    while (entry) {
+      Entry* next = entry->next;
+      Entry*& head = rehash_buckets_[entry->hash & rehash_mask_];
+      entry->next = head;
+      head = entry;
+      entry = next;
+    }
+    break;
+  }
+
+  if (rehash_index_ == buckets_.size()) {
+    buckets_.swap(rehash_buckets_);
+    mask_ = rehash_mask_;
+    rehash_buckets_.clear();
+    rehash_buckets_.shrink_to_fit();
+    rehash_mask_ = 0;
+    rehash_index_ = 0;
+  }
+}
+
+Dict::Batch::Batch()
+    : mask_(0),
+      shift_(0),
+      size_(0),
+      parts_(1) {
+}
+
+Dict::Batch::~Batch() {
+  for (std::vector<Entry*>& part : parts_) {
+    for (Entry* entry : part) {
+      delete entry;
+    }
+  }
+}
+
+void Dict::Batch::add(std::string key, std::string value) {
+  uint64_t h = hash(key);
+  parts_[(h & mask_) >> shift_].push_back(new Entry{std::move(key), std::move(value), h, nullptr});
+  ++size_;
+}
+
+void Dict::prepare_batch(Batch& batch, size_t parts) const {
+  assert(batch.size_ == 0 && !rehashing());
+  int bits = 0;
+  while ((size_t(2) << bits) <= std::min(parts, buckets_.size())) {
+    ++bits;
+  }
+  int bucket_bits = __builtin_ctzll(std::max<uint64_t>(buckets_.size(), 1));
+
+  batch.mask_ = mask_;
+  batch.shift_ = bucket_bits - bits;
+  batch.parts_.assign(size_t(1) << bits, std::vector<Entry*>());
+}
+
+void Dict::load(std::vector<Batch>& batches) {
+  if (batches.empty()) {
+    return;
+  }
+  assert(!image_ && !rehashing());
+
+  size_t total = 0;
+  for (Batch& batch : batches) {
+    assert(batch.mask_ == mask_ && batch.parts_.size() == batches[0].parts_.size());
+    total += batch.size_;
+  }
+  assert(size_ + total <= buckets_.size());
+
+  // the buckets of a part are only touched by the thread linking it
+  auto link = [this, &batches](size_t part) {
+    for (Batch& batch : batches) {
+      for (Entry* entry : batch.parts_[part]) {
+        Entry*& head = buckets_[entry->hash & mask_];
+        entry->next = head;
+        head = entry;
+      }
+      batch.parts_[part].clear();
+    }
+  };
+
+  size_t parts = batches[0].parts_.size();
+  std::vector<std::thread> threads;
+  for (size_t part = 1; part < parts; ++part) {
+    threads.emplace_back(link, part);
+  }
+  link(0);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  for (Batch& batch : batches) {
+    batch.size_ = 0;
+  }
+  size_ += total;
+}
+
+void Dict::for_each(const ScanCallback& callback) const {
+  for (const std::vector<Entry*>* table : {&buckets_, &rehash_buckets_}) {
+    for (const Entry* entry : *table) {
+      for (; entry; entry = entry->next) {
+        callback(entry->key, entry->value);
+      }
+    }
+  }
+  if (image_) {
+    for_each_image(-1, mask_, callback);
+  }
+}
+
+void Dict::for_each_image(int64_t bucket, uint64_t mask, const ScanCallback& callback) const {
+  // the table has at least as many buckets as the image, a bucket of the image
+  // holds the entries of several buckets of the table
+  uint64_t first = bucket < 0 ? 0 : uint64_t(bucket);
+  uint64_t last = bucket < 0 ? image_->mask : uint64_t(bucket);
+  std::string key;
+  std::string value;
+  for (uint64_t b = first; b <= last; ++b) {
+    for (const ImageRecord* r = image_->first(b); r; r = image_->next(r)) {
+      if (image_->shadowed[r->id] || (bucket >= 0 && (r->hash & mask) != uint64_t(bucket))) {
+        continue;
+      }
+      key.assign(Image::key(r), r->key_len);
+      value.assign(Image::value(r), r->value_len);
+      callback(key, value);
+    }
+  }
+}
+
+size_t Dict::image_size() const {
+  return image_ ? image_->live : 0;
+}
+
+Status Dict::save_image(const std::string& path, RateLimiter* limiter) const {
+  FILE* fp = fopen(path.c_str(), "w");
+  if (!fp) {
+    return Status::io_error(strerror(errno));
+  }
+
+  // the image has the buckets of the new table while the table grows
+  const std::vector<Entry*>& table = rehashing() ? rehash_buckets_ : buckets_;
+  uint64_t bucket_count = std::max(table.size(), kMinBuckets);
+  uint64_t mask = bucket_count - 1;
+  std::vector<uint64_t> buckets(bucket_count, 0);
+  ImageHeader header;
+  memset(&header, 0, sizeof(header));
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  uint64_t offset = sizeof(header);
+  uint64_t limited_offset = 0; // the bytes taken from limiter
+  boost::crc_32_type crc32;
+  auto write = [fp, &crc32](const void* data, size_t len) {
+    crc32.process_bytes(data, len);
+    return fwrite(data, 1, len, fp) == len;
+  };
+
+  // the entries of a bucket, of the heap and of the image
+  struct View {
+    const char* key;
+    uint32_t key_len;
+    const char* value;
+    uint32_t value_len;
+    uint64_t hash;
+  };
+  std::vector<View> chain;
+  static const char padding[8] = {0};
+
+  for (uint64_t b = 0; b < bucket_count && ok; ++b) {
+    chain.clear();
+    for (const Entry* entry = b < table.size() ? table[b] : nullptr; entry; entry = entry->next) {
+      chain.push_back(View{entry->key.data(), uint32_t(entry->key.size()),
+                           entry->value.data(), uint32_t(entry->value.size()), entry->hash});
+    }
+    if (rehashing()) {
+      // the entries of the old table not moved yet
+      for (const Entry* entry = buckets_[b & mask_]; entry; entry = entry->next) {
+        if ((entry->hash & mask) == b) {
+          chain.push_back(View{entry->key.data(), uint32_t(entry->key.size()),
+                               entry->value.data(), uint32_t(entry->value.size()), entry->hash});
+        }
+      }
+    }
+    if (image_) {
+      for (const ImageRecord* r = image_->first(b); r; r = image_->next(r)) {
+        if (!image_->shadowed[r->id] && (r->hash & mask) == b) {
+          chain.push_back(View{Image::key(r), r->key_len, Image::value(r), r->value_len, r->hash});
+        }
+      }
+    }
+
+    for (size_t i = 0; i < chain.size() && ok; ++i) {
+      const View& view = chain[i];
+      size_t size = Image::record_size(view.key_len, view.value_len);
+      if (i == 0) {
+        buckets[b] = offset;
+      }
+
+      ImageRecord record;
+      record.next = i + 1 < chain.size() ? offset + size : 0;
+      record.hash = view.hash;
+      record.id = header.entry_count++;
+      record.key_len = view.key_len;
+      record.value_len = view.value_len;
+      size_t pad = size - sizeof(record) - view.key_len - view.value_len;
+      ok = write(&record, sizeof(record))
+          && write(view.key, view.key_len)
+          && write(view.value, view.value_len)
+          && write(padding, pad);
+      offset += size;
+    }
+    if (limiter && offset - limited_offset >= kImageWriteSize) {
+      limiter->acquire(offset - limited_offset);
+      limited_offset = offset;
+    }
+  }
+
+  header.magic = kImageMagic;
+  header.version = kImageVersion;
+  header.hash_check = hash(kImageHashCheck);
+  header.bucket_count = bucket_count;
+  header.buckets_offset = offset;
+  header.file_len = offset + bucket_count * sizeof(uint64_t);
+  ok = ok && write(buckets.data(), bucket_count * sizeof(uint64_t));
+  header.crc32 = crc32.checksum();
+  ok = ok && fseek(fp, 0, SEEK_SET) == 0
+      && fwrite(&header, sizeof(header), 1, fp) == 1
+      && fflush(fp) == 0
+      && fsync(fileno(fp)) == 0;
+  Status status = ok ? Status::ok() : Status::io_error(strerror(errno));
+  fclose(fp);
+  return status;
+}
+
+Status Dict::load_image(const std::string& path) {
+  assert(empty() && !image_);
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return Status::io_error(strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return Status::io_error(strerror(errno));
+  }
+  if (size_t(st.st_size) < sizeof(ImageHeader)) {
+    ::close(fd);
+    return Status::io_error("truncated image");
+  }
+
+  std::unique_ptr<Image> image(new Image());
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return Status::io_error(strerror(errno));
+  }
+  image->data = (const char*) data;
+  image->len = st.st_size;
+
+  const ImageHeader* header = (const ImageHeader*) data;
+  uint64_t bucket_count = header->bucket_count;
+  if (header->magic != kImageMagic || header->version != kImageVersion) {
+    return Status::io_error("invalid image");
+  }
+  if (header->hash_check != hash(kImageHashCheck)) {
+    return Status::not_supported("image of another hash function");
+  }
+  if (header->file_len != image->len || bucket_count < kMinBuckets || (bucket_count & (bucket_count - 1)) != 0
+      || header->buckets_offset % 8 != 0 || header->buckets_offset + bucket_count * sizeof(uint64_t) != image->len) {
+    return Status::io_error("invalid image");
+  }
+
+  // the whole file is read once to check it, a sequential read that is still far
+  // cheaper than decoding the keys, then lookups fault in the pages of the entries
+  // they walk, in no particular order
+  madvise(data, image->len, MADV_SEQUENTIAL);
+  boost::crc_32_type crc32;
+  crc32.process_bytes(image->data + sizeof(ImageHeader), image->len - sizeof(ImageHeader));
+  if (crc32.checksum() != header->crc32) {
+    return Status::io_error("image crc mismatch");
+  }
+  madvise(data, image->len, MADV_RANDOM);
+  image->mask = bucket_count - 1;
+  image->buckets = (const uint64_t*) (image->data + header->buckets_offset);
+  image->shadowed.assign(header->entry_count, false);
+  image->live = header->entry_count;
+
+  rehash(bucket_count);
+  size_ = header->entry_count;
+  image_ = std::move(image);
+  return Status::ok();
+}
+
+uint64_t Dict::scan(uint64_t cursor, size_t count, const ScanCallback& callback) const {
+  if (size_ == 0) {
+    return 0;
+  }
+
+  // bounds the buckets visited by a call on a sparse table
+  size_t empty_visits = count * 10;
+  size_t visited = 0;
+  auto visit = [&callback, &visited, &empty_visits](const Entry* entry) {
+    if (!entry && empty_visits > 0) {
+      --empty_visits;
+    }
+    for (; entry; entry = entry->next) {
+      callback(entry->key, entry->value);
+      ++visited;
+    }
+  };
+  auto visit_image = [this, &callback, &visited](uint64_t bucket, uint64_t mask) {
+    // an entry of the image is visited with the bucket of the table it moves to
+    for_each_image(int64_t(bucket), mask, [&callback, &visited](const std::string& key, const std::string& value) {
+      callback(key, value);
+      ++visited;
+    });
+  };
+
+  do {
+    visit(buckets_[cursor & mask_]);
+    if (image_) {
+      visit_image(cursor & mask_, mask_);
+    }
+    if (!rehashing()) {
+      cursor = next_cursor(cursor, mask_);
+      continue;
+    }
+
+    // while the table grows, the bucket of the old table is followed by every
+    // bucket of the new table it expands to
+    uint64_t mask = rehash_mask_;
+    do {
+      visit(rehash_buckets_[cursor & mask]);
+      cursor = next_cursor(cursor, mask);
+    } while (cursor & (mask_ ^ mask));
+  } while (cursor != 0 && visited < count && empty_visits > 0);
+  return cursor;
+}
+
+}
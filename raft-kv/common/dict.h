@@ -0,0 +1,218 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <stdint.h>
+#include <raft-kv/common/status.h>
+#include <raft-kv/common/rate_limiter.h>
+
+namespace kv {
+
+// Dict is a chained hash table of string keys and values. The number of buckets is
+// always a power of two, which lets scan walk it with a reverse binary cursor that
+// stays valid when the table grows between two calls, see redis dictScan.
+//
+// The table grows incrementally as in redis: a larger table is allocated and each
+// following modification moves a bucket of the old table to it, so that no single
+// insertion rehashes the whole table. A bucket of the old table already moved is
+// looked up in the new table instead.
+//
+// A table can also be backed by an image, a file holding the table itself with
+// offsets instead of pointers, which is mapped into memory instead of being
+// decoded, see load_image. The entries of the image are copied to the heap the
+// first time they are looked up or modified and hidden in the image from then on,
+// so a lookup may modify the table and needs the same locking as a modification.
+class Dict {
+  struct Entry;
+  struct Image;
+  struct ImageRecord;
+
+ public:
+  typedef std::function<void(const std::string& key, const std::string& value)> ScanCallback;
+
+  // Batch holds entries created outside of the table, grouped by the part of the
+  // buckets they belong to, so that several threads can fill a table, see load
+  class Batch {
+   public:
+    explicit Batch();
+
+    ~Batch();
+
+    Batch(Batch&& other) = default;
+
+    Batch(const Batch&) = delete;
+
+    Batch& operator=(const Batch&) = delete;
+
+    void add(std::string key, std::string value);
+
+    size_t size() const {
+      return size_;
+    }
+
+   private:
+    friend class Dict;
+    uint64_t mask_;
+    int shift_;
+    size_t size_;
+    std::vector<std::vector<Entry*>> parts_;
+  };
+
+  explicit Dict();
+
+  ~Dict();
+
+  Dict(const Dict&) = delete;
+
+  Dict& operator=(const Dict&) = delete;
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  // bucket_count returns the number of buckets, of the new table while it grows
+  size_t bucket_count() const {
+    return rehashing() ? rehash_buckets_.size() : buckets_.size();
+  }
+
+  bool rehashing() const {
+    return !rehash_buckets_.empty();
+  }
+
+  static uint64_t hash(const std::string& key) {
+    return std::hash<std::string>()(key);
+  }
+
+  // find returns the value of key, nullptr if it does not exist. An entry of the
+  // image is copied to the heap.
+  std::string* find(const std::string& key) {
+    return find(key, hash(key));
+  }
+
+  const std::string* find(const std::string& key) const {
+    return const_cast<Dict*>(this)->find(key, hash(key));
+  }
+
+  std::string* find(const std::string& key, uint64_t hash);
+
+  // prefetch loads the bucket of hash into the cache
+  void prefetch_bucket(uint64_t hash) const {
+    if (!buckets_.empty()) {
+      __builtin_prefetch(&bucket(hash));
+    }
+  }
+
+  // prefetch loads the first entry of the bucket of hash into the cache
+  void prefetch_entry(uint64_t hash) const {
+    if (!buckets_.empty() && bucket(hash)) {
+      __builtin_prefetch(bucket(hash));
+    }
+  }
+
+  // emplace inserts key if it does not exist, returns its value and whether it was inserted
+  std::pair<std::string*, bool> emplace(std::string key, std::string value);
+
+  std::string& operator[](std::string key) {
+    return *emplace(std::move(key), std::string()).first;
+  }
+
+  // erase removes key, returns false if it does not exist
+  bool erase(const std::string& key);
+
+  void clear();
+
+  // release frees the entries of the buckets starting at cursor until at least
+  // count entries were freed, returns the cursor of the next call, 0 once the table
+  // is empty. It clears a large table in steps, the table stays valid in between.
+  uint64_t release(uint64_t cursor, size_t count);
+
+  void swap(Dict& other);
+
+  // reserve grows the table to hold n entries without rehashing, the entries
+  // already in the table are moved at once
+  void reserve(size_t n);
+
+  // prepare_batch groups the entries later added to batch into parts ranges of the
+  // buckets, parts is rounded down to a power of two. The table must already be
+  // reserved for all the entries to load.
+  void prepare_batch(Batch& batch, size_t parts) const;
+
+  // load moves the entries of batches into the table, each part of the buckets is
+  // linked by its own thread. The keys must be distinct and must not exist in the
+  // table, which must not have an image.
+  void load(std::vector<Batch>& batches);
+
+  // save_image writes the table as an image to path and syncs it, at the rate of
+  // limiter if not null
+  Status save_image(const std::string& path, RateLimiter* limiter = nullptr) const;
+
+  // load_image maps the image at path into the empty table, its entries are read
+  // from the file as they are used. The crc32 of the file is checked first.
+  Status load_image(const std::string& path);
+
+  // image_size returns the number of entries still read from the image
+  size_t image_size() const;
+
+  void for_each(const ScanCallback& callback) const;
+
+  // scan visits the buckets starting at cursor until at least count entries were
+  // visited, returns the cursor of the next call, 0 when the iteration is complete.
+  // Every entry that exists during the whole iteration is visited at least once.
+  uint64_t scan(uint64_t cursor, size_t count, const ScanCallback& callback) const;
+
+ private:
+  struct Entry {
+    std::string key;
+    std::string value;
+    uint64_t hash;
+    Entry* next;
+  };
+
+  // bucket returns the head of the bucket of hash, in the new table once the
+  // bucket of the old one was moved
+  Entry*& bucket(uint64_t hash) {
+    if (rehashing() && (hash & mask_) < rehash_index_) {
+      return rehash_buckets_[hash & rehash_mask_];
+    }
+    return buckets_[hash & mask_];
+  }
+
+  Entry* const& bucket(uint64_t hash) const {
+    return const_cast<Dict*>(this)->bucket(hash);
+  }
+
+  // rehash moves every entry to a table of bucket_count buckets at once
+  void rehash(size_t bucket_count);
+
+  // start_rehash allocates the table of bucket_count buckets the entries move to
+  void start_rehash(size_t bucket_count);
+
+  // rehash_step moves the next bucket of the old table to the new one, or skips a
+  // few empty ones, and replaces the old table once it is empty
+  void rehash_step();
+
+  // find_image returns the entry of the image matching key if it is not shadowed
+  const ImageRecord* find_image(const std::string& key, uint64_t hash) const;
+
+  // fault_in copies the entry of the image matching key to the heap
+  Entry* fault_in(const std::string& key, uint64_t hash);
+
+  // for_each_image calls callback with the entries of the image of the bucket of
+  // the table of mask, all of them if bucket is -1
+  void for_each_image(int64_t bucket, uint64_t mask, const ScanCallback& callback) const;
+
+  std::vector<Entry*> buckets_;
+  uint64_t mask_;
+  std::vector<Entry*> rehash_buckets_; // the table the entries move to while growing
+  uint64_t rehash_mask_;
+  uint64_t rehash_index_;              // the buckets of buckets_ before it were moved
+  size_t size_; // of the heap and the image
+  std::unique_ptr<Image> image_;
+};
+
+}
@@ -0,0 +1,355 @@
+#include <raft-kv/common/glob.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+
+namespace kv {
+
+// see redis keys command
+int string_match_len(const char* pattern, int patternLen,
+                     const char* string, int stringLen, int nocase) {
+  while (patternLen && stringLen) {
+    switch (pattern[0]) {
+      case '*':
+        while (pattern[1] == '*') {
+          pattern++;
+          patternLen--;
+        }
+        if (patternLen == 1)
+          return 1; /* match */
+        while (stringLen) {
+          if (string_match_len(pattern + 1, patternLen - 1,
+                               string, stringLen, nocase))
+            return 1; /* match */
+          string++;
+          stringLen--;
+        }
+        return 0; /* no match */
+        break;
+      case '?':
+        if (stringLen == 0)
+          return 0; /* no match */
+        string++;
+        stringLen--;
+        break;
+      case '[': {
+        int not_match, match;
+
+        pattern++;
+        patternLen--;
+        not_match = pattern[0] == '^';
+        if (not_match) {
+          pattern++;
+          patternLen--;
+        }
+        match = 0;
+        while (1) {
+          if (pattern[0] == '\\' && patternLen >= 2) {
+            pattern++;
+            patternLen--;
+            if (pattern[0] == string[0])
+              match = 1;
+          } else if (pattern[0] == ']') {
+            break;
+          } else if (patternLen == 0) {
+            pattern--;
+            patternLen++;
+            break;
+          } else if (pattern[1] == '-' && patternLen >= 3) {
+            int start = pattern[0];
+            int end = pattern[2];
+            int c = string[0];
+            if (start > end) {
+              int t = start;
+              start = end;
+              end = t;
+            }
+            if (nocase) {
+              start = tolower(start);
+              end = tolower(end);
+              c = tolower(c);
+            }
+            pattern += 2;
+            patternLen -= 2;
+            if (c >= start && c <= end)
+              match = 1;
+          } else {
+            if (!nocase) {
+              if (pattern[0] == string[0])
+                match = 1;
+            } else {
+              if (tolower((int) pattern[0]) == tolower((int) string[0]))
+                match = 1;
+            }
+          }
+          pattern++;
+          patternLen--;
+        }
+        if (not_match)
+          match = !match;
+        if (!match)
+          return 0; /* no match */
+        string++;
+        stringLen--;
+        break;
+      }
+      case '\\':
+        if (patternLen >= 2) {
+          pattern++;
+          patternLen--;
+        }
+        /* fall through */
+      default:
+        if (!nocase) {
+          if (pattern[0] != string[0])
+            return 0; /* no match */
+        } else {
+          if (tolower((int) pattern[0]) != tolower((int) string[0]))
+            return 0; /* no match */
+        }
+        string++;
+        stringLen--;
+        break;
+    }
+    pattern++;
+    patternLen--;
+    if (stringLen == 0) {
+      while (*pattern == '*') {
+        pattern++;
+        patternLen--;
+      }
+      break;
+    }
+  }
+  if (patternLen == 0 && stringLen == 0)
+    return 1;
+  return 0;
+}
+
+// byte_equal is the comparison string_match_len makes between a pattern byte and a string byte
+static bool byte_equal(char p, char c, bool nocase) {
+  if (!nocase) {
+    return p == c;
+  }
+  return tolower((int) p) == tolower((int) c);
+}
+
+GlobMatcher::GlobMatcher(const char* pattern, int len, bool nocase)
+    : empty_(len == 0),
+      star_(false),
+      min_len_(0) {
+  add_segment();
+
+  // the parsing follows string_match_len step by step
+  while (len > 0) {
+    std::bitset<256> bytes;
+    switch (pattern[0]) {
+      case '*': {
+        while (len > 1 && pattern[1] == '*') {
+          pattern++;
+          len--;
+        }
+        star_ = true;
+        add_segment();
+        pattern++;
+        len--;
+        continue;
+      }
+      case '?': {
+        bytes.set();
+        break;
+      }
+      case '[': {
+        pattern++;
+        len--;
+        bool not_match = len > 0 && pattern[0] == '^';
+        if (not_match) {
+          pattern++;
+          len--;
+        }
+
+        const char* items = pattern;
+        int items_len = len;
+        while (true) {
+          if (pattern[0] == '\\' && len >= 2) {
+            pattern++;
+            len--;
+          } else if (len == 0) {
+            pattern--;
+            len++;
+            break;
+          } else if (pattern[0] == ']') {
+            break;
+          } else if (pattern[1] == '-' && len >= 3) {
+            pattern += 2;
+            len -= 2;
+          }
+          pattern++;
+          len--;
+        }
+
+        // evaluates the class against every byte
+        for (int b = 0; b < 256; ++b) {
+          char c = static_cast<char>(b);
+          bool match = false;
+          const char* p = items;
+          int n = items_len;
+          while (true) {
+            if (p[0] == '\\' && n >= 2) {
+              p++;
+              n--;
+              if (p[0] == c) {
+                match = true;
+              }
+            } else if (n == 0 || p[0] == ']') {
+              break;
+            } else if (p[1] == '-' && n >= 3) {
+              int start = p[0];
+              int end = p[2];
+              int x = c;
+              if (start > end) {
+                std::swap(start, end);
+              }
+              if (nocase) {
+                start = tolower(start);
+                end = tolower(end);
+                x = tolower(x);
+              }
+              p += 2;
+              n -= 2;
+              if (x >= start && x <= end) {
+                match = true;
+              }
+            } else if (byte_equal(p[0], c, nocase)) {
+              match = true;
+            }
+            p++;
+            n--;
+          }
+          bytes.set(b, match != not_match);
+        }
+        break;
+      }
+      case '\\': {
+        if (len >= 2) {
+          pattern++;
+          len--;
+        }
+      }
+        /* fall through */
+      default: {
+        for (int b = 0; b < 256; ++b) {
+          bytes.set(b, byte_equal(pattern[0], static_cast<char>(b), nocase));
+        }
+      }
+    }
+
+    Segment& segment = segments_.back();
+    if (bytes.count() == 1) {
+      uint8_t byte = 0;
+      while (!bytes.test(byte)) {
+        ++byte;
+      }
+      if (segment.anchor < 0) {
+        segment.anchor = static_cast<int>(segment.size());
+        segment.anchor_byte = byte;
+      }
+      segment.literal.push_back(static_cast<char>(byte));
+      if (!star_ && segment.literal.size() == segment.size() + 1) {
+        prefix_.push_back(static_cast<char>(byte));
+      }
+    }
+    segment.bytes.push_back(bytes);
+    ++min_len_;
+    pattern++;
+    len--;
+  }
+
+  for (Segment& segment : segments_) {
+    if (segment.literal.size() != segment.size()) {
+      segment.literal.clear();
+    }
+  }
+}
+
+void GlobMatcher::add_segment() {
+  segments_.emplace_back();
+  segments_.back().anchor = -1;
+  segments_.back().anchor_byte = 0;
+}
+
+bool GlobMatcher::match_at(const Segment& segment, const char* str) {
+  if (!segment.literal.empty()) {
+    return memcmp(segment.literal.data(), str, segment.literal.size()) == 0;
+  }
+  for (size_t i = 0; i < segment.size(); ++i) {
+    if (!segment.bytes[i].test(static_cast<uint8_t>(str[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+const char* GlobMatcher::search(const Segment& segment, const char* begin, const char* end) {
+  size_t size = segment.size();
+  if (static_cast<size_t>(end - begin) < size) {
+    return nullptr;
+  }
+  if (size == 0) {
+    return begin;
+  }
+
+  if (!segment.literal.empty()) {
+    return (const char*) memmem(begin, end - begin, segment.literal.data(), size);
+  }
+
+  const char* last = end - size;
+  for (const char* p = begin; p <= last; ++p) {
+    if (segment.anchor >= 0) {
+      // skips to the next occurrence of the byte at the anchor position
+      const char* found = (const char*) memchr(p + segment.anchor, segment.anchor_byte, last - p + 1);
+      if (!found) {
+        return nullptr;
+      }
+      p = found - segment.anchor;
+    }
+    if (match_at(segment, p)) {
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+bool GlobMatcher::match(const char* str, size_t len) const {
+  if (len == 0) {
+    // string_match_len only matches the empty string with the empty pattern
+    return empty_;
+  }
+
+  if (!star_) {
+    return len == min_len_ && match_at(segments_[0], str);
+  }
+
+  if (len < min_len_) {
+    return false;
+  }
+
+  const Segment& first = segments_.front();
+  const Segment& last = segments_.back();
+  if (!match_at(first, str) || !match_at(last, str + len - last.size())) {
+    return false;
+  }
+
+  const char* p = str + first.size();
+  const char* end = str + len - last.size();
+  for (size_t i = 1; i + 1 < segments_.size(); ++i) {
+    p = search(segments_[i], p, end);
+    if (!p) {
+      return false;
+    }
+    p += segments_[i].size();
+  }
+  return true;
+}
+
+}
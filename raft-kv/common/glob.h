@@ -0,0 +1,63 @@
+#pragma once
+#include <bitset>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace kv {
+
+// see redis stringmatchlen, interprets the pattern for every string it matches
+int string_match_len(const char* pattern, int patternLen,
+                     const char* string, int stringLen, int nocase);
+
+// GlobMatcher is a pattern compiled once to be matched against many strings, with
+// the semantics of string_match_len. The pattern is split at '*' into segments of
+// single byte matchers, the first segment is anchored at the start of the string,
+// the last one at its end and the ones in between are searched leftmost first, so
+// matching never backtracks. Literal segments are compared with memcmp and searched
+// with memmem.
+class GlobMatcher {
+ public:
+  explicit GlobMatcher(const char* pattern, int len, bool nocase = false);
+
+  explicit GlobMatcher(const std::string& pattern, bool nocase = false)
+      : GlobMatcher(pattern.data(), static_cast<int>(pattern.size()), nocase) {
+  }
+
+  bool match(const char* str, size_t len) const;
+
+  bool match(const std::string& str) const {
+    return match(str.data(), str.size());
+  }
+
+  // prefix returns the literal bytes every matching string starts with
+  const std::string& prefix() const {
+    return prefix_;
+  }
+
+ private:
+  struct Segment {
+    std::vector<std::bitset<256>> bytes; // the bytes each position matches
+    std::string literal;                 // the bytes to search if every position matches a single one
+    int anchor;                          // the first position matching a single byte, -1 if none
+    uint8_t anchor_byte;
+
+    size_t size() const {
+      return bytes.size();
+    }
+  };
+
+  void add_segment();
+
+  static bool match_at(const Segment& segment, const char* str);
+
+  static const char* search(const Segment& segment, const char* begin, const char* end);
+
+  bool empty_;                   // the pattern is empty
+  bool star_;                    // the pattern has at least one '*'
+  size_t min_len_;               // the length of the shortest matching string
+  std::vector<Segment> segments_;
+  std::string prefix_;
+};
+
+}
@@ -0,0 +1,39 @@
+#include <raft-kv/common/rate_limiter.h>
+#include <algorithm>
+#include <thread>
+
+namespace kv {
+
+RateLimiter::RateLimiter(uint64_t rate)
+    : rate_(rate),
+      tokens_(static_cast<double>(rate)),
+      last_(Clock::now()) {
+}
+
+uint64_t RateLimiter::reserve(uint64_t n) {
+  if (rate_ == 0) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  Clock::time_point now = Clock::now();
+  double elapsed = std::chrono::duration<double>(now - last_).count();
+  last_ = now;
+
+  double rate = static_cast<double>(rate_);
+  tokens_ = std::min(tokens_ + elapsed * rate, rate);
+  tokens_ -= static_cast<double>(n);
+  if (tokens_ >= 0) {
+    return 0;
+  }
+  return static_cast<uint64_t>(-tokens_ * 1000000 / rate);
+}
+
+void RateLimiter::acquire(uint64_t n) {
+  uint64_t wait = reserve(n);
+  if (wait > 0) {
+    std::this_thread::sleep_for(std::chrono::microseconds(wait));
+  }
+}
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+#include <mutex>
+#include <chrono>
+
+namespace kv {
+
+// RateLimiter is a token bucket of bytes, refilled at rate bytes a second and
+// holding at most a second of them. A reservation takes its bytes even if the
+// bucket runs dry, the caller waits for the debt to be repaid, so a large write
+// is never starved by smaller ones. A rate of 0 is unlimited.
+class RateLimiter {
+ public:
+  explicit RateLimiter(uint64_t rate);
+
+  uint64_t rate() const {
+    return rate_;
+  }
+
+  // reserve takes n bytes, returns the microseconds to wait before using them
+  uint64_t reserve(uint64_t n);
+
+  // acquire takes n bytes and sleeps until they may be used
+  void acquire(uint64_t n);
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  std::mutex mutex_;
+  uint64_t rate_;
+  double tokens_;
+  Clock::time_point last_;
+};
+
+}
@@ -7,12 +7,30 @@
 static uint64_t g_id = 0;
 static const char* g_cluster = NULL;
 static uint16_t g_port = 0;
+static const char* g_redirect = NULL;
+static gboolean g_ordered_index = false;
+static gboolean g_snapshot_image = false;
+static const char* g_snapshot_policy = NULL;
+static const char* g_restore = NULL;
+static const char* g_backup_dir = NULL;
 
 int main(int argc, char* argv[]) {
   GOptionEntry entries[] = {
       {"id", 'i', 0, G_OPTION_ARG_INT64, &g_id, "node id", NULL},
       {"cluster", 'c', 0, G_OPTION_ARG_STRING, &g_cluster, "comma separated cluster peers", NULL},
       {"port", 'p', 0, G_OPTION_ARG_INT, &g_port, "key-value server port", NULL},
+      {"redirect", 'r', 0, G_OPTION_ARG_STRING, &g_redirect,
+       "redirect writes on followers to the leader, comma separated key-value server address of the peers", NULL},
+      {"ordered-index", 'o', 0, G_OPTION_ARG_NONE, &g_ordered_index,
+       "keep an ordered index of the keys for prefix and range queries", NULL},
+      {"snapshot-image", 'm', 0, G_OPTION_ARG_NONE, &g_snapshot_image,
+       "write an image of the key space with full snapshots, mapped instead of decoded on restart", NULL},
+      {"snapshot-policy", 's', 0, G_OPTION_ARG_STRING, &g_snapshot_policy,
+       "bounds of the snapshot policy, comma separated name=value such as max_entries=100000,max_log_bytes=64m", NULL},
+      {"restore", 0, 0, G_OPTION_ARG_STRING, &g_restore,
+       "seed the empty directory of the member with a backup and exit", NULL},
+      {"backup-dir", 0, 0, G_OPTION_ARG_STRING, &g_backup_dir,
+       "directory BACKUP writes to and IMPORT reads from, node_<id>/backup by default", NULL},
       {NULL}
   };
 
@@ -25,6 +43,16 @@ int main(int argc, char* argv[]) {
   }
   fprintf(stderr, "id:%lu, port:%d, cluster:%s\n", g_id, g_port, g_cluster);
 
+  if (g_id != 0 && g_restore) {
+    kv::Status status = kv::RaftNode::restore(g_id, g_restore);
+    if (!status.is_ok()) {
+      fprintf(stderr, "restore %s error: %s\n", g_restore, status.to_string().c_str());
+      exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "restored %s\n", g_restore);
+    exit(EXIT_SUCCESS);
+  }
+
   if (g_id == 0 || g_port == 0) {
     char* help = g_option_context_get_help(context, true, NULL);
     fprintf(stderr, help);
@@ -32,6 +60,22 @@ int main(int argc, char* argv[]) {
     exit(EXIT_FAILURE);
   }
 
-  kv::RaftNode::main(g_id, g_cluster, g_port);
+  kv::SnapshotPolicy snapshot_policy;
+  if (g_snapshot_policy) {
+    kv::Status status = snapshot_policy.parse(g_snapshot_policy);
+    if (!status.is_ok()) {
+      fprintf(stderr, "invalid snapshot policy: %s\n", status.to_string().c_str());
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  kv::RaftNode::main(g_id,
+                     g_cluster,
+                     g_port,
+                     g_redirect ? g_redirect : "",
+                     g_ordered_index,
+                     g_snapshot_image,
+                     snapshot_policy,
+                     g_backup_dir ? g_backup_dir : "");
   g_option_context_free(context);
 }
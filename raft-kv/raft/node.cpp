@@ -239,8 +239,23 @@ Status RawNode::read_index(std::vector<uint8_t> rctx) {
 }
 
 RaftStatusPtr RawNode::raft_status() {
-  LOG_DEBUG("no impl yet");
-  return nullptr;
+  RaftStatusPtr status(new RaftStatus());
+  status->id = raft_->id_;
+  status->lead = raft_->lead_;
+  status->raft_state = raft_->state_;
+  status->committed = raft_->raft_log_->committed_;
+  status->applied = raft_->raft_log_->applied_;
+  if (raft_->state_ == RaftState::Leader) {
+    raft_->for_each_progress([this, &status](uint64_t id, ProgressPtr& pr) {
+      if (id != raft_->id_) {
+        FollowerStatus& follower = status->progress[id];
+        follower.match = pr->match;
+        follower.state = pr->state;
+        follower.recent_active = pr->recent_active;
+      }
+    });
+  }
+  return status;
 }
 
 void RawNode::report_unreachable(uint64_t id) {
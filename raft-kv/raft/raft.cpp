@@ -879,7 +879,7 @@ void Raft::restore_node(const std::vector<uint64_t>& nodes, bool is_learner) {
       is_learner_ = is_learner;
     }
     set_progress(node, match, next, is_learner);
-    LOG_INFO("%lu restored progress of %lu [%s]", id_, node, get_progress(id_)->string().c_str());
+    LOG_INFO("%lu restored progress of %lu [%s]", id_, node, get_progress(node)->string().c_str());
   }
 }
 
@@ -1496,6 +1496,8 @@ bool Raft::check_quorum_active() {
     if (pr->recent_active && !pr->is_learner) {
       act++;
     }
+    // a follower is recently active again once it is heard of before the next check
+    pr->recent_active = false;
   });
 
   return act >= quorum();
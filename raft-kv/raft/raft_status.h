@@ -1,11 +1,27 @@
 #pragma once
+#include <unordered_map>
 #include <raft-kv/raft/proto.h>
+#include <raft-kv/raft/ready.h>
+#include <raft-kv/raft/progress.h>
 
 namespace kv {
 
+// FollowerStatus is the progress of a follower seen by the leader
+struct FollowerStatus {
+  uint64_t match;
+  ProgressState state;
+  bool recent_active;
+};
+
 struct RaftStatus {
   uint64_t id;
+  uint64_t lead;
+  RaftState raft_state;
+  uint64_t committed;
+  uint64_t applied;
 
+  // progress of every other member, only known by the leader
+  std::unordered_map<uint64_t, FollowerStatus> progress;
 };
 typedef std::shared_ptr<RaftStatus> RaftStatusPtr;
 
@@ -101,6 +101,28 @@ Status MemoryStorage::compact(uint64_t compact_index) {
   return Status::ok();
 }
 
+Status MemoryStorage::retained_index(uint64_t last, uint64_t max_bytes, uint64_t& index) {
+  std::lock_guard<std::mutex> guard(mutex_);
+
+  uint64_t offset = entries_[0]->index;
+  uint64_t last_idx;
+  this->last_index_impl(last_idx);
+  if (last <= offset || last > last_idx) {
+    return Status::invalid_argument("requested index is unavailable");
+  }
+
+  uint64_t bytes = 0;
+  index = last + 1;
+  for (uint64_t i = last; i > offset; --i) {
+    bytes += entries_[i - offset]->payload_size();
+    if (bytes > max_bytes) {
+      break;
+    }
+    index = i;
+  }
+  return Status::ok();
+}
+
 Status MemoryStorage::append(std::vector<proto::EntryPtr> entries) {
   if (entries.empty()) {
     return Status::ok();
@@ -79,6 +79,11 @@ class MemoryStorage : public Storage {
   // greater than raftLog.applied.
   Status compact(uint64_t compact_index);
 
+  // retained_index returns the first index such that the payloads of the entries
+  // from it up to last hold at most max_bytes, last + 1 if the entry at last does
+  // not fit alone.
+  Status retained_index(uint64_t last, uint64_t max_bytes, uint64_t& index);
+
   // append the new entries to storage.
   Status append(std::vector<proto::EntryPtr> entries);
 
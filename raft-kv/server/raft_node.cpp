@@ -1,39 +1,87 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include <future>
+#include <chrono>
+#include <stdio.h>
+#include <unistd.h>
 #include <raft-kv/server/raft_node.h>
 #include <raft-kv/common/log.h>
+#include <raft-kv/snap/snapshot_file.h>
 
 namespace kv {
 
-static uint64_t defaultSnapCount = 100000;
-static uint64_t snapshotCatchUpEntriesN = 100000;
+// the number of delta snapshots taken before the next full one, bounds the files
+// to load at startup and to send to a follower
+static int maxSnapshotDeltas = 8;
 
-RaftNode::RaftNode(uint64_t id, const std::string& cluster, uint16_t port)
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::string snap_dir(uint64_t id) {
+  return "node_" + std::to_string(id) + "/snap";
+}
+
+static std::string wal_dir(uint64_t id) {
+  return "node_" + std::to_string(id) + "/wal";
+}
+
+RaftNode::RaftNode(uint64_t id,
+                   const std::string& cluster,
+                   uint16_t port,
+                   const std::string& redirect,
+                   bool ordered_index,
+                   bool snapshot_image,
+                   const SnapshotPolicy& snapshot_policy,
+                   const std::string& backup_dir)
     : port_(port),
       pthread_id_(0),
       timer_(io_service_),
       id_(id),
+      lead_(0),
+      ordered_index_(ordered_index),
       last_index_(0),
       conf_state_(new proto::ConfState()),
       snapshot_index_(0),
       applied_index_(0),
       storage_(new MemoryStorage()),
-      snap_count_(defaultSnapCount) {
+      snapshot_image_(snapshot_image),
+      snapshot_policy_(snapshot_policy),
+      applied_bytes_(0),
+      snapshot_wal_size_(0),
+      rss_bytes_(0),
+      ticks_(0),
+      snapshot_in_progress_(false),
+      snapshot_deltas_(-1),
+      checkpoint_index_(0),
+      checkpoint_in_progress_(false),
+      start_time_(std::chrono::steady_clock::now()) {
   boost::split(peers_, cluster, boost::is_any_of(","));
   if (peers_.empty()) {
     LOG_FATAL("invalid args %s", cluster.c_str());
   }
 
-  std::string work_dir = "node_" + std::to_string(id);
-  snap_dir_ = work_dir + "/snap";
-  wal_dir_ = work_dir + "/wal";
+  if (!redirect.empty()) {
+    boost::split(redirect_peers_, redirect, boost::is_any_of(","));
+    if (redirect_peers_.size() != peers_.size()) {
+      LOG_FATAL("invalid redirect args %s", redirect.c_str());
+    }
+  }
+
+  snap_dir_ = snap_dir(id);
+  wal_dir_ = wal_dir(id);
+  backup_dir_ = backup_dir.empty() ? "node_" + std::to_string(id) + "/backup" : backup_dir;
 
   if (!boost::filesystem::exists(snap_dir_)) {
     boost::filesystem::create_directories(snap_dir_);
   }
 
   snapshotter_.reset(new Snapshotter(snap_dir_));
+  // the transport is not started yet, what was received before a restart is not installed
+  snapshotter_->purge_received(UINT64_MAX);
+
+  // messages received during the replay wait in io_service_ until schedule runs it
+  start_transport();
 
   bool wal_exists = boost::filesystem::exists(wal_dir_);
 
@@ -44,7 +92,8 @@ RaftNode::RaftNode(uint64_t id, const std::string& cluster, uint16_t port)
   c.election_tick = 10;
   c.heartbeat_tick = 1;
   c.storage = storage_;
-  c.applied = 0;
+  // the entries up to the checkpoint are already in the store
+  c.applied = checkpoint_index_;
   c.max_size_per_msg = 1024 * 1024;
   c.max_committed_size_per_ready = 0;
   c.max_uncommitted_entries_size = 1 << 30;
@@ -88,6 +137,10 @@ void RaftNode::start_timer() {
     }
 
     this->start_timer();
+    // the memory is sampled once a second, for the snapshot policy
+    if (this->snapshot_policy_.max_rss_bytes > 0 && this->ticks_++ % 10 == 0) {
+      this->sample_rss();
+    }
     this->node_->tick();
     this->pull_ready_events();
   });
@@ -102,6 +155,10 @@ void RaftNode::pull_ready_events() {
       return;
     }
 
+    if (rd->soft_state) {
+      lead_ = rd->soft_state->lead;
+    }
+
     wal_->save(rd->hard_state, rd->entries);
 
     if (!rd->snapshot.is_empty()) {
@@ -109,7 +166,10 @@ void RaftNode::pull_ready_events() {
       if (!status.is_ok()) {
         LOG_FATAL("save snapshot error %s", status.to_string().c_str());
       }
-      storage_->apply_snapshot(rd->snapshot);
+      // the data stays in the snapshot file only
+      proto::Snapshot snapshot;
+      snapshot.metadata = rd->snapshot.metadata;
+      storage_->apply_snapshot(snapshot);
       publish_snapshot(rd->snapshot);
     }
 
@@ -128,6 +188,7 @@ void RaftNode::pull_ready_events() {
       }
     }
     maybe_trigger_snapshot();
+    maybe_checkpoint();
     node_->advance(rd);
   }
 }
@@ -147,7 +208,12 @@ Status RaftNode::save_snap(const proto::Snapshot& snap) {
     return status;
   }
 
-  status = snapshotter_->save_snap(snap);
+  if (snap.data.empty()) {
+    // streamed from the leader by the transport, see received_snapshot_path
+    status = snapshotter_->install_received(received_snapshot_path(snap.metadata));
+  } else {
+    status = snapshotter_->save_snap(snap);
+  }
   if (!status.is_ok()) {
     LOG_FATAL("save snapshot error %s", status.to_string().c_str());
   }
@@ -170,13 +236,21 @@ void RaftNode::publish_snapshot(const proto::Snapshot& snap) {
   //trigger to load snapshot
   proto::SnapshotPtr snapshot(new proto::Snapshot());
   snapshot->metadata = snap.metadata;
-  SnapshotDataPtr data(new std::vector<uint8_t>(snap.data));
+  std::vector<std::string> paths;
+  Status status = snapshotter_->files(snap.metadata, paths);
+  if (!status.is_ok()) {
+    LOG_FATAL("snapshot files error %s", status.to_string().c_str());
+  }
 
   *(this->conf_state_) = snapshot->metadata.conf_state;
   snapshot_index_ = snapshot->metadata.index;
   applied_index_ = snapshot->metadata.index;
+  applied_bytes_ = 0;
+  snapshot_wal_size_ = wal_->size();
+  // the next snapshot of the store can not be a delta of a received one
+  snapshot_deltas_ = -1;
 
-  redis_server_->recover_from_snapshot(data, [snapshot, this](const Status& status) {
+  redis_server_->recover_from_snapshot(paths, snapshot->metadata.index, [snapshot, this](const Status& status) {
     //由redis线程回调
     if (!status.is_ok()) {
       LOG_FATAL("recover from snapshot error %s", status.to_string().c_str());
@@ -201,11 +275,44 @@ void RaftNode::open_WAL(const proto::Snapshot& snap) {
   wal_ = WAL::open(wal_dir_, walsnap);
 }
 
+void RaftNode::start_transport() {
+  transport_ = Transport::create(this, id_, snapshot_policy_.max_send_rate);
+  transport_->start(peers_[id_ - 1]);
+
+  for (uint64_t i = 0; i < peers_.size(); ++i) {
+    uint64_t peer = i + 1;
+    if (peer == id_) {
+      continue;
+    }
+    transport_->add_peer(peer, peers_[i]);
+  }
+}
+
+void RaftNode::load_store(uint64_t snap_index) {
+  std::vector<std::string> snap_paths = snap_paths_;
+  std::string image_path = image_path_;
+  std::string checkpoint_path = checkpoint_path_;
+  store_loading_ = std::async(std::launch::async, [this, snap_paths, image_path, checkpoint_path, snap_index] {
+    auto start = std::chrono::steady_clock::now();
+    auto store = std::make_shared<RedisStore>(this,
+                                              snap_paths,
+                                              image_path,
+                                              checkpoint_path,
+                                              snap_index,
+                                              port_,
+                                              ordered_index_,
+                                              snapshot_policy_.max_write_rate);
+    LOG_INFO("startup: store loaded %lu snapshot files in %.1f ms", snap_paths.size(), elapsed_ms(start));
+    return store;
+  });
+}
+
 void RaftNode::replay_WAL() {
   LOG_DEBUG("replaying WAL of member %lu", id_);
 
+  auto start = std::chrono::steady_clock::now();
   proto::Snapshot snapshot;
-  Status status = snapshotter_->load(snapshot);
+  Status status = snapshotter_->load_newest(snapshot.metadata, snap_paths_);
   if (!status.is_ok()) {
     if (status.is_not_found()) {
       LOG_INFO("snapshot not found for node %lu", id_);
@@ -214,8 +321,30 @@ void RaftNode::replay_WAL() {
     }
   } else {
     storage_->apply_snapshot(snapshot);
+    snapshot_deltas_ = static_cast<int>(snap_paths_.size()) - 1;
+    std::string image_path = Snapshotter::image_path(snap_paths_[0]);
+    if (snapshot_image_ && boost::filesystem::exists(image_path)) {
+      image_path_ = image_path;
+    }
   }
+  LOG_INFO("startup: snapshot %lu found in %.1f ms", snapshot.metadata.index, elapsed_ms(start));
+
+  proto::SnapshotMetadata checkpoint;
+  if (!snap_paths_.empty()) {
+    std::string path = snap_dir_ + "/checkpoint";
+    status = read_checkpoint(path, snapshot.metadata.index, checkpoint);
+    if (status.is_ok()) {
+      checkpoint_path_ = path;
+    } else if (!status.is_not_found()) {
+      LOG_INFO("checkpoint %s is not usable, %s", path.c_str(), status.to_string().c_str());
+      boost::filesystem::remove(path);
+    }
+  }
+
+  // the store decodes the snapshot while the WAL is read
+  load_store(checkpoint_path_.empty() ? snapshot.metadata.index : checkpoint.index);
 
+  start = std::chrono::steady_clock::now();
   open_WAL(snapshot);
   assert(wal_ != nullptr);
 
@@ -234,9 +363,55 @@ void RaftNode::replay_WAL() {
   // send nil once lastIndex is published so client knows commit channel is current
   if (!ents.empty()) {
     last_index_ = ents.back()->index;
-  } else {
-    snap_data_ = std::move(snapshot.data);
   }
+  LOG_INFO("startup: WAL read in %.1f ms, %lu entries", elapsed_ms(start), ents.size());
+
+  if (!checkpoint_path_.empty()) {
+    if (checkpoint_applies(checkpoint, hs, ents, *storage_)) {
+      checkpoint_index_ = checkpoint.index;
+      LOG_INFO("startup: skipping the entries up to the checkpoint at index %lu", checkpoint_index_);
+    } else {
+      // the store is loaded again without the checkpoint
+      LOG_INFO("checkpoint at index %lu does not match the WAL, ignored", checkpoint.index);
+      store_loading_.get();
+      boost::filesystem::remove(checkpoint_path_);
+      checkpoint_path_.clear();
+      load_store(snapshot.metadata.index);
+    }
+  }
+}
+
+Status RaftNode::read_checkpoint(const std::string& path, uint64_t snap_index, proto::SnapshotMetadata& meta) {
+  if (!boost::filesystem::exists(path)) {
+    return Status::not_found("no checkpoint");
+  }
+  std::unique_ptr<SnapshotReader> reader;
+  Status status = SnapshotReader::open(path, reader);
+  if (!status.is_ok()) {
+    return status;
+  }
+  if (reader->base_index() == 0 || reader->base_index() != snap_index || reader->metadata().index <= snap_index) {
+    return Status::invalid_argument("checkpoint of another snapshot");
+  }
+  meta = reader->metadata();
+  return Status::ok();
+}
+
+bool RaftNode::checkpoint_applies(const proto::SnapshotMetadata& checkpoint,
+                                  const proto::HardState& hs,
+                                  const std::vector<proto::EntryPtr>& ents,
+                                  Storage& storage) {
+  uint64_t term = 0;
+  if (checkpoint.index > hs.commit || !storage.term(checkpoint.index, term).is_ok() || term != checkpoint.term) {
+    return false;
+  }
+  // the members only change by applying the entries, they are not skipped
+  for (const proto::EntryPtr& entry : ents) {
+    if (entry->index <= checkpoint.index && entry->type == proto::EntryConfChange) {
+      return false;
+    }
+  }
+  return true;
 }
 
 bool RaftNode::publish_entries(const std::vector<proto::EntryPtr>& entries) {
@@ -290,6 +465,7 @@ bool RaftNode::publish_entries(const std::vector<proto::EntryPtr>& entries) {
 
     // after commit, update appliedIndex
     applied_index_ = entry->index;
+    applied_bytes_ += entry->payload_size();
 
     // replay has finished
     if (entry->index == this->last_index_) {
@@ -314,45 +490,170 @@ void RaftNode::entries_to_apply(const std::vector<proto::EntryPtr>& entries, std
 }
 
 void RaftNode::maybe_trigger_snapshot() {
-  if (applied_index_ - snapshot_index_ <= snap_count_) {
+  if (snapshot_in_progress_) {
+    return;
+  }
+
+  SnapshotStats stats;
+  stats.entries = applied_index_ - snapshot_index_;
+  stats.log_bytes = applied_bytes_;
+  uint64_t wal_size = wal_->size();
+  stats.wal_bytes = wal_size > snapshot_wal_size_ ? wal_size - snapshot_wal_size_ : 0;
+  stats.rss_bytes = rss_bytes_;
+  if (!snapshot_policy_.should_snapshot(stats)) {
     return;
   }
 
-  LOG_DEBUG("start snapshot [applied index: %lu | last snapshot index: %lu], snapshot count[%lu]",
+  LOG_DEBUG("start snapshot [applied index: %lu | last snapshot index: %lu], applied bytes %lu, wal bytes %lu, rss %lu",
             applied_index_,
             snapshot_index_,
-            snap_count_);
+            stats.log_bytes,
+            stats.wal_bytes,
+            stats.rss_bytes);
+  applied_bytes_ = 0;
+  snapshot_wal_size_ = wal_size;
+
+  proto::SnapshotMetadata meta;
+  meta.index = applied_index_;
+  meta.conf_state = *conf_state_;
+  Status status = storage_->term(applied_index_, meta.term);
+  if (!status.is_ok()) {
+    LOG_FATAL("snapshot term error %s", status.to_string().c_str());
+  }
 
-  std::promise<SnapshotDataPtr> promise;
-  std::future<SnapshotDataPtr> future = promise.get_future();
-  redis_server_->get_snapshot(std::move([&promise](const SnapshotDataPtr& data) {
-    promise.set_value(data);
-  }));
+  uint64_t base_index = 0;
+  if (snapshot_deltas_ >= 0 && snapshot_deltas_ < maxSnapshotDeltas) {
+    base_index = snapshot_index_;
+  }
 
-  future.wait();
-  SnapshotDataPtr snapshot_data = future.get();
+  snapshot_in_progress_ = true;
+  std::string tmp_path = snap_dir_ + "/store.tmp";
+  std::string image_tmp_path;
+  if (snapshot_image_) {
+    image_tmp_path = snap_dir_ + "/image.tmp";
+    boost::filesystem::remove(image_tmp_path);
+  }
+  redis_server_->get_snapshot(tmp_path, image_tmp_path, meta, base_index, [this, tmp_path, meta](const Status& status, bool delta) {
+    io_service_.post([this, tmp_path, meta, status, delta] {
+      this->snapshot_in_progress_ = false;
+      if (!status.is_ok()) {
+        LOG_ERROR("snapshot at index %lu failed %s", meta.index, status.to_string().c_str());
+        // the keys changed since the last snapshot are lost with the failed delta
+        this->snapshot_deltas_ = -1;
+        return;
+      }
+      this->save_store_snapshot(tmp_path, meta, delta);
+    });
+  });
+}
 
-  proto::SnapshotPtr snap;
-  Status status = storage_->create_snapshot(applied_index_, conf_state_, *snapshot_data, snap);
+void RaftNode::maybe_checkpoint() {
+  // the checkpoint holds the keys changed since the last snapshot, which are only
+  // known once it is installed and as long as the next one is not a full one
+  if (snapshot_in_progress_ || checkpoint_in_progress_ || snapshot_index_ == 0 || snapshot_deltas_ < 0) {
+    return;
+  }
+  if (!snapshot_policy_.should_checkpoint(applied_index_ - std::max(snapshot_index_, checkpoint_index_))) {
+    return;
+  }
+
+  proto::SnapshotMetadata meta;
+  meta.index = applied_index_;
+  meta.conf_state = *conf_state_;
+  Status status = storage_->term(applied_index_, meta.term);
   if (!status.is_ok()) {
-    LOG_FATAL("create snapshot error %s", status.to_string().c_str());
+    LOG_FATAL("checkpoint term error %s", status.to_string().c_str());
+  }
+
+  // a failed checkpoint is retried after as many entries
+  checkpoint_index_ = applied_index_;
+  checkpoint_in_progress_ = true;
+  redis_server_->save_checkpoint(snap_dir_ + "/checkpoint", meta, snapshot_index_, [this, meta](const Status& status) {
+    io_service_.post([this, meta, status] {
+      this->checkpoint_in_progress_ = false;
+      if (!status.is_ok()) {
+        LOG_WARN("checkpoint at index %lu failed %s", meta.index, status.to_string().c_str());
+        return;
+      }
+      LOG_DEBUG("checkpoint at index %lu", meta.index);
+    });
+  });
+}
+
+void RaftNode::save_store_snapshot(const std::string& tmp_path, const proto::SnapshotMetadata& meta, bool delta) {
+  if (meta.index <= snapshot_index_) {
+    // a snapshot received from the leader meanwhile is more recent
+    LOG_INFO("dropped snapshot at index %lu, last snapshot index %lu", meta.index, snapshot_index_);
+    boost::filesystem::remove(tmp_path);
+    return;
   }
 
-  status = save_snap(*snap);
+  // the snapshot index is saved to the WAL before the snapshot file appears,
+  // see save_snap
+  WAL_Snapshot wal_snapshot;
+  wal_snapshot.index = meta.index;
+  wal_snapshot.term = meta.term;
+  Status status = wal_->save_snapshot(wal_snapshot);
   if (!status.is_ok()) {
     LOG_FATAL("save snapshot error %s", status.to_string().c_str());
   }
 
-  uint64_t compactIndex = 1;
-  if (applied_index_ > snapshotCatchUpEntriesN) {
-    compactIndex = applied_index_ - snapshotCatchUpEntriesN;
+  status = snapshotter_->install(tmp_path, meta, delta);
+  if (!status.is_ok()) {
+    LOG_FATAL("install snapshot error %s", status.to_string().c_str());
   }
-  status = storage_->compact(compactIndex);
+  if (delta) {
+    ++snapshot_deltas_;
+  } else {
+    snapshot_deltas_ = 0;
+    std::string image_tmp_path = snap_dir_ + "/image.tmp";
+    if (snapshot_image_ && boost::filesystem::exists(image_tmp_path)) {
+      status = snapshotter_->install_image(image_tmp_path, meta);
+      if (!status.is_ok()) {
+        LOG_ERROR("install snapshot image error %s", status.to_string().c_str());
+      }
+    }
+    snapshotter_->purge();
+  }
+
+  proto::SnapshotPtr snap;
+  proto::ConfStatePtr conf_state(new proto::ConfState(meta.conf_state));
+  status = storage_->create_snapshot(meta.index, conf_state, std::vector<uint8_t>(), snap);
   if (!status.is_ok()) {
-    LOG_FATAL("compact error %s", status.to_string().c_str());
+    LOG_FATAL("create snapshot error %s", status.to_string().c_str());
   }
-  LOG_INFO("compacted log at index %lu", compactIndex);
-  snapshot_index_ = applied_index_;
+
+  uint64_t bytes_index = 0;
+  status = storage_->retained_index(meta.index, snapshot_policy_.max_catch_up_bytes, bytes_index);
+  if (!status.is_ok()) {
+    bytes_index = 0;
+  }
+  uint64_t slowest_match = SnapshotPolicy::slowest_match(*node_->raft_status());
+  uint64_t compact_index = snapshot_policy_.compact_index(meta.index, bytes_index, slowest_match);
+
+  uint64_t first_index = 0;
+  storage_->first_index(first_index);
+  if (compact_index >= first_index) {
+    status = storage_->compact(compact_index);
+    if (!status.is_ok()) {
+      LOG_FATAL("compact error %s", status.to_string().c_str());
+    }
+    LOG_INFO("compacted log at index %lu", compact_index);
+  }
+  snapshot_index_ = meta.index;
+}
+
+void RaftNode::sample_rss() {
+  FILE* fp = fopen("/proc/self/statm", "r");
+  if (!fp) {
+    return;
+  }
+  unsigned long size = 0;
+  unsigned long resident = 0;
+  if (fscanf(fp, "%lu %lu", &size, &resident) == 2) {
+    rss_bytes_ = static_cast<uint64_t>(resident) * sysconf(_SC_PAGESIZE);
+  }
+  fclose(fp);
 }
 
 void RaftNode::schedule() {
@@ -366,9 +667,12 @@ void RaftNode::schedule() {
 
   *conf_state_ = snap->metadata.conf_state;
   snapshot_index_ = snap->metadata.index;
-  applied_index_ = snap->metadata.index;
+  applied_index_ = std::max(snap->metadata.index, checkpoint_index_);
+
+  auto start = std::chrono::steady_clock::now();
+  redis_server_ = store_loading_.get();
+  LOG_INFO("startup: waited %.1f ms for the store, started in %.1f ms", elapsed_ms(start), elapsed_ms(start_time_));
 
-  redis_server_ = std::make_shared<RedisStore>(this, std::move(snap_data_), port_);
   std::promise<pthread_t> promise;
   std::future<pthread_t> future = promise.get_future();
   redis_server_->start(promise);
@@ -394,6 +698,100 @@ void RaftNode::propose(std::shared_ptr<std::vector<uint8_t>> data, const StatusC
   }
 }
 
+Status RaftNode::backup_path(const std::string& name, std::string& path) const {
+  if (name.empty() || name == "." || name.find('/') != std::string::npos || name.find("..") != std::string::npos) {
+    return Status::invalid_argument("not a file name of the backup directory");
+  }
+  path = backup_dir_ + "/" + name;
+  return Status::ok();
+}
+
+void RaftNode::backup(const std::string& path, const std::function<void(const Status&, uint64_t)>& callback) {
+  io_service_.post([this, path, callback] {
+    boost::system::error_code code;
+    boost::filesystem::create_directories(backup_dir_, code);
+    if (code) {
+      callback(Status::io_error(code.message().c_str()), 0);
+      return;
+    }
+
+    proto::SnapshotMetadata meta;
+    meta.index = applied_index_;
+    meta.conf_state = *conf_state_;
+    Status status = applied_index_ == 0 ? Status::not_found("nothing applied") : storage_->term(applied_index_, meta.term);
+    if (!status.is_ok()) {
+      callback(status, 0);
+      return;
+    }
+
+    uint64_t index = meta.index;
+    redis_server_->save_backup(path, meta, [path, index, callback](const Status& status) {
+      if (status.is_ok()) {
+        LOG_INFO("backup %s at index %lu", path.c_str(), index);
+      } else {
+        LOG_ERROR("backup %s error %s", path.c_str(), status.to_string().c_str());
+      }
+      callback(status, index);
+    });
+  });
+}
+
+Status RaftNode::restore(uint64_t id, const std::string& backup_path) {
+  if (boost::filesystem::exists(wal_dir(id))) {
+    return Status::invalid_argument("member already has a WAL");
+  }
+
+  std::unique_ptr<SnapshotReader> reader;
+  Status status = SnapshotReader::open(backup_path, reader);
+  if (!status.is_ok()) {
+    return status;
+  }
+  if (reader->base_index() != 0) {
+    return Status::invalid_argument("not a full snapshot");
+  }
+  proto::SnapshotMetadata meta = reader->metadata();
+  reader.reset();
+
+  boost::system::error_code code;
+  boost::filesystem::create_directories(snap_dir(id), code);
+  Snapshotter snapshotter(snap_dir(id));
+  std::string tmp_path = snap_dir(id) + "/restore.tmp";
+  boost::filesystem::remove(tmp_path, code);
+  boost::filesystem::copy_file(backup_path, tmp_path, code);
+  if (code) {
+    return Status::io_error(code.message().c_str());
+  }
+  status = snapshotter.install(tmp_path, meta);
+  if (!status.is_ok()) {
+    return status;
+  }
+
+  // the WAL starts at the snapshot, with the members of the snapshot
+  boost::filesystem::create_directories(wal_dir(id), code);
+  WAL::create(wal_dir(id));
+  WAL_Snapshot start;
+  start.index = 0;
+  start.term = 0;
+  WAL_ptr wal = WAL::open(wal_dir(id), start);
+  proto::HardState hs;
+  std::vector<proto::EntryPtr> ents;
+  status = wal->read_all(hs, ents);
+  if (!status.is_ok()) {
+    return status;
+  }
+
+  WAL_Snapshot wal_snapshot;
+  wal_snapshot.index = meta.index;
+  wal_snapshot.term = meta.term;
+  status = wal->save_snapshot(wal_snapshot);
+  if (!status.is_ok()) {
+    return status;
+  }
+  hs.term = meta.term;
+  hs.commit = meta.index;
+  return wal->save(hs, std::vector<proto::EntryPtr>());
+}
+
 void RaftNode::process(proto::MessagePtr msg, const StatusCallback& callback) {
   if (pthread_id_ != pthread_self()) {
     io_service_.post([this, msg, callback]() {
@@ -408,6 +806,20 @@ void RaftNode::process(proto::MessagePtr msg, const StatusCallback& callback) {
   }
 }
 
+bool RaftNode::leader_redirect(uint64_t& lead, std::string& address) const {
+  if (redirect_peers_.empty()) {
+    return false;
+  }
+
+  lead = lead_;
+  if (lead == 0 || lead == id_ || lead > redirect_peers_.size()) {
+    // without a known leader the proposal is forwarded as usual
+    return false;
+  }
+  address = redirect_peers_[lead - 1];
+  return true;
+}
+
 void RaftNode::is_id_removed(uint64_t id, const std::function<void(bool)>& callback) {
   LOG_DEBUG("no impl yet");
   callback(false);
@@ -418,7 +830,18 @@ void RaftNode::report_unreachable(uint64_t id) {
 }
 
 void RaftNode::report_snapshot(uint64_t id, SnapshotStatus status) {
-  LOG_DEBUG("no impl yet");
+  io_service_.post([this, id, status]() {
+    this->node_->report_snapshot(id, status);
+    pull_ready_events();
+  });
+}
+
+Status RaftNode::snapshot_files(const proto::SnapshotMetadata& meta, std::vector<std::string>& paths) const {
+  return snapshotter_->files(meta, paths);
+}
+
+std::string RaftNode::received_snapshot_path(const proto::SnapshotMetadata& meta) const {
+  return snapshotter_->received_path(meta.term, meta.index);
 }
 
 static RaftNodePtr g_node = nullptr;
@@ -430,27 +853,34 @@ void on_signal(int) {
   }
 }
 
-void RaftNode::main(uint64_t id, const std::string& cluster, uint16_t port) {
+void RaftNode::main(uint64_t id,
+                    const std::string& cluster,
+                    uint16_t port,
+                    const std::string& redirect,
+                    bool ordered_index,
+                    bool snapshot_image,
+                    const SnapshotPolicy& snapshot_policy,
+                    const std::string& backup_dir) {
   ::signal(SIGINT, on_signal);
   ::signal(SIGHUP, on_signal);
-  g_node = std::make_shared<RaftNode>(id, cluster, port);
-
-  g_node->transport_ = Transport::create(g_node.get(), g_node->id_);
-  std::string& host = g_node->peers_[id - 1];
-  g_node->transport_->start(host);
-
-  for (uint64_t i = 0; i < g_node->peers_.size(); ++i) {
-    uint64_t peer = i + 1;
-    if (peer == g_node->id_) {
-      continue;
-    }
-    g_node->transport_->add_peer(peer, g_node->peers_[i]);
-  }
-
+  g_node = std::make_shared<RaftNode>(id,
+                                      cluster,
+                                      port,
+                                      redirect,
+                                      ordered_index,
+                                      snapshot_image,
+                                      snapshot_policy,
+                                      backup_dir);
   g_node->schedule();
 }
 
 void RaftNode::stop() {
+  if (pthread_id_ != pthread_self()) {
+    io_service_.post([this]() {
+      stop();
+    });
+    return;
+  }
   LOG_DEBUG("stopping");
   redis_server_->stop();
 
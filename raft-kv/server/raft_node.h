@@ -3,26 +3,74 @@
 #include <stdint.h>
 #include <memory>
 #include <vector>
+#include <atomic>
+#include <future>
+#include <chrono>
 #include <raft-kv/transport/transport.h>
 #include <raft-kv/raft/node.h>
 #include <raft-kv/server/redis_store.h>
 #include <raft-kv/wal/wal.h>
 #include <raft-kv/snap/snapshotter.h>
+#include <raft-kv/server/snapshot_policy.h>
 
 namespace kv {
 
 class RaftNode : public RaftServer {
  public:
-  static void main(uint64_t id, const std::string& cluster, uint16_t port);
-
-  explicit RaftNode(uint64_t id, const std::string& cluster, uint16_t port);
+  static void main(uint64_t id,
+                   const std::string& cluster,
+                   uint16_t port,
+                   const std::string& redirect,
+                   bool ordered_index,
+                   bool snapshot_image,
+                   const SnapshotPolicy& snapshot_policy,
+                   const std::string& backup_dir);
+
+  explicit RaftNode(uint64_t id,
+                    const std::string& cluster,
+                    uint16_t port,
+                    const std::string& redirect,
+                    bool ordered_index,
+                    bool snapshot_image,
+                    const SnapshotPolicy& snapshot_policy,
+                    const std::string& backup_dir);
 
   ~RaftNode() final;
 
+  // restore seeds the empty directory of member id with a backup, every member of
+  // the restored cluster is seeded with the same backup before it starts
+  static Status restore(uint64_t id, const std::string& backup_path);
+
+  // read_checkpoint reads the metadata of the checkpoint at path, it must be a delta
+  // on top of the snapshot at snap_index
+  static Status read_checkpoint(const std::string& path, uint64_t snap_index, proto::SnapshotMetadata& meta);
+
+  // checkpoint_applies returns true if the entries up to the checkpoint can be
+  // skipped, they are committed in the term of the checkpoint and hold no
+  // configuration change. storage holds the snapshot and the entries of the WAL.
+  static bool checkpoint_applies(const proto::SnapshotMetadata& checkpoint,
+                                 const proto::HardState& hs,
+                                 const std::vector<proto::EntryPtr>& ents,
+                                 Storage& storage);
+
+  // schedule runs the member on the calling thread until it is stopped
+  void schedule();
+
+  // stop can be called from any thread, the member stops on its own thread
   void stop();
 
   void propose(std::shared_ptr<std::vector<uint8_t>> data, const StatusCallback& callback);
 
+  // backup_path returns the path of the file name in the backup directory, which
+  // BACKUP writes to and IMPORT reads from. name must be a plain file name, so that
+  // clients can not reach the files outside of the directory.
+  Status backup_path(const std::string& name, std::string& path) const;
+
+  // backup writes a full snapshot of the key space at the applied index to path,
+  // with the term and members of that index, without stopping the member. The
+  // callback is called from a background thread with the index of the backup.
+  void backup(const std::string& path, const std::function<void(const Status&, uint64_t)>& callback);
+
   void process(proto::MessagePtr msg, const StatusCallback& callback) final;
 
   void is_id_removed(uint64_t id, const std::function<void(bool)>& callback) final;
@@ -31,24 +79,45 @@ class RaftNode : public RaftServer {
 
   void report_snapshot(uint64_t id, SnapshotStatus status) final;
 
+  Status snapshot_files(const proto::SnapshotMetadata& meta, std::vector<std::string>& paths) const final;
+
+  std::string received_snapshot_path(const proto::SnapshotMetadata& meta) const final;
+
   uint64_t node_id() const final { return id_; }
 
+  // lead returns the id of the leader this member knows of, 0 if none
+  uint64_t lead() const { return lead_; }
+
+  // leader_redirect returns true if writes should be sent to the leader instead,
+  // which is the case when redirection is enabled and another member leads.
+  bool leader_redirect(uint64_t& lead, std::string& address) const;
+
   bool publish_entries(const std::vector<proto::EntryPtr>& entries);
   void entries_to_apply(const std::vector<proto::EntryPtr>& entries, std::vector<proto::EntryPtr>& ents);
   void maybe_trigger_snapshot();
+  // maybe_checkpoint writes the keys changed since the last snapshot to the
+  // checkpoint, the entries up to it are not applied again after a restart
+  void maybe_checkpoint();
 
  private:
   void start_timer();
   void pull_ready_events();
   Status save_snap(const proto::Snapshot& snap);
   void publish_snapshot(const proto::Snapshot& snap);
-
+  // save_store_snapshot installs the snapshot file of the store written to tmp_path
+  // and compacts the log
+  void save_store_snapshot(const std::string& tmp_path, const proto::SnapshotMetadata& meta, bool delta);
+
+  // start_transport starts accepting and connects to the peers
+  void start_transport();
+  // load_store builds the store from the snapshot files in the background
+  void load_store(uint64_t snap_index);
   // replay_WAL replays WAL entries into the raft instance.
   void replay_WAL();
   // open_WAL opens a WAL ready for reading.
   void open_WAL(const proto::Snapshot& snap);
-
-  void schedule();
+  // sample_rss reads the resident memory of the process
+  void sample_rss();
 
   uint16_t port_;
   pthread_t pthread_id_;
@@ -56,6 +125,9 @@ class RaftNode : public RaftServer {
   boost::asio::deadline_timer timer_;
   uint64_t id_;
   std::vector<std::string> peers_;
+  std::vector<std::string> redirect_peers_; // key-value server address of each peer
+  std::atomic<uint64_t> lead_;
+  bool ordered_index_;
   uint64_t last_index_;
   proto::ConfStatePtr conf_state_;
   uint64_t snapshot_index_;
@@ -65,10 +137,26 @@ class RaftNode : public RaftServer {
   std::unique_ptr<Node> node_;
   TransporterPtr transport_;
   std::shared_ptr<RedisStore> redis_server_;
+  std::future<std::shared_ptr<RedisStore>> store_loading_; // the store loading during the replay
 
-  std::vector<uint8_t> snap_data_;
+  std::vector<std::string> snap_paths_; // snapshot files the store is loaded from at startup
+  bool snapshot_image_;                 // full snapshots come with an image of the table
+  std::string image_path_;              // image the store is mapped from at startup
+  std::string checkpoint_path_;         // checkpoint the store is loaded with at startup
   std::string snap_dir_;
-  uint64_t snap_count_;
+  std::string backup_dir_;
+  SnapshotPolicy snapshot_policy_;
+  uint64_t applied_bytes_;     // bytes of the entries applied since the last snapshot
+  uint64_t snapshot_wal_size_; // size of the WAL at the last snapshot
+  uint64_t rss_bytes_;
+  uint64_t ticks_;
+  bool snapshot_in_progress_; // a snapshot of the store is being taken in the background
+  // the number of deltas on top of the last full snapshot, -1 forces the next
+  // snapshot to be full
+  int snapshot_deltas_;
+  uint64_t checkpoint_index_;   // index of the last checkpoint taken or loaded at startup
+  bool checkpoint_in_progress_;
+  std::chrono::steady_clock::time_point start_time_;
   std::unique_ptr<Snapshotter> snapshotter_;
 
   std::string wal_dir_;
@@ -1,12 +1,14 @@
 #include <raft-kv/server/redis_session.h>
 #include <raft-kv/common/log.h>
 #include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
 #include <raft-kv/server/redis_store.h>
-#include <glib.h>
 
 namespace kv {
 
 #define RECEIVE_BUFFER_SIZE (1024 * 512)
+#define WAIT_APPLIED_TIMEOUT_MS 100
 
 namespace shared {
 
@@ -17,6 +19,15 @@ static const char* unknown_command = "-ERR unknown command `%s`\r\n";
 static const char* wrong_number_arguments = "-ERR wrong number of arguments for '%s' command\r\n";
 static const char* pong = "+PONG\r\n";
 static const char* null = "$-1\r\n";
+static const char* ok_index = "+OK %lu\r\n";
+static const char* try_again = "-TRYAGAIN applied index %lu is behind %lu\r\n";
+static const char* syntax_error = "-ERR syntax error\r\n";
+static const char* moved = "-MOVED %lu %s\r\n";
+static const char* integer = ":%ld\r\n";
+static const char* not_integer = "-ERR value is not an integer or out of range\r\n";
+static const char* queued = "+QUEUED\r\n";
+static const char* exec_abort = "-EXECABORT Transaction discarded because of previous errors.\r\n";
+static const char* empty_array = "*0\r\n";
 
 typedef std::function<void(RedisSessionPtr, struct redisReply* reply)> CommandCallback;
 
@@ -31,6 +42,49 @@ static std::unordered_map<std::string, CommandCallback> command_table = {
     {"DEL", RedisSession::del_command},
     {"keys", RedisSession::keys_command},
     {"KEYS", RedisSession::keys_command},
+    {"scan", RedisSession::scan_command},
+    {"SCAN", RedisSession::scan_command},
+    {"range", RedisSession::range_command},
+    {"RANGE", RedisSession::range_command},
+    {"mget", RedisSession::mget_command},
+    {"MGET", RedisSession::mget_command},
+    {"mset", RedisSession::mset_command},
+    {"MSET", RedisSession::mset_command},
+    {"msetnx", RedisSession::msetnx_command},
+    {"MSETNX", RedisSession::msetnx_command},
+    {"incr", RedisSession::incr_command},
+    {"INCR", RedisSession::incr_command},
+    {"decr", RedisSession::decr_command},
+    {"DECR", RedisSession::decr_command},
+    {"incrby", RedisSession::incrby_command},
+    {"INCRBY", RedisSession::incrby_command},
+    {"decrby", RedisSession::decrby_command},
+    {"DECRBY", RedisSession::decrby_command},
+    {"append", RedisSession::append_command},
+    {"APPEND", RedisSession::append_command},
+    {"getset", RedisSession::getset_command},
+    {"GETSET", RedisSession::getset_command},
+    {"setnx", RedisSession::setnx_command},
+    {"SETNX", RedisSession::setnx_command},
+    {"cas", RedisSession::cas_command},
+    {"CAS", RedisSession::cas_command},
+    {"client", RedisSession::client_command},
+    {"CLIENT", RedisSession::client_command},
+    {"multi", RedisSession::multi_command},
+    {"MULTI", RedisSession::multi_command},
+    {"exec", RedisSession::exec_command},
+    {"EXEC", RedisSession::exec_command},
+    {"discard", RedisSession::discard_command},
+    {"DISCARD", RedisSession::discard_command},
+    {"import", RedisSession::import_command},
+    {"IMPORT", RedisSession::import_command},
+    {"backup", RedisSession::backup_command},
+    {"BACKUP", RedisSession::backup_command},
+};
+
+// commands that are queued between MULTI and EXEC
+static std::unordered_set<std::string> queueable_commands = {
+    "get", "set", "del", "mset", "msetnx", "incr", "decr", "incrby", "decrby", "append", "getset", "setnx", "cas",
 };
 
 }
@@ -45,20 +99,32 @@ static void build_redis_string_array_reply(const std::vector<std::string>& strs,
   for (const std::string& str : strs) {
     snprintf(buffer, sizeof(buffer), "$%lu\r\n", str.size());
     reply.append(buffer);
-
-    if (!str.empty()) {
-      reply.append(str);
-      reply.append("\r\n");
-    }
+    reply.append(str);
+    reply.append("\r\n");
   }
 }
 
+static void build_redis_bulk_string_reply(const std::string& str, std::string& reply) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "$%lu\r\n", str.size());
+  reply.append(buffer);
+  reply.append(str);
+  reply.append("\r\n");
+}
+
 RedisSession::RedisSession(RedisStore* server, boost::asio::io_service& io_service)
     : quit_(false),
       server_(server),
       socket_(io_service),
       read_buffer_(RECEIVE_BUFFER_SIZE),
-      reader_(redisReaderCreate()) {
+      reader_(redisReaderCreate()),
+      next_reply_(0),
+      sent_reply_(0),
+      token_(false),
+      write_index_(0),
+      min_index_(0),
+      multi_(false),
+      multi_error_(false) {
 }
 
 void RedisSession::start() {
@@ -83,40 +149,23 @@ void RedisSession::start() {
 }
 
 void RedisSession::handle_read(size_t bytes) {
-  uint8_t* start = read_buffer_.data();
-  uint8_t* end = read_buffer_.data() + bytes;
-  int err = REDIS_OK;
+  // the reader keeps a command split across reads until the rest of it arrives
+  int err = redisReaderFeed(reader_, (const char*) read_buffer_.data(), bytes);
   std::vector<struct redisReply*> replies;
 
-  while (!quit_ && start < end) {
-    uint8_t* p = (uint8_t*) memchr(start, '\n', bytes);
-    if (!p) {
-      this->start();
-      break;
-    }
-
-    size_t n = p + 1 - start;
-    err = redisReaderFeed(reader_, (const char*) start, n);
-    if (err != REDIS_OK) {
-      LOG_DEBUG("redis protocol error %d, %s", err, reader_->errstr);
-      quit_ = true;
-      break;
-    }
-
+  while (!quit_ && err == REDIS_OK) {
     struct redisReply* reply = NULL;
     err = redisReaderGetReply(reader_, (void**) &reply);
-    if (err != REDIS_OK) {
-      LOG_DEBUG("redis protocol error %d, %s", err, reader_->errstr);
-      quit_ = true;
+    if (!reply) {
       break;
     }
-    if (reply) {
-      replies.push_back(reply);
-    }
-
-    start += n;
-    bytes -= n;
+    replies.push_back(reply);
+  }
+  if (err != REDIS_OK) {
+    LOG_DEBUG("redis protocol error %d, %s", err, reader_->errstr);
+    quit_ = true;
   }
+
   if (err == REDIS_OK) {
     for (struct redisReply* reply : replies) {
       on_redis_reply(reply);
@@ -133,20 +182,20 @@ void RedisSession::on_redis_reply(struct redisReply* reply) {
   char buffer[256];
   if (reply->type != REDIS_REPLY_ARRAY) {
     LOG_WARN("wrong type %d", reply->type);
-    send_reply(shared::wrong_type, strlen(shared::wrong_type));
+    send_error(shared::wrong_type, strlen(shared::wrong_type));
     return;
   }
 
   if (reply->elements < 1) {
     LOG_WARN("wrong elements %lu", reply->elements);
     int n = snprintf(buffer, sizeof(buffer), shared::wrong_number_arguments, "");
-    send_reply(buffer, n);
+    send_error(buffer, n);
     return;
   }
 
   if (reply->element[0]->type != REDIS_REPLY_STRING) {
     LOG_WARN("wrong type %d", reply->element[0]->type);
-    send_reply(shared::wrong_type, strlen(shared::wrong_type));
+    send_error(shared::wrong_type, strlen(shared::wrong_type));
     return;
   }
 
@@ -154,21 +203,202 @@ void RedisSession::on_redis_reply(struct redisReply* reply) {
   auto it = shared::command_table.find(command);
   if (it == shared::command_table.end()) {
     int n = snprintf(buffer, sizeof(buffer), shared::unknown_command, command.c_str());
-    send_reply(buffer, n);
+    send_error(buffer, n);
     return;
   }
+
+  if (multi_) {
+    std::string lower(command);
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    if (lower != "exec" && lower != "discard" && lower != "multi"
+        && shared::queueable_commands.find(lower) == shared::queueable_commands.end()) {
+      int n = snprintf(buffer, sizeof(buffer), shared::err, "command not allowed in a transaction");
+      send_error(buffer, n);
+      return;
+    }
+  }
+
   shared::CommandCallback& cb = it->second;
   cb(shared_from_this(), reply);
 }
 
 void RedisSession::send_reply(const char* data, uint32_t len) {
+  complete_reply(reserve_reply(), data, len);
+}
+
+void RedisSession::send_error(const char* data, uint32_t len) {
+  multi_error_ = multi_error_ || multi_;
+  send_reply(data, len);
+}
+
+void RedisSession::complete_reply(uint64_t seq, const char* data, uint32_t len) {
+  if (seq != sent_reply_) {
+    completed_replies_[seq].assign(data, len);
+    return;
+  }
+
   uint32_t bytes = send_buffer_.readable_bytes();
   send_buffer_.put((uint8_t*) data, len);
+  ++sent_reply_;
+
+  auto it = completed_replies_.begin();
+  while (it != completed_replies_.end() && it->first == sent_reply_) {
+    send_buffer_.put((const uint8_t*) it->second.data(), static_cast<uint32_t>(it->second.size()));
+    ++sent_reply_;
+    it = completed_replies_.erase(it);
+  }
+
   if (bytes == 0) {
     start_send();
   }
 }
 
+// build_commit_reply formats the reply of a commit of the given type
+static void build_commit_reply(uint8_t type, const Status& status, const RedisCommitResult& result, std::string& str) {
+  char buff[256];
+  if (!status.is_ok()) {
+    int n = snprintf(buff, sizeof(buff), shared::err, status.to_string().c_str());
+    str.append(buff, n);
+    return;
+  }
+
+  switch (type) {
+    case RedisCommitData::kCommitSet:
+    case RedisCommitData::kCommitDel: {
+      str.append(shared::ok);
+      break;
+    }
+    case RedisCommitData::kCommitGetSet:
+    case RedisCommitData::kCommitGet: {
+      if (result.nil) {
+        str.append(shared::null);
+      } else {
+        build_redis_bulk_string_reply(result.value, str);
+      }
+      break;
+    }
+    default: {
+      int n = snprintf(buff, sizeof(buff), shared::integer, result.integer);
+      str.append(buff, n);
+    }
+  }
+}
+
+void RedisSession::complete_commit_reply(uint64_t seq,
+                                         uint8_t type,
+                                         const Status& status,
+                                         const RedisCommitResult& result) {
+  std::string str;
+  if (status.is_ok()) {
+    write_index_ = std::max(write_index_, result.index);
+  }
+
+  if (status.is_ok() && token_
+      && (type == RedisCommitData::kCommitSet || type == RedisCommitData::kCommitDel)) {
+    char buff[64];
+    int n = snprintf(buff, sizeof(buff), shared::ok_index, result.index);
+    str.assign(buff, n);
+  } else {
+    build_commit_reply(type, status, result, str);
+  }
+  complete_write(seq, str);
+}
+
+void RedisSession::complete_write(uint64_t seq, const std::string& str) {
+  complete_reply(seq, str.data(), str.size());
+  pending_writes_.erase(seq);
+
+  // the reads sent after the writes completed so far see them
+  while (!deferred_reads_.empty()
+      && (pending_writes_.empty() || deferred_reads_.front().first < *pending_writes_.begin())) {
+    std::pair<uint64_t, std::function<void(std::string&)>> read = std::move(deferred_reads_.front());
+    deferred_reads_.pop_front();
+    read_at(read.first, read.second);
+  }
+}
+
+void RedisSession::write(uint8_t type, std::vector<std::string> strs) {
+  if (multi_) {
+    RedisCommitData data;
+    data.type = type;
+    data.strs = std::move(strs);
+    queued_.push_back(std::move(data));
+    send_reply(shared::queued, strlen(shared::queued));
+    return;
+  }
+
+  if (redirect_write()) {
+    return;
+  }
+
+  auto self = shared_from_this();
+  uint64_t seq = reserve_write();
+  server_->propose_commit(type, std::move(strs), [self, seq, type](const Status& status, const RedisCommitResult& result) {
+    self->complete_commit_reply(seq, type, status, result);
+  });
+}
+
+void RedisSession::run_read(const std::function<void(std::string&)>& read) {
+  uint64_t seq = reserve_reply();
+  if (!pending_writes_.empty()) {
+    // a pipelined read waits for the index of the writes sent before it
+    deferred_reads_.emplace_back(seq, read);
+    return;
+  }
+  read_at(seq, read);
+}
+
+void RedisSession::read_at(uint64_t seq, const std::function<void(std::string&)>& read) {
+  read_after(seq, write_index_, min_index_, read);
+}
+
+void RedisSession::read_after(uint64_t seq,
+                              uint64_t write_index,
+                              uint64_t min_index,
+                              const std::function<void(std::string&)>& read) {
+  uint64_t applied = server_->applied_index();
+  if (applied >= write_index && applied >= min_index) {
+    std::string str;
+    read(str);
+    complete_reply(seq, str.data(), str.size());
+    return;
+  }
+
+  auto self = shared_from_this();
+  if (applied < write_index) {
+    // the writes of the session are committed and will be applied, however long that takes
+    server_->wait_applied(write_index, 0, [self, seq, min_index, read](const Status& status) {
+      self->read_after(seq, 0, min_index, read);
+    });
+    return;
+  }
+
+  server_->wait_applied(min_index, WAIT_APPLIED_TIMEOUT_MS, [self, seq, min_index, read](const Status& status) {
+    std::string str;
+    if (status.is_ok()) {
+      read(str);
+    } else {
+      char buff[256];
+      int n = snprintf(buff, sizeof(buff), shared::try_again, self->server_->applied_index(), min_index);
+      str.assign(buff, n);
+    }
+    self->complete_reply(seq, str.data(), str.size());
+  });
+}
+
+bool RedisSession::redirect_write() {
+  uint64_t lead;
+  std::string address;
+  if (!server_->leader_redirect(lead, address)) {
+    return false;
+  }
+
+  char buffer[256];
+  int n = snprintf(buffer, sizeof(buffer), shared::moved, lead, address.c_str());
+  send_reply(buffer, n);
+  return true;
+}
+
 void RedisSession::start_send() {
   if (!send_buffer_.readable()) {
     return;
@@ -195,122 +425,529 @@ void RedisSession::ping_command(std::shared_ptr<RedisSession> self, struct redis
   self->send_reply(shared::pong, strlen(shared::pong));
 }
 
-void RedisSession::get_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
-  assert(reply->type = REDIS_REPLY_ARRAY);
-  assert(reply->elements > 0);
-  char buffer[256];
+// parse_args collects the nargs string arguments of command, replies an error
+// and returns false if they are malformed.
+static bool parse_args(std::shared_ptr<RedisSession> self,
+                       struct redisReply* reply,
+                       const char* command,
+                       size_t nargs,
+                       std::vector<std::string>& args) {
+  if (reply->elements != nargs + 1) {
+    char buffer[256];
+    int n = snprintf(buffer, sizeof(buffer), shared::wrong_number_arguments, command);
+    self->send_error(buffer, n);
+    return false;
+  }
 
-  if (reply->elements != 2) {
-    LOG_WARN("wrong elements %lu", reply->elements);
-    int n = snprintf(buffer, sizeof(buffer), shared::wrong_number_arguments, "get");
-    self->send_reply(buffer, n);
-    return;
+  for (size_t i = 1; i < reply->elements; ++i) {
+    redisReply* element = reply->element[i];
+    if (element->type != REDIS_REPLY_STRING) {
+      self->send_error(shared::wrong_type, strlen(shared::wrong_type));
+      return false;
+    }
+    args.emplace_back(element->str, element->len);
+  }
+  return true;
+}
+
+// parse_keys collects the one or more keys of command, replies an error and
+// returns false if they are malformed.
+static bool parse_keys(std::shared_ptr<RedisSession> self,
+                       struct redisReply* reply,
+                       const char* command,
+                       std::vector<std::string>& keys) {
+  if (reply->elements < 2) {
+    char buffer[256];
+    int n = snprintf(buffer, sizeof(buffer), shared::wrong_number_arguments, command);
+    self->send_error(buffer, n);
+    return false;
   }
 
-  if (reply->element[1]->type != REDIS_REPLY_STRING) {
-    LOG_WARN("wrong type %d", reply->element[1]->type);
-    self->send_reply(shared::wrong_type, strlen(shared::wrong_type));
+  for (size_t i = 1; i < reply->elements; ++i) {
+    redisReply* element = reply->element[i];
+    if (element->type != REDIS_REPLY_STRING) {
+      self->send_error(shared::wrong_type, strlen(shared::wrong_type));
+      return false;
+    }
+    keys.emplace_back(element->str, element->len);
+  }
+  return true;
+}
+
+// parse_key_values collects the key value pairs of MSET and MSETNX, replies an
+// error and returns false if they are malformed.
+static bool parse_key_values(std::shared_ptr<RedisSession> self,
+                             struct redisReply* reply,
+                             const char* command,
+                             std::vector<std::string>& key_values) {
+  if (reply->elements < 3 || reply->elements % 2 == 0) {
+    char buffer[256];
+    int n = snprintf(buffer, sizeof(buffer), shared::wrong_number_arguments, command);
+    self->send_error(buffer, n);
+    return false;
+  }
+  return parse_keys(self, reply, command, key_values);
+}
+
+void RedisSession::get_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  std::vector<std::string> args;
+  if (!parse_args(self, reply, "get", 1, args)) {
     return;
   }
 
-  std::string value;
-  std::string key(reply->element[1]->str, reply->element[1]->len);
-  bool get = self->server_->get(key, value);
-  if (!get) {
-    self->send_reply(shared::null, strlen(shared::null));
-  } else {
-    char* str = g_strdup_printf("$%lu\r\n%s\r\n", value.size(), value.c_str());
-    self->send_reply(str, strlen(str));
-    g_free(str);
+  if (self->multi_) {
+    // evaluated when the transaction is applied
+    self->write(RedisCommitData::kCommitGet, std::move(args));
+    return;
   }
+
+  std::string key = std::move(args[0]);
+  RedisStore* server = self->server_;
+  self->run_read([server, key](std::string& str) {
+    std::string value;
+    bool get = server->get(key, value);
+    if (!get) {
+      str.append(shared::null);
+    } else {
+      build_redis_bulk_string_reply(value, str);
+    }
+  });
 }
 
 void RedisSession::set_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
-  assert(reply->type = REDIS_REPLY_ARRAY);
-  assert(reply->elements > 0);
-  char buffer[256];
+  std::vector<std::string> args;
+  if (parse_args(self, reply, "set", 2, args)) {
+    self->write(RedisCommitData::kCommitSet, std::move(args));
+  }
+}
 
-  if (reply->elements != 3) {
-    LOG_WARN("wrong elements %lu", reply->elements);
-    int n = snprintf(buffer, sizeof(buffer), shared::wrong_number_arguments, "set");
+void RedisSession::del_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  std::vector<std::string> keys;
+  if (parse_keys(self, reply, "del", keys)) {
+    self->write(RedisCommitData::kCommitDel, std::move(keys));
+  }
+}
+
+void RedisSession::keys_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  std::vector<std::string> args;
+  if (!parse_args(self, reply, "keys", 1, args)) {
+    return;
+  }
+
+  std::string pattern = std::move(args[0]);
+  RedisStore* server = self->server_;
+  self->run_read([server, pattern](std::string& str) {
+    std::vector<std::string> keys;
+    server->keys(pattern.data(), pattern.size(), keys);
+    build_redis_string_array_reply(keys, str);
+  });
+}
+
+void RedisSession::scan_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  // SCAN cursor [MATCH pattern] [COUNT count]
+  char buffer[256];
+  if (reply->elements < 2 || reply->elements % 2 != 0) {
+    int n = snprintf(buffer, sizeof(buffer), shared::wrong_number_arguments, "scan");
     self->send_reply(buffer, n);
     return;
   }
 
-  if (reply->element[1]->type != REDIS_REPLY_STRING || reply->element[2]->type != REDIS_REPLY_STRING) {
-    LOG_WARN("wrong type %d", reply->element[1]->type);
-    self->send_reply(shared::wrong_type, strlen(shared::wrong_type));
+  for (size_t i = 1; i < reply->elements; ++i) {
+    if (reply->element[i]->type != REDIS_REPLY_STRING) {
+      self->send_reply(shared::wrong_type, strlen(shared::wrong_type));
+      return;
+    }
+  }
+
+  const char* arg = reply->element[1]->str;
+  char* end = NULL;
+  uint64_t cursor = strtoull(arg, &end, 10);
+  if (end == arg || *end != '\0') {
+    int n = snprintf(buffer, sizeof(buffer), shared::err, "invalid cursor");
+    self->send_reply(buffer, n);
     return;
   }
-  std::string key(reply->element[1]->str, reply->element[1]->len);
-  std::string value(reply->element[2]->str, reply->element[2]->len);
-  self->server_->set(std::move(key), std::move(value), [self](const Status& status) {
-    if (status.is_ok()) {
-      self->send_reply(shared::ok, strlen(shared::ok));
+
+  std::string pattern("*");
+  size_t count = 10;
+  for (size_t i = 2; i < reply->elements; i += 2) {
+    const char* option = reply->element[i]->str;
+    redisReply* value = reply->element[i + 1];
+    if (strcasecmp(option, "match") == 0) {
+      pattern.assign(value->str, value->len);
+    } else if (strcasecmp(option, "count") == 0) {
+      int64_t n;
+      if (!string_to_int64(std::string(value->str, value->len), n)) {
+        self->send_reply(shared::not_integer, strlen(shared::not_integer));
+        return;
+      }
+      if (n < 1) {
+        self->send_reply(shared::syntax_error, strlen(shared::syntax_error));
+        return;
+      }
+      count = static_cast<size_t>(n);
     } else {
-      char buff[256];
-      int n = snprintf(buff, sizeof(buff), shared::err, status.to_string().c_str());
-      self->send_reply(buff, n);
+      self->send_reply(shared::syntax_error, strlen(shared::syntax_error));
+      return;
     }
+  }
+
+  RedisStore* server = self->server_;
+  self->run_read([server, cursor, pattern, count](std::string& str) {
+    std::vector<std::string> keys;
+    uint64_t next;
+    char buffer[64];
+    if (!server->scan(cursor, pattern.data(), pattern.size(), count, next, keys)) {
+      int n = snprintf(buffer, sizeof(buffer), shared::err, "invalid cursor");
+      str.append(buffer, n);
+      return;
+    }
+
+    std::string next_cursor = std::to_string(next);
+    snprintf(buffer, sizeof(buffer), "*2\r\n$%lu\r\n", next_cursor.size());
+    str.append(buffer);
+    str.append(next_cursor);
+    str.append("\r\n");
+    build_redis_string_array_reply(keys, str);
   });
 }
 
-void RedisSession::del_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
-  assert(reply->type = REDIS_REPLY_ARRAY);
-  assert(reply->elements > 0);
+void RedisSession::range_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  // RANGE start end [COUNT count]
   char buffer[256];
-
-  if (reply->elements <= 1) { ;
-    int n = snprintf(buffer, sizeof(buffer), shared::wrong_number_arguments, "del");
+  if (reply->elements != 3 && reply->elements != 5) {
+    int n = snprintf(buffer, sizeof(buffer), shared::wrong_number_arguments, "range");
     self->send_reply(buffer, n);
     return;
   }
 
-  std::vector<std::string> keys;
   for (size_t i = 1; i < reply->elements; ++i) {
-    redisReply* element = reply->element[i];
-    if (element->type != REDIS_REPLY_STRING) {
+    if (reply->element[i]->type != REDIS_REPLY_STRING) {
       self->send_reply(shared::wrong_type, strlen(shared::wrong_type));
       return;
     }
+  }
 
-    keys.emplace_back(element->str, element->len);
+  std::string start(reply->element[1]->str, reply->element[1]->len);
+  std::string end(reply->element[2]->str, reply->element[2]->len);
+  size_t count = SIZE_MAX;
+  if (reply->elements == 5) {
+    int64_t n;
+    if (strcasecmp(reply->element[3]->str, "count") != 0) {
+      self->send_reply(shared::syntax_error, strlen(shared::syntax_error));
+      return;
+    }
+    if (!string_to_int64(std::string(reply->element[4]->str, reply->element[4]->len), n) || n < 0) {
+      self->send_reply(shared::not_integer, strlen(shared::not_integer));
+      return;
+    }
+    count = static_cast<size_t>(n);
+  }
+
+  RedisStore* server = self->server_;
+  self->run_read([server, start, end, count](std::string& str) {
+    std::vector<std::string> key_values;
+    if (!server->range(start, end, count, key_values)) {
+      char buffer[256];
+      int n = snprintf(buffer, sizeof(buffer), shared::err, "ordered index is disabled");
+      str.append(buffer, n);
+      return;
+    }
+    build_redis_string_array_reply(key_values, str);
+  });
+}
+
+void RedisSession::mget_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  std::vector<std::string> keys;
+  if (!parse_keys(self, reply, "mget", keys)) {
+    return;
+  }
+
+  RedisStore* server = self->server_;
+  self->run_read([server, keys](std::string& str) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "*%lu\r\n", keys.size());
+    str.append(buffer);
+    server->mget(keys, [&str](const std::string* value) {
+      if (value) {
+        build_redis_bulk_string_reply(*value, str);
+      } else {
+        str.append(shared::null);
+      }
+    });
+  });
+}
+
+void RedisSession::mset_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  std::vector<std::string> key_values;
+  if (parse_key_values(self, reply, "mset", key_values)) {
+    self->write(RedisCommitData::kCommitSet, std::move(key_values));
+  }
+}
+
+void RedisSession::msetnx_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  std::vector<std::string> key_values;
+  if (parse_key_values(self, reply, "msetnx", key_values)) {
+    self->write(RedisCommitData::kCommitMSetNX, std::move(key_values));
+  }
+}
+
+static void incrby(std::shared_ptr<RedisSession> self, std::string key, int64_t delta) {
+  std::vector<std::string> strs;
+  strs.push_back(std::move(key));
+  strs.push_back(std::to_string(delta));
+  self->write(RedisCommitData::kCommitIncrBy, std::move(strs));
+}
+
+void RedisSession::incr_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  std::vector<std::string> args;
+  if (parse_args(self, reply, "incr", 1, args)) {
+    incrby(self, std::move(args[0]), 1);
   }
+}
 
-  self->server_->del(std::move(keys), [self](const Status& status) {
+void RedisSession::decr_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  std::vector<std::string> args;
+  if (parse_args(self, reply, "decr", 1, args)) {
+    incrby(self, std::move(args[0]), -1);
+  }
+}
+
+void RedisSession::incrby_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  std::vector<std::string> args;
+  if (!parse_args(self, reply, "incrby", 2, args)) {
+    return;
+  }
+
+  int64_t delta;
+  if (!string_to_int64(args[1], delta)) {
+    self->send_error(shared::not_integer, strlen(shared::not_integer));
+    return;
+  }
+  incrby(self, std::move(args[0]), delta);
+}
+
+void RedisSession::decrby_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  std::vector<std::string> args;
+  if (!parse_args(self, reply, "decrby", 2, args)) {
+    return;
+  }
+
+  int64_t delta;
+  if (!string_to_int64(args[1], delta) || delta == INT64_MIN) {
+    self->send_error(shared::not_integer, strlen(shared::not_integer));
+    return;
+  }
+  incrby(self, std::move(args[0]), -delta);
+}
+
+void RedisSession::append_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  std::vector<std::string> args;
+  if (parse_args(self, reply, "append", 2, args)) {
+    self->write(RedisCommitData::kCommitAppend, std::move(args));
+  }
+}
+
+void RedisSession::getset_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  std::vector<std::string> args;
+  if (parse_args(self, reply, "getset", 2, args)) {
+    self->write(RedisCommitData::kCommitGetSet, std::move(args));
+  }
+}
+
+void RedisSession::setnx_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  std::vector<std::string> args;
+  if (parse_args(self, reply, "setnx", 2, args)) {
+    self->write(RedisCommitData::kCommitSetNX, std::move(args));
+  }
+}
+
+void RedisSession::cas_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  // CAS key expected value
+  std::vector<std::string> args;
+  if (parse_args(self, reply, "cas", 3, args)) {
+    self->write(RedisCommitData::kCommitCas, std::move(args));
+  }
+}
+
+void RedisSession::multi_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  char buffer[256];
+  std::vector<std::string> args;
+  if (!parse_args(self, reply, "multi", 0, args)) {
+    return;
+  }
+
+  if (self->multi_) {
+    int n = snprintf(buffer, sizeof(buffer), shared::err, "MULTI calls can not be nested");
+    self->send_reply(buffer, n);
+    return;
+  }
+  self->multi_ = true;
+  self->multi_error_ = false;
+  self->send_reply(shared::ok, strlen(shared::ok));
+}
+
+void RedisSession::exec_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  char buffer[256];
+  std::vector<std::string> args;
+  if (!parse_args(self, reply, "exec", 0, args)) {
+    return;
+  }
+
+  if (!self->multi_) {
+    int n = snprintf(buffer, sizeof(buffer), shared::err, "EXEC without MULTI");
+    self->send_reply(buffer, n);
+    return;
+  }
+
+  std::vector<RedisCommitData> batch;
+  batch.swap(self->queued_);
+  self->multi_ = false;
+
+  if (self->multi_error_) {
+    self->send_reply(shared::exec_abort, strlen(shared::exec_abort));
+    return;
+  }
+
+  if (batch.empty()) {
+    self->send_reply(shared::empty_array, strlen(shared::empty_array));
+    return;
+  }
+
+  if (self->redirect_write()) {
+    return;
+  }
+
+  std::vector<uint8_t> types;
+  for (const RedisCommitData& data : batch) {
+    types.push_back(data.type);
+  }
+
+  uint64_t seq = self->reserve_write();
+  self->server_->propose_batch(std::move(batch),
+                               [self, seq, types](const Status& status, const RedisCommitResult& result) {
+                                 std::string str;
+                                 if (!status.is_ok() || !result.batch || result.batch->size() != types.size()) {
+                                   build_commit_reply(RedisCommitData::kCommitMulti, status, result, str);
+                                   self->complete_write(seq, str);
+                                   return;
+                                 }
+
+                                 self->write_index_ = std::max(self->write_index_, result.index);
+                                 char buff[64];
+                                 snprintf(buff, sizeof(buff), "*%lu\r\n", types.size());
+                                 str.append(buff);
+                                 for (size_t i = 0; i < types.size(); ++i) {
+                                   const std::pair<Status, RedisCommitResult>& r = (*result.batch)[i];
+                                   build_commit_reply(types[i], r.first, r.second, str);
+                                 }
+                                 self->complete_write(seq, str);
+                               });
+}
+
+void RedisSession::discard_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  char buffer[256];
+  std::vector<std::string> args;
+  if (!parse_args(self, reply, "discard", 0, args)) {
+    return;
+  }
+
+  if (!self->multi_) {
+    int n = snprintf(buffer, sizeof(buffer), shared::err, "DISCARD without MULTI");
+    self->send_reply(buffer, n);
+    return;
+  }
+  self->multi_ = false;
+  self->queued_.clear();
+  self->send_reply(shared::ok, strlen(shared::ok));
+}
+
+void RedisSession::import_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  // IMPORT <name>, a snapshot file of the backup directory of the member the client is connected to
+  std::vector<std::string> args;
+  if (!parse_args(self, reply, "import", 1, args)) {
+    return;
+  }
+
+  if (self->redirect_write()) {
+    return;
+  }
+
+  uint64_t seq = self->reserve_write();
+  self->server_->import(args[0], [self, seq](const Status& status, const RedisCommitResult& result) {
+    if (status.is_ok()) {
+      self->write_index_ = std::max(self->write_index_, result.index);
+    }
+    std::string str;
+    build_commit_reply(RedisCommitData::kCommitImport, status, result, str);
+    self->complete_write(seq, str);
+  });
+}
+
+void RedisSession::backup_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  // BACKUP <name>, written to the backup directory of the member the client is connected to
+  std::vector<std::string> args;
+  if (!parse_args(self, reply, "backup", 1, args)) {
+    return;
+  }
+
+  uint64_t seq = self->reserve_reply();
+  self->server_->backup(args[0], [self, seq](const Status& status, const RedisCommitResult& result) {
+    char buff[256];
+    int n;
     if (status.is_ok()) {
-      self->send_reply(shared::ok, strlen(shared::ok));
+      n = snprintf(buff, sizeof(buff), shared::ok_index, result.index);
     } else {
-      char buff[256];
-      int n = snprintf(buff, sizeof(buff), shared::err, status.to_string().c_str());
-      self->send_reply(buff, n);
+      n = snprintf(buff, sizeof(buff), shared::err, status.to_string().c_str());
     }
+    self->complete_reply(seq, buff, n);
   });
 }
 
-void RedisSession::keys_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
-  assert(reply->type = REDIS_REPLY_ARRAY);
+void RedisSession::client_command(std::shared_ptr<RedisSession> self, struct redisReply* reply) {
+  assert(reply->type == REDIS_REPLY_ARRAY);
   assert(reply->elements > 0);
   char buffer[256];
 
-  if (reply->elements != 2) { ;
-    int n = snprintf(buffer, sizeof(buffer), shared::wrong_number_arguments, "keys");
+  if (reply->elements != 3) {
+    int n = snprintf(buffer, sizeof(buffer), shared::wrong_number_arguments, "client");
     self->send_reply(buffer, n);
     return;
   }
 
-  redisReply* element = reply->element[1];
-
-  if (element->type != REDIS_REPLY_STRING) {
+  if (reply->element[1]->type != REDIS_REPLY_STRING || reply->element[2]->type != REDIS_REPLY_STRING) {
     self->send_reply(shared::wrong_type, strlen(shared::wrong_type));
     return;
   }
 
-  std::vector<std::string> keys;
-  self->server_->keys(element->str, element->len, keys);
-  std::string str;
-  build_redis_string_array_reply(keys, str);
-  self->send_reply(str.data(), str.size());
+  const char* sub = reply->element[1]->str;
+  const char* arg = reply->element[2]->str;
+
+  if (strcasecmp(sub, "token") == 0) {
+    // CLIENT TOKEN ON|OFF
+    if (strcasecmp(arg, "on") == 0) {
+      self->token_ = true;
+    } else if (strcasecmp(arg, "off") == 0) {
+      self->token_ = false;
+    } else {
+      self->send_reply(shared::syntax_error, strlen(shared::syntax_error));
+      return;
+    }
+  } else if (strcasecmp(sub, "minindex") == 0) {
+    // CLIENT MININDEX <index>, a token returned by a write on any member
+    char* end = NULL;
+    uint64_t index = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0') {
+      self->send_reply(shared::syntax_error, strlen(shared::syntax_error));
+      return;
+    }
+    self->min_index_ = std::max(self->min_index_, index);
+  } else {
+    int n = snprintf(buffer, sizeof(buffer), shared::err, "unknown subcommand");
+    self->send_reply(buffer, n);
+    return;
+  }
+  self->send_reply(shared::ok, strlen(shared::ok));
 }
 
 }
@@ -1,12 +1,15 @@
 #pragma once
 #include <memory>
+#include <map>
+#include <set>
+#include <deque>
 #include <boost/asio.hpp>
 #include <hiredis/hiredis.h>
 #include <raft-kv/common/bytebuffer.h>
+#include <raft-kv/server/redis_store.h>
 
 namespace kv {
 
-class RedisStore;
 class RedisSession : public std::enable_shared_from_this<RedisSession> {
  public:
   explicit RedisSession(RedisStore* server, boost::asio::io_service& io_service);
@@ -23,6 +26,53 @@ class RedisSession : public std::enable_shared_from_this<RedisSession> {
 
   void send_reply(const char* data, uint32_t len);
 
+  // send_error replies the error of a rejected command, inside MULTI the
+  // transaction is aborted at EXEC
+  void send_error(const char* data, uint32_t len);
+
+  // reserve_reply takes the position of a reply that is completed later,
+  // replies are written in the order their positions were taken.
+  uint64_t reserve_reply() {
+    return next_reply_++;
+  }
+
+  void complete_reply(uint64_t seq, const char* data, uint32_t len);
+
+  // reserve_write takes the position of the reply of a proposed write, the
+  // reads sent after it wait until it is completed with complete_write.
+  uint64_t reserve_write() {
+    uint64_t seq = reserve_reply();
+    pending_writes_.insert(seq);
+    return seq;
+  }
+
+  void complete_write(uint64_t seq, const std::string& str);
+
+  void complete_commit_reply(uint64_t seq, uint8_t type, const Status& status, const RedisCommitResult& result);
+
+  // write proposes a commit of the given type, or queues it inside MULTI
+  void write(uint8_t type, std::vector<std::string> strs);
+
+  // run_read runs read once the writes sent before it are completed and the
+  // store has applied write_index_ and min_index_, the reply keeps its
+  // position among the replies of the session.
+  void run_read(const std::function<void(std::string&)>& read);
+
+  // read_at runs read once the store has applied write_index_ and min_index_
+  // and completes the reply at seq
+  void read_at(uint64_t seq, const std::function<void(std::string&)>& read);
+
+  // read_after waits for write_index without a limit, then for min_index for
+  // at most WAIT_APPLIED_TIMEOUT_MS and answers -TRYAGAIN if it is not applied
+  void read_after(uint64_t seq,
+                  uint64_t write_index,
+                  uint64_t min_index,
+                  const std::function<void(std::string&)>& read);
+
+  // redirect_write answers a write with the address of the leader when this
+  // member should not propose it, returns false if the write is to be proposed.
+  bool redirect_write();
+
   void start_send();
 
   static void ping_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
@@ -34,6 +84,44 @@ class RedisSession : public std::enable_shared_from_this<RedisSession> {
   static void del_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
 
   static void keys_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void scan_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void range_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void mget_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void mset_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void msetnx_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void incr_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void decr_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void incrby_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void decrby_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void append_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void getset_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void setnx_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void cas_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void client_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void multi_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void exec_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void discard_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void import_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
+
+  static void backup_command(std::shared_ptr<RedisSession> self, struct redisReply* reply);
  public:
   bool quit_;
   RedisStore* server_;
@@ -41,6 +129,20 @@ class RedisSession : public std::enable_shared_from_this<RedisSession> {
   std::vector<uint8_t> read_buffer_;
   redisReader* reader_;
   ByteBuffer send_buffer_;
+  uint64_t next_reply_;
+  uint64_t sent_reply_;
+  std::map<uint64_t, std::string> completed_replies_;
+
+  bool token_;           // reply writes with the raft index they were applied at
+  uint64_t write_index_; // reads wait until the store has applied the writes of the session
+  uint64_t min_index_;   // reads wait until the store has applied this index, set by CLIENT MININDEX
+  std::set<uint64_t> pending_writes_; // reply positions of the writes not completed yet
+  // reads pipelined after a pending write, with their reply positions
+  std::deque<std::pair<uint64_t, std::function<void(std::string&)>>> deferred_reads_;
+
+  bool multi_;                          // inside MULTI, writes are queued
+  bool multi_error_;                    // a command was rejected while queuing, EXEC aborts
+  std::vector<RedisCommitData> queued_; // commits queued since MULTI
 };
 typedef std::shared_ptr<RedisSession> RedisSessionPtr;
 
@@ -1,146 +1,445 @@
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <random>
 #include <msgpack.hpp>
 #include <raft-kv/server/redis_store.h>
 #include <raft-kv/server/raft_node.h>
 #include <raft-kv/common/log.h>
 #include <raft-kv/server/redis_session.h>
+#include <raft-kv/snap/snapshot_file.h>
 
 namespace kv {
 
-// see redis keys command
-int string_match_len(const char* pattern, int patternLen,
-                     const char* string, int stringLen, int nocase) {
-  while (patternLen && stringLen) {
-    switch (pattern[0]) {
-      case '*':
-        while (pattern[1] == '*') {
-          pattern++;
-          patternLen--;
-        }
-        if (patternLen == 1)
-          return 1; /* match */
-        while (stringLen) {
-          if (string_match_len(pattern + 1, patternLen - 1,
-                               string, stringLen, nocase))
-            return 1; /* match */
-          string++;
-          stringLen--;
-        }
-        return 0; /* no match */
-        break;
-      case '?':
-        if (stringLen == 0)
-          return 0; /* no match */
-        string++;
-        stringLen--;
+// the key space is snapshotted as a sequence of msgpack maps of keys to values,
+// each holding at most kSnapshotBatch keys or about kSnapshotBatchBytes of keys
+// and values, and written as its own chunk
+static const size_t kSnapshotBatch = 1024;
+static const size_t kSnapshotBatchBytes = 4 * 1024 * 1024;
+static const size_t kMaxLoadThreads = 16;
+
+// the nice value of the snapshot child
+static const int kSnapshotNice = 10;
+
+// the entries freed at a time by the release thread
+static const size_t kReleaseBatch = 4096;
+
+// the entries of an import proposed and not yet applied
+static const size_t kImportWindow = 16;
+// the keys and values of the chunks imported are proposed in entries of about this size
+static const size_t kImportEntryBytes = 1024 * 1024;
+
+// the cursors of prefix scans remembered, a forgotten one is refused
+static const size_t kMaxScanCursors = 1024;
+
+static uint64_t random_cursor() {
+  std::random_device device;
+  return (static_cast<uint64_t>(device()) << 32) | device();
+}
+
+static Status write_key_values(const Dict& key_values, SnapshotWriter& writer) {
+  Status status;
+  msgpack::sbuffer sbuf;
+  std::vector<std::pair<const std::string*, const std::string*>> batch;
+  batch.reserve(kSnapshotBatch);
+
+  size_t batch_bytes = 0;
+
+  auto flush = [&status, &sbuf, &batch, &batch_bytes, &writer]() {
+    msgpack::packer<msgpack::sbuffer> packer(&sbuf);
+    packer.pack_map(static_cast<uint32_t>(batch.size()));
+    for (auto& kv : batch) {
+      packer.pack(*kv.first);
+      packer.pack(*kv.second);
+    }
+    if (status.is_ok()) {
+      status = writer.write_chunk(sbuf.data(), sbuf.size(), static_cast<uint32_t>(batch.size()));
+    }
+    sbuf.clear();
+    batch.clear();
+    batch_bytes = 0;
+  };
+
+  key_values.for_each([&batch, &batch_bytes, &flush](const std::string& key, const std::string& value) {
+    batch.emplace_back(&key, &value);
+    batch_bytes += key.size() + value.size();
+    if (batch.size() == kSnapshotBatch || batch_bytes >= kSnapshotBatchBytes) {
+      flush();
+    }
+  });
+  if (!batch.empty()) {
+    flush();
+  }
+  return status;
+}
+
+static Status read_key_values(SnapshotReader& reader, Dict& key_values) {
+  static const size_t kReadSize = 1024 * 1024;
+  msgpack::unpacker unpacker;
+  try {
+    while (true) {
+      unpacker.reserve_buffer(kReadSize);
+      size_t n = 0;
+      Status status = reader.read(unpacker.buffer(), unpacker.buffer_capacity(), n);
+      if (!status.is_ok()) {
+        return status;
+      }
+      if (n == 0) {
         break;
-      case '[': {
-        int not_match, match;
-
-        pattern++;
-        patternLen--;
-        not_match = pattern[0] == '^';
-        if (not_match) {
-          pattern++;
-          patternLen--;
+      }
+      unpacker.buffer_consumed(n);
+
+      msgpack::object_handle oh;
+      while (unpacker.next(oh)) {
+        const msgpack::object& obj = oh.get();
+        if (obj.type != msgpack::type::MAP) {
+          return Status::io_error("invalid snapshot");
         }
-        match = 0;
-        while (1) {
-          if (pattern[0] == '\\' && patternLen >= 2) {
-            pattern++;
-            patternLen--;
-            if (pattern[0] == string[0])
-              match = 1;
-          } else if (pattern[0] == ']') {
-            break;
-          } else if (patternLen == 0) {
-            pattern--;
-            patternLen++;
-            break;
-          } else if (pattern[1] == '-' && patternLen >= 3) {
-            int start = pattern[0];
-            int end = pattern[2];
-            int c = string[0];
-            if (start > end) {
-              int t = start;
-              start = end;
-              end = t;
-            }
-            if (nocase) {
-              start = tolower(start);
-              end = tolower(end);
-              c = tolower(c);
-            }
-            pattern += 2;
-            patternLen -= 2;
-            if (c >= start && c <= end)
-              match = 1;
-          } else {
-            if (!nocase) {
-              if (pattern[0] == string[0])
-                match = 1;
-            } else {
-              if (tolower((int) pattern[0]) == tolower((int) string[0]))
-                match = 1;
-            }
-          }
-          pattern++;
-          patternLen--;
+        for (uint32_t i = 0; i < obj.via.map.size; ++i) {
+          const msgpack::object_kv& kv = obj.via.map.ptr[i];
+          key_values[kv.key.as<std::string>()] = kv.val.as<std::string>();
         }
-        if (not_match)
-          match = !match;
-        if (!match)
-          return 0; /* no match */
-        string++;
-        stringLen--;
-        break;
       }
-      case '\\':
-        if (patternLen >= 2) {
-          pattern++;
-          patternLen--;
+    }
+  } catch (std::exception& e) {
+    return Status::io_error("invalid snapshot");
+  }
+
+  if (unpacker.nonparsed_size() != 0) {
+    return Status::io_error("truncated snapshot");
+  }
+  return Status::ok();
+}
+
+static Status decode_chunk(const std::vector<char>& data, uint32_t count, Dict::Batch& batch) {
+  try {
+    msgpack::object_handle oh = msgpack::unpack(data.data(), data.size());
+    const msgpack::object& obj = oh.get();
+    if (obj.type != msgpack::type::MAP || obj.via.map.size != count) {
+      return Status::io_error("invalid snapshot chunk");
+    }
+    for (uint32_t i = 0; i < obj.via.map.size; ++i) {
+      const msgpack::object_kv& kv = obj.via.map.ptr[i];
+      batch.add(kv.key.as<std::string>(), kv.val.as<std::string>());
+    }
+  } catch (std::exception& e) {
+    return Status::io_error("invalid snapshot chunk");
+  }
+  return Status::ok();
+}
+
+// read_chunks verifies and decodes the chunks on several threads, the entries of
+// every chunk are grouped by the part of the table they belong to and each part is
+// then linked by its own thread
+static Status read_chunks(const SnapshotReader& reader, Dict& key_values) {
+  size_t total = 0;
+  for (size_t i = 0; i < reader.chunk_count(); ++i) {
+    total += reader.chunk(i).count;
+  }
+  size_t threads = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), kMaxLoadThreads);
+  threads = std::min(threads, reader.chunk_count());
+
+  key_values.reserve(key_values.size() + total);
+  std::vector<Dict::Batch> batches(reader.chunk_count());
+  for (Dict::Batch& batch : batches) {
+    key_values.prepare_batch(batch, threads);
+  }
+
+  std::atomic<size_t> next_chunk(0);
+  std::mutex mutex;
+  Status error;
+  auto decode = [&]() {
+    std::vector<char> data;
+    for (size_t i = next_chunk++; i < batches.size(); i = next_chunk++) {
+      Status status = reader.read_chunk(i, data);
+      if (status.is_ok()) {
+        status = decode_chunk(data, reader.chunk(i).count, batches[i]);
+      }
+      if (!status.is_ok()) {
+        std::lock_guard<std::mutex> guard(mutex);
+        error = status;
+        next_chunk = batches.size();
+        return;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; ++i) {
+    workers.emplace_back(decode);
+  }
+  decode();
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  if (!error.is_ok()) {
+    return error;
+  }
+
+  key_values.load(batches);
+  return Status::ok();
+}
+
+// apply_delta applies the chunks of a delta snapshot in order, a nil value is a
+// key deleted since the base snapshot. The keys of the delta are added to keys if
+// not null.
+static Status apply_delta(const SnapshotReader& reader, Dict& key_values, std::unordered_set<std::string>* keys = nullptr) {
+  std::vector<char> data;
+  for (size_t i = 0; i < reader.chunk_count(); ++i) {
+    Status status = reader.read_chunk(i, data);
+    if (!status.is_ok()) {
+      return status;
+    }
+    try {
+      msgpack::object_handle oh = msgpack::unpack(data.data(), data.size());
+      const msgpack::object& obj = oh.get();
+      if (obj.type != msgpack::type::MAP || obj.via.map.size != reader.chunk(i).count) {
+        return Status::io_error("invalid snapshot chunk");
+      }
+      for (uint32_t j = 0; j < obj.via.map.size; ++j) {
+        const msgpack::object_kv& kv = obj.via.map.ptr[j];
+        if (keys) {
+          keys->insert(kv.key.as<std::string>());
         }
-        /* fall through */
-      default:
-        if (!nocase) {
-          if (pattern[0] != string[0])
-            return 0; /* no match */
+        if (kv.val.type == msgpack::type::NIL) {
+          key_values.erase(kv.key.as<std::string>());
         } else {
-          if (tolower((int) pattern[0]) != tolower((int) string[0]))
-            return 0; /* no match */
+          key_values[kv.key.as<std::string>()] = kv.val.as<std::string>();
         }
-        string++;
-        stringLen--;
-        break;
+      }
+    } catch (std::exception& e) {
+      return Status::io_error("invalid snapshot chunk");
+    }
+  }
+  return Status::ok();
+}
+
+static Status load_key_values(const std::string& path, Dict& key_values) {
+  std::unique_ptr<SnapshotReader> reader;
+  Status status = SnapshotReader::open(path, reader);
+  if (!status.is_ok()) {
+    return status;
+  }
+
+  // raw chunks, of a snapshot in the first format, are not decodable on their own
+  for (size_t i = 0; i < reader->chunk_count(); ++i) {
+    if (reader->chunk(i).count == 0) {
+      return read_key_values(*reader, key_values);
     }
-    pattern++;
-    patternLen--;
-    if (stringLen == 0) {
-      while (*pattern == '*') {
-        pattern++;
-        patternLen--;
+  }
+  return read_chunks(*reader, key_values);
+}
+
+// load_snapshot loads the full snapshot of paths in parallel, or maps its image,
+// and applies its deltas
+static Status load_snapshot(const std::vector<std::string>& paths, const std::string& image_path, Dict& key_values) {
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (i == 0) {
+      if (!image_path.empty()) {
+        Status status = key_values.load_image(image_path);
+        if (status.is_ok()) {
+          LOG_INFO("mapped image %s, %lu keys", image_path.c_str(), key_values.size());
+          continue;
+        }
+        LOG_WARN("load image %s error %s", image_path.c_str(), status.to_string().c_str());
+      }
+      Status status = load_key_values(paths[i], key_values);
+      if (!status.is_ok()) {
+        return status;
+      }
+      continue;
+    }
+
+    std::unique_ptr<SnapshotReader> reader;
+    Status status = SnapshotReader::open(paths[i], reader);
+    if (status.is_ok()) {
+      status = apply_delta(*reader, key_values);
+    }
+    if (!status.is_ok()) {
+      return status;
+    }
+  }
+  return Status::ok();
+}
+
+// load_checkpoint applies the checkpoint at path, a delta on top of the snapshot
+// already loaded, and returns the keys it changes
+static Status load_checkpoint(const std::string& path, Dict& key_values, std::unordered_set<std::string>& keys) {
+  std::unique_ptr<SnapshotReader> reader;
+  Status status = SnapshotReader::open(path, reader);
+  if (!status.is_ok()) {
+    return status;
+  }
+  return apply_delta(*reader, key_values, &keys);
+}
+
+// lower_priority lowers the cpu and io priority of the snapshot child, so that
+// the WAL and the clients are served first
+static void lower_priority() {
+  if (setpriority(PRIO_PROCESS, 0, kSnapshotNice) != 0) {
+    LOG_WARN("setpriority error %s", strerror(errno));
+  }
+#ifdef SYS_ioprio_set
+  // the lowest level of the best effort class, see linux/ioprio.h
+  const int ioprio_class_be = 2;
+  const int ioprio_class_shift = 13;
+  const int ioprio_who_process = 1;
+  if (syscall(SYS_ioprio_set, ioprio_who_process, 0, (ioprio_class_be << ioprio_class_shift) | 7) != 0) {
+    LOG_WARN("ioprio_set error %s", strerror(errno));
+  }
+#endif
+}
+
+// wait_child waits for a forked snapshot child, returns an error if it failed
+static Status wait_child(pid_t pid) {
+  int child_status = 0;
+  while (waitpid(pid, &child_status, 0) < 0) {
+    if (errno != EINTR) {
+      return Status::io_error(strerror(errno));
+    }
+  }
+  if (!WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) {
+    return Status::io_error("snapshot child failed");
+  }
+  return Status::ok();
+}
+
+// save_key_values runs in the forked snapshot child
+static Status save_key_values(const Dict& key_values,
+                              const std::string& path,
+                              const proto::SnapshotMetadata& meta,
+                              RateLimiter* limiter) {
+  std::unique_ptr<SnapshotWriter> writer;
+  Status status = SnapshotWriter::create(path, meta, writer);
+  if (!status.is_ok()) {
+    return status;
+  }
+  writer->set_rate_limiter(limiter);
+
+  status = write_key_values(key_values, *writer);
+  if (!status.is_ok()) {
+    return status;
+  }
+  return writer->finish();
+}
+
+// save_delta runs in the forked snapshot child, it writes the current value of
+// every dirty key, nil if it was deleted
+static Status save_delta(const Dict& key_values,
+                         const std::unordered_set<std::string>& dirty_keys,
+                         const std::string& path,
+                         const proto::SnapshotMetadata& meta,
+                         uint64_t base_index,
+                         RateLimiter* limiter) {
+  std::unique_ptr<SnapshotWriter> writer;
+  Status status = SnapshotWriter::create_delta(path, meta, base_index, writer);
+  if (!status.is_ok()) {
+    return status;
+  }
+  writer->set_rate_limiter(limiter);
+
+  msgpack::sbuffer sbuf;
+  std::vector<std::pair<const std::string*, const std::string*>> batch;
+  batch.reserve(kSnapshotBatch);
+  size_t batch_bytes = 0;
+  auto flush = [&]() {
+    msgpack::packer<msgpack::sbuffer> packer(&sbuf);
+    packer.pack_map(static_cast<uint32_t>(batch.size()));
+    for (auto& kv : batch) {
+      packer.pack(*kv.first);
+      if (kv.second) {
+        packer.pack(*kv.second);
+      } else {
+        packer.pack_nil();
       }
-      break;
     }
+    if (status.is_ok()) {
+      status = writer->write_chunk(sbuf.data(), sbuf.size(), static_cast<uint32_t>(batch.size()));
+    }
+    sbuf.clear();
+    batch.clear();
+    batch_bytes = 0;
+  };
+
+  for (const std::string& key : dirty_keys) {
+    const std::string* value = key_values.find(key);
+    batch.emplace_back(&key, value);
+    batch_bytes += key.size() + (value ? value->size() : 0);
+    if (batch.size() == kSnapshotBatch || batch_bytes >= kSnapshotBatchBytes) {
+      flush();
+    }
+  }
+  if (!batch.empty()) {
+    flush();
+  }
+  if (!status.is_ok()) {
+    return status;
   }
-  if (patternLen == 0 && stringLen == 0)
-    return 1;
-  return 0;
+  return writer->finish();
 }
 
-RedisStore::RedisStore(RaftNode* server, std::vector<uint8_t> snap, uint16_t port)
+static void build_ordered_keys(const Dict& key_values, std::set<std::string>& ordered_keys) {
+  key_values.for_each([&ordered_keys](const std::string& key, const std::string& value) {
+    ordered_keys.insert(key);
+  });
+}
+
+struct IndexWaiter {
+  explicit IndexWaiter(boost::asio::io_service& io_service, uint64_t index, const StatusCallback& callback)
+      : index(index),
+        done(false),
+        timer(io_service),
+        callback(callback) {
+  }
+
+  uint64_t index;
+  bool done;
+  boost::asio::deadline_timer timer;
+  StatusCallback callback;
+};
+
+RedisStore::RedisStore(RaftNode* server,
+                       const std::vector<std::string>& snap_paths,
+                       const std::string& image_path,
+                       const std::string& checkpoint_path,
+                       uint64_t snap_index,
+                       uint16_t port,
+                       bool ordered_index,
+                       uint64_t snapshot_write_rate)
     : server_(server),
       acceptor_(io_service_),
-      next_request_id_(0) {
+      apply_work_(new boost::asio::io_service::work(apply_service_)),
+      release_work_(new boost::asio::io_service::work(release_service_)),
+      backup_in_progress_(false),
+      ordered_index_(ordered_index),
+      next_scan_cursor_(random_cursor()),
+      dirty_overflow_(false),
+      snapshot_write_rate_(snapshot_write_rate),
+      next_request_id_(0),
+      applied_index_(snap_index),
+      waiter_count_(0) {
 
-  if (!snap.empty()) {
-    std::unordered_map<std::string, std::string> kv;
-    msgpack::object_handle oh = msgpack::unpack((const char*) snap.data(), snap.size());
-    try {
-      oh.get().convert(kv);
-    } catch (std::exception& e) {
-      LOG_WARN("invalid snapshot");
+  if (!snap_paths.empty()) {
+    Status status = load_snapshot(snap_paths, image_path, key_values_);
+    if (!status.is_ok()) {
+      LOG_FATAL("load snapshot %s error %s", snap_paths.back().c_str(), status.to_string().c_str());
+    }
+    if (!checkpoint_path.empty()) {
+      // the keys of the checkpoint changed since the snapshot, the next delta holds them
+      std::unordered_set<std::string> keys;
+      status = load_checkpoint(checkpoint_path, key_values_, keys);
+      if (!status.is_ok()) {
+        LOG_FATAL("load checkpoint %s error %s", checkpoint_path.c_str(), status.to_string().c_str());
+      }
+      for (const std::string& key : keys) {
+        mark_dirty(key);
+      }
+    }
+    if (ordered_index_) {
+      build_ordered_keys(key_values_, ordered_keys_);
     }
-    std::swap(kv, key_values_);
   }
 
   auto address = boost::asio::ip::address::from_string("0.0.0.0");
@@ -156,11 +455,35 @@ RedisStore::~RedisStore() {
   if (worker_.joinable()) {
     worker_.join();
   }
+  if (apply_worker_.joinable()) {
+    apply_worker_.join();
+  }
+  if (snapshot_worker_.joinable()) {
+    snapshot_worker_.join();
+  }
+  release_work_.reset();
+  if (release_worker_.joinable()) {
+    release_worker_.join();
+  }
+  if (backup_worker_.joinable()) {
+    backup_worker_.join();
+  }
+  if (checkpoint_worker_.joinable()) {
+    checkpoint_worker_.join();
+  }
 }
 
 void RedisStore::start(std::promise<pthread_t>& promise) {
   start_accept();
 
+  apply_worker_ = std::thread([this]() {
+    this->apply_service_.run();
+  });
+
+  release_worker_ = std::thread([this]() {
+    this->release_service_.run();
+  });
+
   worker_ = std::thread([this, &promise]() {
     promise.set_value(pthread_self());
     this->io_service_.run();
@@ -180,15 +503,48 @@ void RedisStore::start_accept() {
   });
 }
 
-void RedisStore::set(std::string key, std::string value, const StatusCallback& callback) {
-  uint32_t commit_id = next_request_id_++;
+void RedisStore::mget(const std::vector<std::string>& keys, const std::function<void(const std::string*)>& callback) {
+  // resolving the buckets of the keys a few positions ahead lets their cache
+  // misses overlap with the lookups in progress
+  static const size_t prefetch_distance = 4;
+
+  std::vector<uint64_t> hashes(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    hashes[i] = Dict::hash(keys[i]);
+  }
 
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    // the bucket slot is loaded two distances ahead, its first entry one distance ahead
+    if (i + 2 * prefetch_distance < keys.size()) {
+      key_values_.prefetch_bucket(hashes[i + 2 * prefetch_distance]);
+    }
+    if (i + prefetch_distance < keys.size()) {
+      key_values_.prefetch_entry(hashes[i + prefetch_distance]);
+    }
+
+    callback(key_values_.find(keys[i], hashes[i]));
+  }
+}
+
+void RedisStore::propose_commit(uint8_t type, std::vector<std::string> strs, const CommitCallback& callback) {
   RaftCommit commit;
+  commit.redis_data.type = type;
+  commit.redis_data.strs = std::move(strs);
+  propose(commit, callback);
+}
+
+void RedisStore::propose_batch(std::vector<RedisCommitData> batch, const CommitCallback& callback) {
+  RaftCommit commit;
+  commit.redis_data.type = RedisCommitData::kCommitMulti;
+  commit.batch = std::move(batch);
+  propose(commit, callback);
+}
+
+void RedisStore::propose(RaftCommit& commit, const CommitCallback& callback) {
+  uint32_t commit_id = next_request_id_++;
   commit.node_id = static_cast<uint32_t>(server_->node_id());
   commit.commit_id = commit_id;
-  commit.redis_data.type = RedisCommitData::kCommitSet;
-  commit.redis_data.strs.push_back(std::move(key));
-  commit.redis_data.strs.push_back(std::move(value));
 
   msgpack::sbuffer sbuf;
   msgpack::pack(sbuf, commit);
@@ -202,115 +558,825 @@ void RedisStore::set(std::string key, std::string value, const StatusCallback& c
         return;
       }
 
-      auto it = pending_requests_.find(commit_id);
-      if (it != pending_requests_.end()) {
-        it->second(status);
-        pending_requests_.erase(it);
-      }
+      this->reply_commit(commit_id, status, RedisCommitResult());
     });
   });
 }
 
-void RedisStore::del(std::vector<std::string> keys, const StatusCallback& callback) {
-  uint32_t commit_id = next_request_id_++;
+struct ImportJob {
+  std::unique_ptr<SnapshotReader> reader;
+  size_t next_chunk;
+  std::vector<char> chunk_data;   // of the chunk being proposed
+  msgpack::object_handle chunk;   // its map of keys to values
+  uint32_t chunk_keys;
+  uint32_t next_key;
+  size_t pending;  // entries proposed and not yet applied
+  uint64_t keys;   // keys of the entries applied
+  uint64_t index;  // of the last entry applied
+  Status status;
+  CommitCallback callback;
+};
 
-  RaftCommit commit;
-  commit.node_id = static_cast<uint32_t>(server_->node_id());
-  commit.commit_id = commit_id;
-  commit.redis_data.type = RedisCommitData::kCommitDel;
-  commit.redis_data.strs = std::move(keys);
-  msgpack::sbuffer sbuf;
-  msgpack::pack(sbuf, commit);
-  std::shared_ptr<std::vector<uint8_t>> data(new std::vector<uint8_t>(sbuf.data(), sbuf.data() + sbuf.size()));
+// next_import_entry packs the next keys of job into a msgpack map of about
+// kImportEntryBytes, count is 0 once all chunks are read
+static Status next_import_entry(ImportJob& job, std::string& entry, uint32_t& count) {
+  msgpack::sbuffer body;
+  msgpack::packer<msgpack::sbuffer> packer(&body);
+  count = 0;
+  while (body.size() < kImportEntryBytes) {
+    if (job.next_key == job.chunk_keys) {
+      if (job.next_chunk == job.reader->chunk_count()) {
+        break;
+      }
+      Status status = job.reader->read_chunk(job.next_chunk++, job.chunk_data);
+      if (!status.is_ok()) {
+        return status;
+      }
+      try {
+        job.chunk = msgpack::unpack(job.chunk_data.data(), job.chunk_data.size());
+      } catch (std::exception& e) {
+        return Status::io_error("invalid snapshot chunk");
+      }
+      if (job.chunk.get().type != msgpack::type::MAP) {
+        return Status::io_error("invalid snapshot chunk");
+      }
+      job.chunk_keys = job.chunk.get().via.map.size;
+      job.next_key = 0;
+      continue;
+    }
 
-  pending_requests_[commit_id] = callback;
+    const msgpack::object_kv& kv = job.chunk.get().via.map.ptr[job.next_key++];
+    if (kv.key.type != msgpack::type::STR || kv.val.type != msgpack::type::STR) {
+      return Status::io_error("invalid snapshot chunk");
+    }
+    packer.pack_str(kv.key.via.str.size);
+    packer.pack_str_body(kv.key.via.str.ptr, kv.key.via.str.size);
+    packer.pack_str(kv.val.via.str.size);
+    packer.pack_str_body(kv.val.via.str.ptr, kv.val.via.str.size);
+    ++count;
+  }
 
-  server_->propose(std::move(data), [this, commit_id](const Status& status) {
-    io_service_.post([commit_id, status, this]() {
+  msgpack::sbuffer head;
+  msgpack::packer<msgpack::sbuffer>(&head).pack_map(count);
+  entry.reserve(head.size() + body.size());
+  entry.assign(head.data(), head.size());
+  entry.append(body.data(), body.size());
+  return Status::ok();
+}
+
+void RedisStore::import(const std::string& name, const CommitCallback& callback) {
+  std::string path;
+  ImportJobPtr job(new ImportJob());
+  Status status = server_->backup_path(name, path);
+  if (status.is_ok()) {
+    status = SnapshotReader::open(path, job->reader);
+  }
+  if (status.is_ok() && job->reader->base_index() != 0) {
+    status = Status::invalid_argument("can not import a delta snapshot");
+  }
+  for (size_t i = 0; status.is_ok() && i < job->reader->chunk_count(); ++i) {
+    // raw chunks, of a snapshot in the first format, are not decodable on their own
+    if (job->reader->chunk(i).count == 0) {
+      status = Status::not_supported("snapshot format");
+    }
+  }
+  if (!status.is_ok()) {
+    callback(status, RedisCommitResult());
+    return;
+  }
+
+  LOG_INFO("importing %s, %lu chunks", path.c_str(), job->reader->chunk_count());
+  job->next_chunk = 0;
+  job->chunk_keys = 0;
+  job->next_key = 0;
+  job->pending = 0;
+  job->keys = 0;
+  job->index = 0;
+  job->callback = callback;
+  import_next(job);
+}
+
+void RedisStore::import_next(const ImportJobPtr& job) {
+  bool done = false;
+  while (job->status.is_ok() && job->pending < kImportWindow && !done) {
+    RaftCommit commit;
+    commit.redis_data.type = RedisCommitData::kCommitImport;
+    commit.redis_data.strs.resize(1);
+    uint32_t count = 0;
+    Status status = next_import_entry(*job, commit.redis_data.strs[0], count);
+    if (!status.is_ok()) {
+      job->status = status;
+      break;
+    }
+    if (count == 0) {
+      done = true;
+      break;
+    }
+
+    ++job->pending;
+    propose(commit, [this, job](const Status& status, const RedisCommitResult& result) {
+      --job->pending;
+      if (!status.is_ok()) {
+        if (job->status.is_ok()) {
+          job->status = status;
+        }
+      } else {
+        job->keys += static_cast<uint64_t>(result.integer);
+        job->index = std::max(job->index, result.index);
+      }
+      this->import_next(job);
+    });
+  }
+
+  if (job->pending > 0 || (job->status.is_ok() && !done)) {
+    return;
+  }
+  if (job->status.is_ok()) {
+    LOG_INFO("imported %lu keys at index %lu", job->keys, job->index);
+  }
+  RedisCommitResult result;
+  result.index = job->index;
+  result.integer = static_cast<int64_t>(job->keys);
+  job->callback(job->status, result);
+}
+
+bool RedisStore::leader_redirect(uint64_t& lead, std::string& address) const {
+  return server_->leader_redirect(lead, address);
+}
+
+void RedisStore::wait_applied(uint64_t index, uint32_t timeout_ms, const StatusCallback& callback) {
+  if (applied_index_ >= index) {
+    callback(Status::ok());
+    return;
+  }
+
+  IndexWaiterPtr waiter(new IndexWaiter(io_service_, index, callback));
+  index_waiters_.insert(std::make_pair(index, waiter));
+  ++waiter_count_;
+
+  if (timeout_ms > 0) {
+    waiter->timer.expires_from_now(boost::posix_time::millisec(timeout_ms));
+    waiter->timer.async_wait([this, waiter](const boost::system::error_code& err) {
+      if (err || waiter->done) {
+        return;
+      }
+      waiter->done = true;
 
-      auto it = pending_requests_.find(commit_id);
-      if (it != pending_requests_.end()) {
-        it->second(status);
-        pending_requests_.erase(it);
+      auto range = index_waiters_.equal_range(waiter->index);
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == waiter) {
+          index_waiters_.erase(it);
+          --waiter_count_;
+          break;
+        }
       }
+      waiter->callback(Status::io_error("wait applied index timeout"));
+    });
+  }
+
+  // the apply thread may have moved past index before it saw the waiter
+  if (applied_index_ >= index) {
+    notify_applied();
+  }
+}
+
+void RedisStore::set_applied_index(uint64_t index) {
+  applied_index_ = index;
+  if (waiter_count_ > 0) {
+    io_service_.post([this]() {
+      this->notify_applied();
     });
+  }
+}
+
+void RedisStore::notify_applied() {
+  while (!index_waiters_.empty() && index_waiters_.begin()->first <= applied_index_) {
+    IndexWaiterPtr waiter = index_waiters_.begin()->second;
+    index_waiters_.erase(index_waiters_.begin());
+    --waiter_count_;
+    if (waiter->done) {
+      continue;
+    }
+    waiter->done = true;
+    waiter->timer.cancel();
+    waiter->callback(Status::ok());
+  }
+}
+
+Status RedisStore::fork_child(const char* name,
+                              uint64_t index,
+                              std::thread& worker,
+                              const std::string& tmp_path,
+                              const std::string& path,
+                              const std::function<Status(RateLimiter*)>& body,
+                              const StatusCallback& callback) {
+  if (worker.joinable()) {
+    worker.join();
+  }
+
+  // reads on the session thread move entries of an image to the heap under
+  // mutex_, the child must not see one half moved
+  pid_t pid;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    pid = fork();
+  }
+  if (pid < 0) {
+    return Status::io_error(strerror(errno));
+  }
+
+  if (pid == 0) {
+    lower_priority();
+    RateLimiter rate_limiter(snapshot_write_rate_);
+    Status status = body(snapshot_write_rate_ > 0 ? &rate_limiter : nullptr);
+    _exit(status.is_ok() ? 0 : 1);
+  }
+
+  LOG_DEBUG("%s child %d started at index %lu", name, pid, index);
+  worker = std::thread([pid, tmp_path, path, callback] {
+    Status status = wait_child(pid);
+    if (status.is_ok() && !path.empty() && rename(tmp_path.c_str(), path.c_str()) != 0) {
+      status = Status::io_error(strerror(errno));
+    }
+    if (!status.is_ok()) {
+      unlink(tmp_path.c_str());
+    }
+    callback(status);
   });
+  return Status::ok();
 }
 
-void RedisStore::get_snapshot(const GetSnapshotCallback& callback) {
-  io_service_.post([this, callback] {
-    msgpack::sbuffer sbuf;
-    msgpack::pack(sbuf, this->key_values_);
-    SnapshotDataPtr data(new std::vector<uint8_t>(sbuf.data(), sbuf.data() + sbuf.size()));
-    callback(data);
+void RedisStore::get_snapshot(const std::string& tmp_path,
+                              const std::string& image_tmp_path,
+                              const proto::SnapshotMetadata& meta,
+                              uint64_t base_index,
+                              const SnapshotCallback& callback) {
+  // forked on the apply thread, the child sees key_values_ as of meta.index
+  apply_service_.post([this, tmp_path, image_tmp_path, meta, base_index, callback] {
+    bool delta = base_index != 0 && !dirty_overflow_;
+    auto body = [this, tmp_path, image_tmp_path, meta, base_index, delta](RateLimiter* limiter) {
+      Status status = delta ? save_delta(key_values_, dirty_keys_, tmp_path, meta, base_index, limiter)
+                            : save_key_values(key_values_, tmp_path, meta, limiter);
+      if (status.is_ok() && !delta && !image_tmp_path.empty()
+          && !key_values_.save_image(image_tmp_path, limiter).is_ok()) {
+        unlink(image_tmp_path.c_str());
+      }
+      return status;
+    };
+    Status status = fork_child(delta ? "delta snapshot" : "snapshot",
+                               meta.index,
+                               snapshot_worker_,
+                               tmp_path,
+                               std::string(),
+                               body,
+                               [callback, delta](const Status& status) {
+                                 callback(status, delta);
+                               });
+    if (!status.is_ok()) {
+      callback(status, delta);
+      return;
+    }
+
+    // the next delta starts from this snapshot, if it fails the next one is full
+    dirty_keys_.clear();
+    dirty_overflow_ = false;
   });
 }
 
-void RedisStore::recover_from_snapshot(SnapshotDataPtr snap, const StatusCallback& callback) {
-  io_service_.post([this, snap, callback] {
-    std::unordered_map<std::string, std::string> kv;
-    msgpack::object_handle oh = msgpack::unpack((const char*) snap->data(), snap->size());
-    try {
-      oh.get().convert(kv);
-    } catch (std::exception& e) {
-      callback(Status::io_error("invalid snapshot"));
+void RedisStore::save_checkpoint(const std::string& path,
+                                 const proto::SnapshotMetadata& meta,
+                                 uint64_t base_index,
+                                 const StatusCallback& callback) {
+  // the keys changed since the snapshot at base_index stay tracked for the next delta
+  apply_service_.post([this, path, meta, base_index, callback] {
+    if (dirty_overflow_) {
+      callback(Status::not_supported("too many keys changed since the snapshot"));
+      return;
+    }
+
+    std::string tmp_path = path + ".tmp";
+    auto body = [this, tmp_path, meta, base_index](RateLimiter* limiter) {
+      return save_delta(key_values_, dirty_keys_, tmp_path, meta, base_index, limiter);
+    };
+    Status status = fork_child("checkpoint", meta.index, checkpoint_worker_, tmp_path, path, body, callback);
+    if (!status.is_ok()) {
+      callback(status);
+    }
+  });
+}
+
+void RedisStore::backup(const std::string& name, const CommitCallback& callback) {
+  std::string path;
+  Status status = server_->backup_path(name, path);
+  if (!status.is_ok()) {
+    callback(status, RedisCommitResult());
+    return;
+  }
+  server_->backup(path, [this, callback](const Status& status, uint64_t index) {
+    io_service_.post([status, index, callback] {
+      RedisCommitResult result;
+      result.index = index;
+      callback(status, result);
+    });
+  });
+}
+
+void RedisStore::save_backup(const std::string& path, const proto::SnapshotMetadata& meta, const StatusCallback& callback) {
+  // the keys tracked for the next delta are left alone
+  apply_service_.post([this, path, meta, callback] {
+    if (backup_in_progress_) {
+      callback(Status::io_error("backup already in progress"));
+      return;
+    }
+
+    std::string tmp_path = path + ".tmp";
+    auto body = [this, tmp_path, meta](RateLimiter* limiter) {
+      return save_key_values(key_values_, tmp_path, meta, limiter);
+    };
+    backup_in_progress_ = true;
+    Status status = fork_child("backup", meta.index, backup_worker_, tmp_path, path, body,
+                               [this, callback](const Status& status) {
+                                 backup_in_progress_ = false;
+                                 callback(status);
+                               });
+    if (!status.is_ok()) {
+      backup_in_progress_ = false;
+      callback(status);
+    }
+  });
+}
+
+void RedisStore::recover_from_snapshot(const std::vector<std::string>& snap_paths,
+                                       uint64_t snap_index,
+                                       const StatusCallback& callback) {
+  apply_service_.post([this, snap_paths, snap_index, callback] {
+    Dict kv;
+    Status status = load_snapshot(snap_paths, std::string(), kv);
+    if (!status.is_ok()) {
+      callback(status);
       return;
     }
-    std::swap(kv, key_values_);
+    std::set<std::string> ordered_keys;
+    if (ordered_index_) {
+      build_ordered_keys(kv, ordered_keys);
+    }
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      kv.swap(key_values_);
+      ordered_keys.swap(ordered_keys_);
+    }
+    // the old key space is freed without stalling the apply thread
+    std::shared_ptr<Dict> old_key_values(new Dict());
+    old_key_values->swap(kv);
+    std::shared_ptr<std::set<std::string>> old_ordered_keys(new std::set<std::string>());
+    old_ordered_keys->swap(ordered_keys);
+    release_in_background(old_key_values, old_ordered_keys);
+
+    // the key space no longer derives from the last snapshot taken
+    dirty_keys_.clear();
+    dirty_overflow_ = true;
+    if (snap_index > applied_index_) {
+      set_applied_index(snap_index);
+    }
     callback(Status::ok());
   });
 }
 
+void RedisStore::release_in_background(std::shared_ptr<Dict> key_values,
+                                       std::shared_ptr<std::set<std::string>> ordered_keys) {
+  LOG_DEBUG("releasing %lu keys", key_values->size());
+  release_service_.post([key_values, ordered_keys] {
+    // the allocator is shared with the apply thread, it is yielded to between batches
+    uint64_t cursor = 0;
+    do {
+      cursor = key_values->release(cursor, kReleaseBatch);
+      std::this_thread::yield();
+    } while (cursor != 0);
+
+    while (!ordered_keys->empty()) {
+      auto end = ordered_keys->begin();
+      for (size_t i = 0; i < kReleaseBatch && end != ordered_keys->end(); ++i) {
+        ++end;
+      }
+      ordered_keys->erase(ordered_keys->begin(), end);
+      std::this_thread::yield();
+    }
+  });
+}
+
 void RedisStore::keys(const char* pattern, int len, std::vector<std::string>& keys) {
-  for (auto it = key_values_.begin(); it != key_values_.end(); ++it) {
-    if (string_match_len(pattern, len, it->first.c_str(), it->first.size(), 0)) {
-      keys.push_back(it->first);
+  GlobMatcher matcher(pattern, len);
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (ordered_index_ && !matcher.prefix().empty()) {
+    prefix_keys(matcher, keys);
+    return;
+  }
+  key_values_.for_each([&matcher, &keys](const std::string& key, const std::string& value) {
+    if (matcher.match(key)) {
+      keys.push_back(key);
+    }
+  });
+}
+
+bool RedisStore::scan(uint64_t cursor,
+                      const char* pattern,
+                      int len,
+                      size_t count,
+                      uint64_t& next,
+                      std::vector<std::string>& keys) {
+  GlobMatcher matcher(pattern, len);
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (ordered_index_ && !matcher.prefix().empty()) {
+    return prefix_scan(cursor, matcher, count, next, keys);
+  }
+  next = key_values_.scan(cursor, count, [&matcher, &keys](const std::string& key, const std::string& value) {
+    if (matcher.match(key)) {
+      keys.push_back(key);
+    }
+  });
+  return true;
+}
+
+void RedisStore::prefix_keys(const GlobMatcher& matcher, std::vector<std::string>& keys) {
+  const std::string& prefix = matcher.prefix();
+  for (auto it = ordered_keys_.lower_bound(prefix); it != ordered_keys_.end(); ++it) {
+    if (it->compare(0, prefix.size(), prefix) != 0) {
+      break;
+    }
+    if (matcher.match(*it)) {
+      keys.push_back(*it);
+    }
+  }
+}
+
+bool RedisStore::prefix_scan(uint64_t cursor,
+                             const GlobMatcher& matcher,
+                             size_t count,
+                             uint64_t& next,
+                             std::vector<std::string>& keys) {
+  const std::string& prefix = matcher.prefix();
+  auto it = ordered_keys_.lower_bound(prefix);
+  if (cursor != 0) {
+    // starting over would return the keys visited again, and might never end
+    auto last = scan_cursors_.find(cursor);
+    if (last == scan_cursors_.end() || last->second.compare(0, prefix.size(), prefix) != 0) {
+      return false;
+    }
+    // the keys inserted or erased since are seen or not as they are now
+    it = ordered_keys_.upper_bound(last->second);
+  }
+
+  next = 0;
+  for (size_t n = 0; n < count && it != ordered_keys_.end(); ++n, ++it) {
+    if (it->compare(0, prefix.size(), prefix) != 0) {
+      return true;
+    }
+    if (matcher.match(*it)) {
+      keys.push_back(*it);
+    }
+  }
+  if (it == ordered_keys_.end() || it->compare(0, prefix.size(), prefix) != 0) {
+    return true;
+  }
+
+  // 0 ends a scan, it is never a cursor
+  next = ++next_scan_cursor_ == 0 ? ++next_scan_cursor_ : next_scan_cursor_;
+  scan_cursors_[next] = *std::prev(it);
+  if (scan_cursors_.size() > kMaxScanCursors) {
+    scan_cursors_.erase(scan_cursors_.begin());
+  }
+  return true;
+}
+
+bool RedisStore::range(const std::string& start,
+                       const std::string& end,
+                       size_t count,
+                       std::vector<std::string>& key_values) {
+  if (!ordered_index_) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (auto it = ordered_keys_.lower_bound(start); it != ordered_keys_.end() && count > 0; ++it, --count) {
+    if (!end.empty() && *it >= end) {
+      break;
+    }
+    key_values.push_back(*it);
+    key_values.push_back(*key_values_.find(*it));
+  }
+  return true;
+}
+
+// see redis string2ll, an optional minus sign and digits without a leading zero,
+// "0" is the only way to write zero
+bool string_to_int64(const std::string& str, int64_t& value) {
+  const char* p = str.data();
+  size_t len = str.size();
+  if (len == 0 || len > 20) {
+    return false;
+  }
+  if (len == 1 && p[0] == '0') {
+    value = 0;
+    return true;
+  }
+
+  bool negative = false;
+  if (p[0] == '-') {
+    negative = true;
+    ++p;
+    --len;
+  }
+  if (len == 0 || p[0] < '1' || p[0] > '9') {
+    return false;
+  }
+
+  uint64_t v = 0;
+  for (; len > 0; ++p, --len) {
+    if (*p < '0' || *p > '9') {
+      return false;
+    }
+    uint64_t digit = static_cast<uint64_t>(*p - '0');
+    if (v > (UINT64_MAX - digit) / 10) {
+      return false;
+    }
+    v = v * 10 + digit;
+  }
+
+  if (negative) {
+    if (v > static_cast<uint64_t>(INT64_MAX) + 1) {
+      return false;
+    }
+    value = -static_cast<int64_t>(v - 1) - 1;
+  } else {
+    if (v > static_cast<uint64_t>(INT64_MAX)) {
+      return false;
     }
+    value = static_cast<int64_t>(v);
   }
+  return true;
+}
+
+// reply_on_commit returns true for commits whose reply does not depend on the
+// key space, they are acknowledged as soon as they are committed.
+static bool reply_on_commit(const RedisCommitData& data) {
+  return data.type == RedisCommitData::kCommitSet || data.type == RedisCommitData::kCommitDel;
 }
 
 void RedisStore::read_commit(proto::EntryPtr entry) {
-  auto cb = [this, entry] {
-    RaftCommit commit;
-    try {
-      msgpack::object_handle oh = msgpack::unpack((const char*) entry->data.data(), entry->data.size());
-      oh.get().convert(commit);
+  uint64_t index = entry->index;
+  std::shared_ptr<RaftCommit> commit(new RaftCommit());
+  try {
+    msgpack::object_handle oh = msgpack::unpack((const char*) entry->data.data(), entry->data.size());
+    oh.get().convert(*commit);
+  }
+  catch (std::exception& e) {
+    LOG_ERROR("bad entry %s", e.what());
+    apply_service_.post([this, index] {
+      this->set_applied_index(index);
+    });
+    return;
+  }
+
+  bool local = commit->node_id == server_->node_id();
+  bool early_reply = local && reply_on_commit(commit->redis_data);
+  if (early_reply) {
+    RedisCommitResult result;
+    result.index = index;
+    uint32_t commit_id = commit->commit_id;
+    io_service_.post([this, commit_id, result] {
+      this->reply_commit(commit_id, Status::ok(), result);
+    });
+  }
 
+  apply_service_.post([this, index, commit, local, early_reply] {
+    RedisCommitResult result;
+    result.index = index;
+    Status status = this->apply_commit(*commit, result);
+    this->set_applied_index(index);
+
+    if (local && !early_reply) {
+      uint32_t commit_id = commit->commit_id;
+      io_service_.post([this, commit_id, status, result] {
+        this->reply_commit(commit_id, status, result);
+      });
     }
-    catch (std::exception& e) {
-      LOG_ERROR("bad entry %s", e.what());
-      return;
+  });
+}
+
+Status RedisStore::apply_commit(RaftCommit& commit, RedisCommitResult& result) {
+  // a batch is applied under one lock, readers never observe part of it
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (commit.redis_data.type != RedisCommitData::kCommitMulti) {
+    return apply_data(commit.redis_data, result);
+  }
+
+  result.batch = std::make_shared<RedisBatchResult>();
+  for (RedisCommitData& data : commit.batch) {
+    RedisCommitResult data_result;
+    data_result.index = result.index;
+    Status status = apply_data(data, data_result);
+    result.batch->push_back(std::make_pair(status, std::move(data_result)));
+  }
+  return Status::ok();
+}
+
+void RedisStore::mark_dirty(const std::string& key) {
+  if (dirty_overflow_) {
+    return;
+  }
+  dirty_keys_.insert(key);
+  if (dirty_keys_.size() > kSnapshotBatch && dirty_keys_.size() > key_values_.size() / 2) {
+    // a delta this large costs about as much as a full snapshot
+    dirty_keys_.clear();
+    dirty_overflow_ = true;
+  }
+}
+
+void RedisStore::mark_dirty(const RedisCommitData& data) {
+  switch (data.type) {
+    case RedisCommitData::kCommitSet:
+    case RedisCommitData::kCommitMSetNX: {
+      for (size_t i = 0; i < data.strs.size(); i += 2) {
+        mark_dirty(data.strs[i]);
+      }
+      break;
     }
-    RedisCommitData& data = commit.redis_data;
+    case RedisCommitData::kCommitDel: {
+      for (const std::string& key : data.strs) {
+        mark_dirty(key);
+      }
+      break;
+    }
+    case RedisCommitData::kCommitIncrBy:
+    case RedisCommitData::kCommitAppend:
+    case RedisCommitData::kCommitGetSet:
+    case RedisCommitData::kCommitSetNX:
+    case RedisCommitData::kCommitCas: {
+      if (!data.strs.empty()) {
+        mark_dirty(data.strs[0]);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
 
-    switch (data.type) {
-      case RedisCommitData::kCommitSet: {
-        assert(data.strs.size() == 2);
-        this->key_values_[std::move(data.strs[0])] = std::move(data.strs[1]);
-        break;
+Status RedisStore::apply_data(RedisCommitData& data, RedisCommitResult& result) {
+  mark_dirty(data);
+  switch (data.type) {
+    case RedisCommitData::kCommitSet: {
+      assert(data.strs.size() % 2 == 0);
+      for (size_t i = 0; i + 1 < data.strs.size(); i += 2) {
+        *insert(std::move(data.strs[i])).first = std::move(data.strs[i + 1]);
       }
-      case RedisCommitData::kCommitDel: {
-        for (const std::string& key : data.strs) {
-          this->key_values_.erase(key);
+      break;
+    }
+    case RedisCommitData::kCommitMSetNX: {
+      assert(data.strs.size() % 2 == 0);
+      result.integer = 1;
+      for (size_t i = 0; i < data.strs.size(); i += 2) {
+        if (this->key_values_.find(data.strs[i])) {
+          result.integer = 0;
+          break;
         }
-        break;
       }
-      default: {
-        LOG_ERROR("not supported type %d", data.type);
+      if (result.integer == 1) {
+        for (size_t i = 0; i + 1 < data.strs.size(); i += 2) {
+          *insert(std::move(data.strs[i])).first = std::move(data.strs[i + 1]);
+        }
       }
+      break;
     }
+    case RedisCommitData::kCommitIncrBy: {
+      assert(data.strs.size() == 2);
+      int64_t delta = 0;
+      int64_t value = 0;
+      if (!string_to_int64(data.strs[1], delta)) {
+        return Status::invalid_argument("value is not an integer or out of range");
+      }
+
+      std::string* exist = this->key_values_.find(data.strs[0]);
+      if (exist && !string_to_int64(*exist, value)) {
+        return Status::invalid_argument("value is not an integer or out of range");
+      }
+      if (__builtin_add_overflow(value, delta, &value)) {
+        return Status::invalid_argument("increment or decrement would overflow");
+      }
 
-    if (commit.node_id == server_->node_id()) {
-      auto it = pending_requests_.find(commit.commit_id);
-      if (it != pending_requests_.end()) {
-        it->second(Status::ok());
-        pending_requests_.erase(it);
+      if (exist) {
+        *exist = std::to_string(value);
+      } else {
+        *insert(std::move(data.strs[0])).first = std::to_string(value);
       }
+      result.integer = value;
+      break;
     }
-  };
+    case RedisCommitData::kCommitAppend: {
+      assert(data.strs.size() == 2);
+      std::string& value = *insert(std::move(data.strs[0])).first;
+      value.append(data.strs[1]);
+      result.integer = static_cast<int64_t>(value.size());
+      break;
+    }
+    case RedisCommitData::kCommitGetSet: {
+      assert(data.strs.size() == 2);
+      std::string* exist = this->key_values_.find(data.strs[0]);
+      if (exist) {
+        result.nil = false;
+        result.value.swap(*exist);
+        *exist = std::move(data.strs[1]);
+      } else {
+        insert(std::move(data.strs[0]), std::move(data.strs[1]));
+      }
+      break;
+    }
+    case RedisCommitData::kCommitSetNX: {
+      assert(data.strs.size() == 2);
+      auto ret = insert(std::move(data.strs[0]), std::move(data.strs[1]));
+      result.integer = ret.second ? 1 : 0;
+      break;
+    }
+    case RedisCommitData::kCommitGet: {
+      assert(data.strs.size() == 1);
+      const std::string* exist = this->key_values_.find(data.strs[0]);
+      if (exist) {
+        result.nil = false;
+        result.value = *exist;
+      }
+      break;
+    }
+    case RedisCommitData::kCommitCas: {
+      assert(data.strs.size() == 3);
+      std::string* exist = this->key_values_.find(data.strs[0]);
+      if (exist && *exist == data.strs[1]) {
+        *exist = std::move(data.strs[2]);
+        result.integer = 1;
+      } else {
+        result.integer = 0;
+      }
+      break;
+    }
+    case RedisCommitData::kCommitDel: {
+      for (const std::string& key : data.strs) {
+        erase(key);
+      }
+      break;
+    }
+    case RedisCommitData::kCommitImport: {
+      if (data.strs.size() != 1) {
+        return Status::invalid_argument("import chunk");
+      }
+      try {
+        msgpack::object_handle oh = msgpack::unpack(data.strs[0].data(), data.strs[0].size());
+        const msgpack::object& obj = oh.get();
+        if (obj.type != msgpack::type::MAP) {
+          return Status::io_error("invalid import chunk");
+        }
+        for (uint32_t i = 0; i < obj.via.map.size; ++i) {
+          const msgpack::object_kv& kv = obj.via.map.ptr[i];
+          std::string key = kv.key.as<std::string>();
+          mark_dirty(key);
+          *insert(std::move(key)).first = kv.val.as<std::string>();
+        }
+        result.integer = obj.via.map.size;
+      } catch (std::exception& e) {
+        return Status::io_error("invalid import chunk");
+      }
+      break;
+    }
+    default: {
+      LOG_ERROR("not supported type %d", data.type);
+      return Status::not_supported("commit type");
+    }
+  }
+  return Status::ok();
+}
 
-  io_service_.post(std::move(cb));
+std::pair<std::string*, bool> RedisStore::insert(std::string key, std::string value) {
+  if (!ordered_index_) {
+    return key_values_.emplace(std::move(key), std::move(value));
+  }
+
+  auto ret = key_values_.emplace(key, std::move(value));
+  if (ret.second) {
+    ordered_keys_.insert(std::move(key));
+  }
+  return ret;
 }
 
+void RedisStore::erase(const std::string& key) {
+  if (key_values_.erase(key) && ordered_index_) {
+    ordered_keys_.erase(key);
+  }
 }
 
+void RedisStore::reply_commit(uint32_t commit_id, const Status& status, const RedisCommitResult& result) {
+  auto it = pending_requests_.find(commit_id);
+  if (it != pending_requests_.end()) {
+    it->second(status, result);
+    pending_requests_.erase(it);
+  }
+}
+
+}
@@ -1,20 +1,37 @@
 #pragma once
 #include <boost/asio.hpp>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <set>
 #include <thread>
 #include <future>
+#include <mutex>
+#include <atomic>
 #include <raft-kv/common/status.h>
+#include <raft-kv/common/dict.h>
+#include <raft-kv/common/glob.h>
 #include <raft-kv/raft/proto.h>
 #include <msgpack.hpp>
 
 namespace kv {
 
-int string_match_len(const char* pattern, int patternLen,
-                     const char* string, int stringLen, int nocase);
+// string_to_int64 parses the integers redis accepts, returns false for anything
+// else: a sign other than a leading minus, leading zeros, "-0", spaces or overflow
+bool string_to_int64(const std::string& str, int64_t& value);
 
 struct RedisCommitData {
   static const uint8_t kCommitSet = 0;
   static const uint8_t kCommitDel = 1;
+  static const uint8_t kCommitMSetNX = 2;
+  static const uint8_t kCommitIncrBy = 3;
+  static const uint8_t kCommitAppend = 4;
+  static const uint8_t kCommitGetSet = 5;
+  static const uint8_t kCommitSetNX = 6;
+  static const uint8_t kCommitCas = 7;
+  static const uint8_t kCommitGet = 8;   // only within a batch
+  static const uint8_t kCommitMulti = 9; // the commits are in RaftCommit::batch
+  static const uint8_t kCommitImport = 10; // strs[0] is a msgpack map of keys to values of a snapshot
 
   uint8_t type;
   std::vector<std::string> strs;
@@ -28,17 +45,55 @@ struct RaftCommit {
   uint32_t node_id;
   uint32_t commit_id;
   RedisCommitData redis_data;
-  MSGPACK_DEFINE (node_id, commit_id, redis_data);
+  // batch was appended to the fields of the entries in the WAL, msgpack leaves
+  // the fields missing from a shorter array as they are, so that the entries
+  // written before it decode with an empty batch
+  std::vector<RedisCommitData> batch;
+  MSGPACK_DEFINE (node_id, commit_id, redis_data, batch);
+};
+
+struct RedisCommitResult;
+typedef std::vector<std::pair<Status, RedisCommitResult>> RedisBatchResult;
+
+struct RedisCommitResult {
+  RedisCommitResult()
+      : index(0),
+        integer(0),
+        nil(true) {
+  }
+
+  uint64_t index;    // raft index the commit was applied at
+  int64_t integer;   // integer reply of conditional and counter commits
+  bool nil;          // value is not set
+  std::string value; // previous value of GETSET, value of GET within a batch
+  std::shared_ptr<RedisBatchResult> batch; // results of the commits of a batch
 };
 
 typedef std::function<void(const Status&)> StatusCallback;
-typedef std::shared_ptr<std::vector<uint8_t>> SnapshotDataPtr;
-typedef std::function<void(SnapshotDataPtr)> GetSnapshotCallback;
+typedef std::function<void(const Status&, const RedisCommitResult&)> CommitCallback;
+typedef std::function<void(const Status&, bool delta)> SnapshotCallback;
+
+struct IndexWaiter;
+typedef std::shared_ptr<IndexWaiter> IndexWaiterPtr;
+
+struct ImportJob;
+typedef std::shared_ptr<ImportJob> ImportJobPtr;
 
 class RaftNode;
 class RedisStore {
  public:
-  explicit RedisStore(RaftNode* server, std::vector<uint8_t> snap, uint16_t port);
+  // the key space is loaded from the files of a snapshot, a full snapshot
+  // followed by its deltas. If image_path is not empty, the image of the full
+  // snapshot is mapped instead of decoding it. If checkpoint_path is not empty,
+  // the checkpoint is applied on top of the snapshot and snap_index is its index.
+  explicit RedisStore(RaftNode* server,
+                      const std::vector<std::string>& snap_paths,
+                      const std::string& image_path,
+                      const std::string& checkpoint_path,
+                      uint64_t snap_index,
+                      uint16_t port,
+                      bool ordered_index,
+                      uint64_t snapshot_write_rate);
 
   ~RedisStore();
 
@@ -47,42 +102,242 @@ class RedisStore {
     if (worker_.joinable()) {
       worker_.join();
     }
+    apply_work_.reset();
+    apply_service_.stop();
+    if (apply_worker_.joinable()) {
+      apply_worker_.join();
+    }
+    if (snapshot_worker_.joinable()) {
+      snapshot_worker_.join();
+    }
+    // the key spaces still queued are freed before returning
+    release_work_.reset();
+    if (release_worker_.joinable()) {
+      release_worker_.join();
+    }
+    if (backup_worker_.joinable()) {
+      backup_worker_.join();
+    }
+    if (checkpoint_worker_.joinable()) {
+      checkpoint_worker_.join();
+    }
   }
 
   void start(std::promise<pthread_t>& promise);
 
   bool get(const std::string& key, std::string& value) {
-    auto it = key_values_.find(key);
-    if (it != key_values_.end()) {
-      value = it->second;
+    std::lock_guard<std::mutex> guard(mutex_);
+    const std::string* exist = key_values_.find(key);
+    if (exist) {
+      value = *exist;
       return true;
     } else {
       return false;
     }
   }
 
-  void set(std::string key, std::string value, const StatusCallback& callback);
+  // propose_commit proposes a commit of the given type, callback is called once
+  // it is applied, or committed for the commits that reply without reading the
+  // key space.
+  void propose_commit(uint8_t type, std::vector<std::string> strs, const CommitCallback& callback);
+
+  // propose_batch proposes the commits as a single raft entry that is applied
+  // atomically, the result holds the result of every commit of the batch.
+  void propose_batch(std::vector<RedisCommitData> batch, const CommitCallback& callback);
+
+  // import sets the keys of the full snapshot file name of the backup directory, a
+  // backup or a snapshot written elsewhere. The keys of the chunks of the file are
+  // proposed in entries of about 1MB, a few of them in flight at a time. The result
+  // holds the number of keys imported and the index of the last entry. Entries
+  // applied before an error stay applied.
+  void import(const std::string& name, const CommitCallback& callback);
 
-  void del(std::vector<std::string> keys, const StatusCallback& callback);
+  // mget looks up all keys in one pass, callback is called in the order of keys
+  // with the value or nullptr if the key does not exist.
+  void mget(const std::vector<std::string>& keys, const std::function<void(const std::string*)>& callback);
+
+  // leader_redirect returns true if writes should be sent to the given leader
+  bool leader_redirect(uint64_t& lead, std::string& address) const;
+
+  // applied_index returns the index of the last raft entry applied to the key space
+  uint64_t applied_index() const {
+    return applied_index_;
+  }
 
-  void get_snapshot(const GetSnapshotCallback& callback);
+  // wait_applied calls back once the store has applied the given index, or with
+  // an error if that does not happen within timeout_ms, 0 waits without a limit.
+  // Writes are acknowledged once committed and may not be applied yet, sessions
+  // wait on their last acknowledged index before reading.
+  void wait_applied(uint64_t index, uint32_t timeout_ms, const StatusCallback& callback);
 
-  void recover_from_snapshot(SnapshotDataPtr snap, const StatusCallback& callback);
+  // get_snapshot takes a point in time view of the key space by forking, the child
+  // streams it into a snapshot file at tmp_path while the parent keeps applying
+  // commits. meta.index must be the last index posted to the apply thread. The
+  // callback is called from a background thread once the file is synced.
+  // If base_index is not 0, the last snapshot taken, only the keys changed since
+  // then are written as a delta on top of it, unless too many keys changed. The
+  // callback tells which kind of snapshot was written. If image_tmp_path is not
+  // empty, a full snapshot is followed by an image of the table written there, on
+  // a best effort basis. The child runs at a low cpu and io priority and writes at
+  // most snapshot_write_rate bytes a second, if not 0.
+  void get_snapshot(const std::string& tmp_path,
+                    const std::string& image_tmp_path,
+                    const proto::SnapshotMetadata& meta,
+                    uint64_t base_index,
+                    const SnapshotCallback& callback);
+
+  // save_checkpoint forks like get_snapshot, the child writes the keys changed since
+  // the snapshot at base_index to path, as a delta on top of it. meta.index must be
+  // the last index posted to the apply thread. The callback is called from a
+  // background thread once the file is synced and renamed to path.
+  void save_checkpoint(const std::string& path,
+                       const proto::SnapshotMetadata& meta,
+                       uint64_t base_index,
+                       const StatusCallback& callback);
+
+  // backup writes a full snapshot of the key space as applied by this member to
+  // the file name of the backup directory, see RaftNode::backup. The result holds
+  // the index of the snapshot.
+  void backup(const std::string& name, const CommitCallback& callback);
+
+  // save_backup forks like get_snapshot, the child writes a full snapshot to path.
+  // meta.index must be the last index posted to the apply thread. The callback is
+  // called from a background thread once the file is synced and renamed to path.
+  void save_backup(const std::string& path, const proto::SnapshotMetadata& meta, const StatusCallback& callback);
+
+  // recover_from_snapshot replaces the key space with the one of the snapshot files
+  void recover_from_snapshot(const std::vector<std::string>& snap_paths,
+                             uint64_t snap_index,
+                             const StatusCallback& callback);
 
   void keys(const char* pattern, int len, std::vector<std::string>& keys);
 
+  // range appends the keys in [start, end) in order, each followed by its value,
+  // at most count of them. An empty end is unbounded. Returns false if the
+  // ordered index is disabled.
+  bool range(const std::string& start, const std::string& end, size_t count, std::vector<std::string>& key_values);
+
+  // scan appends the keys matching pattern of the buckets starting at cursor,
+  // visiting about count keys, and sets next to the cursor to continue from, 0
+  // once the whole key space was visited. With the ordered index, a pattern with
+  // a literal prefix is scanned in key order over the keys with the prefix only.
+  // Returns false if such a scan is given a cursor this member does not know.
+  bool scan(uint64_t cursor,
+            const char* pattern,
+            int len,
+            size_t count,
+            uint64_t& next,
+            std::vector<std::string>& keys);
+
+  // read_commit is called by the raft thread for each committed entry. Replies
+  // that do not depend on the key space are sent right away, the entry is applied
+  // asynchronously on the apply thread.
   void read_commit(proto::EntryPtr entry);
 
  private:
   void start_accept();
 
+  void propose(RaftCommit& commit, const CommitCallback& callback);
+
+  // fork_child forks on the apply thread, the child runs body at a low cpu and io
+  // priority with the snapshot write rate and exits. worker, joined first if it
+  // still runs, waits for the child, renames the file it wrote to tmp_path to path
+  // unless path is empty, then calls callback. The file of a failed child is
+  // removed. Returns an error if the fork failed, callback is not called then.
+  Status fork_child(const char* name,
+                    uint64_t index,
+                    std::thread& worker,
+                    const std::string& tmp_path,
+                    const std::string& path,
+                    const std::function<Status(RateLimiter*)>& body,
+                    const StatusCallback& callback);
+
+  // import_next proposes the next entries of job, calls it back once all are applied
+  void import_next(const ImportJobPtr& job);
+
+  Status apply_commit(RaftCommit& commit, RedisCommitResult& result);
+
+  Status apply_data(RedisCommitData& data, RedisCommitResult& result);
+
+  void set_applied_index(uint64_t index);
+
+  // insert and erase modify the key space and the ordered index
+  std::pair<std::string*, bool> insert(std::string key, std::string value = std::string());
+
+  void erase(const std::string& key);
+
+  // mark_dirty records the keys data modifies for the next delta snapshot
+  void mark_dirty(const RedisCommitData& data);
+
+  void mark_dirty(const std::string& key);
+
+  void prefix_keys(const GlobMatcher& matcher, std::vector<std::string>& keys);
+
+  // prefix_scan appends the keys matching matcher among at most count keys with
+  // its prefix, after the key cursor stands for. It sets next to a new cursor
+  // standing for the last key visited, 0 once every key with the prefix was
+  // visited. Returns false if cursor is unknown or stands for a key without the prefix.
+  bool prefix_scan(uint64_t cursor,
+                   const GlobMatcher& matcher,
+                   size_t count,
+                   uint64_t& next,
+                   std::vector<std::string>& keys);
+
+  void notify_applied();
+
+  // release_in_background queues a key space replaced by a snapshot to be freed
+  // on the release thread, a few entries at a time
+  void release_in_background(std::shared_ptr<Dict> key_values, std::shared_ptr<std::set<std::string>> ordered_keys);
+
+  void reply_commit(uint32_t commit_id, const Status& status, const RedisCommitResult& result);
+
   RaftNode* server_;
   boost::asio::io_service io_service_;
   boost::asio::ip::tcp::acceptor acceptor_;
   std::thread worker_;
-  std::unordered_map<std::string, std::string> key_values_;
+
+  // committed entries and snapshots are applied on their own thread, so that
+  // acknowledging writes does not queue behind applying them
+  boost::asio::io_service apply_service_;
+  std::unique_ptr<boost::asio::io_service::work> apply_work_;
+  std::thread apply_worker_;
+
+  // waits for the forked snapshot child
+  std::thread snapshot_worker_;
+
+  // frees the key spaces replaced by snapshots in turn, the apply thread never
+  // waits for one to be freed
+  boost::asio::io_service release_service_;
+  std::unique_ptr<boost::asio::io_service::work> release_work_;
+  std::thread release_worker_;
+
+  // waits for the forked backup child
+  std::thread backup_worker_;
+  std::atomic<bool> backup_in_progress_;
+
+  // waits for the forked checkpoint child
+  std::thread checkpoint_worker_;
+
+  // guards key_values_, which is only modified by the apply thread
+  std::mutex mutex_;
+  Dict key_values_;
+  bool ordered_index_;
+  std::set<std::string> ordered_keys_; // the keys of key_values_ in order if ordered_index_
+  // the key each cursor of a prefix scan stands for, the oldest are forgotten.
+  // The cursors start at a random value, those of another member or of before
+  // a restart are unknown.
+  std::map<uint64_t, std::string> scan_cursors_;
+  uint64_t next_scan_cursor_;
+  // the keys modified since the last snapshot, only touched by the apply thread.
+  // Tracking stops once they are too many for a delta to pay off.
+  std::unordered_set<std::string> dirty_keys_;
+  bool dirty_overflow_;
+  uint64_t snapshot_write_rate_;
   uint32_t next_request_id_;
-  std::unordered_map<uint32_t, StatusCallback> pending_requests_;
+  std::unordered_map<uint32_t, CommitCallback> pending_requests_;
+  std::atomic<uint64_t> applied_index_;
+  std::atomic<uint32_t> waiter_count_;
+  std::multimap<uint64_t, IndexWaiterPtr> index_waiters_;
 };
 
 }
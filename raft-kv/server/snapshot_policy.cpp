@@ -0,0 +1,138 @@
+#include <raft-kv/server/snapshot_policy.h>
+#include <boost/algorithm/string.hpp>
+#include <algorithm>
+#include <vector>
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+
+namespace kv {
+
+static bool parse_size(const std::string& str, uint64_t& value) {
+  if (str.empty()) {
+    return false;
+  }
+  char* end = nullptr;
+  errno = 0;
+  unsigned long long v = strtoull(str.c_str(), &end, 10);
+  if (errno != 0 || end == str.c_str()) {
+    return false;
+  }
+
+  int shift = 0;
+  if (*end != '\0') {
+    switch (tolower(*end)) {
+      case 'k': shift = 10;
+        break;
+      case 'm': shift = 20;
+        break;
+      case 'g': shift = 30;
+        break;
+      default:
+        return false;
+    }
+    if (*(end + 1) != '\0') {
+      return false;
+    }
+  }
+  if (shift > 0 && v > (~0ULL >> shift)) {
+    return false;
+  }
+  value = v << shift;
+  return true;
+}
+
+Status SnapshotPolicy::parse(const std::string& str) {
+  std::vector<std::string> fields;
+  boost::split(fields, str, boost::is_any_of(","));
+  for (const std::string& field : fields) {
+    if (field.empty()) {
+      continue;
+    }
+    size_t pos = field.find('=');
+    uint64_t value = 0;
+    if (pos == std::string::npos || !parse_size(field.substr(pos + 1), value)) {
+      return Status::invalid_argument(field.c_str());
+    }
+
+    std::string name = field.substr(0, pos);
+    if (name == "min_entries") {
+      min_entries = value;
+    } else if (name == "max_entries") {
+      max_entries = value;
+    } else if (name == "max_log_bytes") {
+      max_log_bytes = value;
+    } else if (name == "max_wal_bytes") {
+      max_wal_bytes = value;
+    } else if (name == "max_rss_bytes") {
+      max_rss_bytes = value;
+    } else if (name == "min_catch_up_entries") {
+      min_catch_up_entries = value;
+    } else if (name == "max_catch_up_entries") {
+      max_catch_up_entries = value;
+    } else if (name == "max_catch_up_bytes") {
+      max_catch_up_bytes = value;
+    } else if (name == "max_write_rate") {
+      max_write_rate = value;
+    } else if (name == "max_send_rate") {
+      max_send_rate = value;
+    } else if (name == "checkpoint_entries") {
+      checkpoint_entries = value;
+    } else {
+      return Status::invalid_argument(field.c_str());
+    }
+  }
+
+  if (min_entries > max_entries || min_catch_up_entries > max_catch_up_entries) {
+    return Status::invalid_argument("lower bound above upper bound");
+  }
+  return Status::ok();
+}
+
+bool SnapshotPolicy::should_snapshot(const SnapshotStats& stats) const {
+  if (stats.entries == 0 || stats.entries < min_entries) {
+    return false;
+  }
+  return stats.entries >= max_entries
+      || stats.log_bytes >= max_log_bytes
+      || stats.wal_bytes >= max_wal_bytes
+      || (max_rss_bytes > 0 && stats.rss_bytes >= max_rss_bytes);
+}
+
+uint64_t SnapshotPolicy::compact_index(uint64_t snapshot_index, uint64_t bytes_index, uint64_t slowest_match) const {
+  // the log is compacted to index, the entries after it are kept
+  uint64_t low = snapshot_index > max_catch_up_entries ? snapshot_index - max_catch_up_entries : 0;
+  if (bytes_index > 0) {
+    low = std::max(low, bytes_index - 1);
+  }
+  uint64_t high = snapshot_index > min_catch_up_entries ? snapshot_index - min_catch_up_entries : 0;
+  // the bytes bound memory, they win over the entries always kept
+  high = std::max(high, low);
+
+  uint64_t index = high;
+  if (slowest_match > 0) {
+    index = std::min(std::max(slowest_match, low), high);
+  }
+  return std::max<uint64_t>(index, 1);
+}
+
+uint64_t SnapshotPolicy::slowest_match(const RaftStatus& status) {
+  uint64_t slowest = 0;
+  for (auto& it : status.progress) {
+    const FollowerStatus& follower = it.second;
+    // a follower that is already sent a snapshot does not need the log either
+    if (!follower.recent_active || follower.state == ProgressStateSnapshot || follower.match == 0) {
+      continue;
+    }
+    if (slowest == 0 || follower.match < slowest) {
+      slowest = follower.match;
+    }
+  }
+  return slowest;
+}
+
+bool SnapshotPolicy::should_checkpoint(uint64_t entries) const {
+  return checkpoint_entries > 0 && entries >= checkpoint_entries;
+}
+
+}
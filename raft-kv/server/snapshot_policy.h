@@ -0,0 +1,83 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <raft-kv/common/status.h>
+#include <raft-kv/raft/raft_status.h>
+
+namespace kv {
+
+// SnapshotStats is what happened since the last snapshot of the store
+struct SnapshotStats {
+  explicit SnapshotStats()
+      : entries(0),
+        log_bytes(0),
+        wal_bytes(0),
+        rss_bytes(0) {
+  }
+
+  uint64_t entries;   // entries applied
+  uint64_t log_bytes; // bytes of the entries applied
+  uint64_t wal_bytes; // bytes appended to the WAL
+  uint64_t rss_bytes; // resident memory of the process, not only since the last snapshot
+};
+
+// SnapshotPolicy decides when the store is snapshotted and how much of the log is
+// kept once it is. A snapshot is taken once enough entries were applied and any of
+// the entries, their bytes, the WAL growth or the resident memory reaches its upper
+// bound. The log kept for the followers to catch up is bounded in entries and bytes,
+// within those bounds the leader keeps the entries the slowest follower misses.
+// The snapshot files are written and sent at bounded rates, so that they do not
+// take the disk from the WAL or the network from the clients. In between two
+// snapshots the store is checkpointed, so that a restart does not apply the whole
+// log since the last snapshot again.
+struct SnapshotPolicy {
+  explicit SnapshotPolicy()
+      : min_entries(100),
+        max_entries(100000),
+        max_log_bytes(64 << 20),
+        max_wal_bytes(256 << 20),
+        max_rss_bytes(0),
+        min_catch_up_entries(1000),
+        max_catch_up_entries(100000),
+        max_catch_up_bytes(64 << 20),
+        max_write_rate(0),
+        max_send_rate(0),
+        checkpoint_entries(10000) {
+  }
+
+  // parse sets the fields named in a comma separated list of name=value, such as
+  // "max_entries=50000,max_log_bytes=32m". Sizes take a k, m or g suffix.
+  Status parse(const std::string& str);
+
+  // should_snapshot returns true if a snapshot should be taken
+  bool should_snapshot(const SnapshotStats& stats) const;
+
+  // compact_index returns the index to compact the log to after a snapshot at
+  // snapshot_index. bytes_index is the first of the entries up to snapshot_index
+  // that fit in max_catch_up_bytes, slowest_match is the match index of the slowest
+  // follower, 0 if unknown.
+  uint64_t compact_index(uint64_t snapshot_index, uint64_t bytes_index, uint64_t slowest_match) const;
+
+  // slowest_match returns the match index of the slowest follower in the status of
+  // a leader that can still catch up from the log, 0 if none. A follower not heard
+  // of since the last quorum check is left out, it would pin the log while it is down.
+  static uint64_t slowest_match(const RaftStatus& status);
+
+  // should_checkpoint returns true if a checkpoint should be taken after entries
+  // were applied since the last snapshot or checkpoint
+  bool should_checkpoint(uint64_t entries) const;
+
+  uint64_t min_entries;          // entries applied before any snapshot
+  uint64_t max_entries;          // entries applied that trigger a snapshot
+  uint64_t max_log_bytes;        // bytes of entries applied that trigger a snapshot
+  uint64_t max_wal_bytes;        // WAL growth that triggers a snapshot
+  uint64_t max_rss_bytes;        // resident memory that triggers a snapshot, 0 to ignore
+  uint64_t min_catch_up_entries; // entries always kept after a snapshot
+  uint64_t max_catch_up_entries; // entries kept at most after a snapshot
+  uint64_t max_catch_up_bytes;   // bytes of entries kept at most after a snapshot
+  uint64_t max_write_rate;       // bytes a second written by a snapshot, 0 if unlimited
+  uint64_t max_send_rate;        // bytes a second of snapshots sent to the followers, 0 if unlimited
+  uint64_t checkpoint_entries;   // entries applied that trigger a checkpoint, 0 to disable them
+};
+
+}
@@ -0,0 +1,504 @@
+#include <raft-kv/snap/snapshot_file.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <string.h>
+#include <msgpack.hpp>
+#include <raft-kv/raft/util.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace kv {
+
+static const size_t kSnapshotRawChunk = 1024 * 1024;
+static const size_t kWriteBufferSize = 1024 * 1024;
+static const uint64_t kWritebackSize = 8 * 1024 * 1024;
+static const int kZstdLevel = 1;
+
+bool snapshot_codec_supported(uint32_t codec) {
+  switch (codec) {
+    case kSnapshotCodecNone:
+      return true;
+#ifdef HAVE_LZ4
+    case kSnapshotCodecLZ4:
+      return true;
+#endif
+#ifdef HAVE_ZSTD
+    case kSnapshotCodecZstd:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+static Status compress_chunk(uint32_t codec, const void* data, size_t len, std::vector<char>& out) {
+  uint32_t raw_len = htole32(static_cast<uint32_t>(len));
+  size_t n = 0;
+  switch (codec) {
+#ifdef HAVE_LZ4
+    case kSnapshotCodecLZ4: {
+      out.resize(sizeof(raw_len) + LZ4_compressBound(static_cast<int>(len)));
+      int ret = LZ4_compress_default((const char*) data,
+                                     out.data() + sizeof(raw_len),
+                                     static_cast<int>(len),
+                                     static_cast<int>(out.size() - sizeof(raw_len)));
+      if (ret <= 0) {
+        return Status::io_error("lz4 compress error");
+      }
+      n = static_cast<size_t>(ret);
+      break;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case kSnapshotCodecZstd: {
+      out.resize(sizeof(raw_len) + ZSTD_compressBound(len));
+      n = ZSTD_compress(out.data() + sizeof(raw_len), out.size() - sizeof(raw_len), data, len, kZstdLevel);
+      if (ZSTD_isError(n)) {
+        return Status::io_error(ZSTD_getErrorName(n));
+      }
+      break;
+    }
+#endif
+    default:
+      return Status::not_supported("snapshot codec not supported");
+  }
+  memcpy(out.data(), &raw_len, sizeof(raw_len));
+  out.resize(sizeof(raw_len) + n);
+  return Status::ok();
+}
+
+static Status decompress_chunk(uint32_t codec, const std::vector<char>& in, std::vector<char>& out) {
+  uint32_t raw_len;
+  if (in.size() < sizeof(raw_len)) {
+    return Status::io_error("invalid compressed chunk");
+  }
+  memcpy(&raw_len, in.data(), sizeof(raw_len));
+  out.resize(le32toh(raw_len));
+
+  switch (codec) {
+#ifdef HAVE_LZ4
+    case kSnapshotCodecLZ4: {
+      int n = LZ4_decompress_safe(in.data() + sizeof(raw_len),
+                                  out.data(),
+                                  static_cast<int>(in.size() - sizeof(raw_len)),
+                                  static_cast<int>(out.size()));
+      if (n < 0 || static_cast<size_t>(n) != out.size()) {
+        return Status::io_error("lz4 decompress error");
+      }
+      return Status::ok();
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case kSnapshotCodecZstd: {
+      size_t n = ZSTD_decompress(out.data(), out.size(), in.data() + sizeof(raw_len), in.size() - sizeof(raw_len));
+      if (ZSTD_isError(n) || n != out.size()) {
+        return Status::io_error("zstd decompress error");
+      }
+      return Status::ok();
+    }
+#endif
+    default:
+      return Status::not_supported("snapshot codec not supported");
+  }
+}
+
+static uint32_t chunk_crc32(const void* data, size_t len) {
+  boost::crc_32_type crc32;
+  crc32.process_bytes(data, len);
+  return crc32.checksum();
+}
+
+static Status pread_full(int fd, void* buf, size_t len, uint64_t offset) {
+  char* p = static_cast<char*>(buf);
+  while (len > 0) {
+    ssize_t n = pread(fd, p, len, static_cast<off_t>(offset));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return Status::io_error(strerror(errno));
+    }
+    if (n == 0) {
+      return Status::io_error("unexpected end of snapshot");
+    }
+    p += n;
+    len -= n;
+    offset += n;
+  }
+  return Status::ok();
+}
+
+SnapshotWriter::SnapshotWriter(FILE* fp, uint32_t codec)
+    : fp_(fp),
+      codec_(codec),
+      data_offset_(0),
+      offset_(0),
+      limiter_(nullptr),
+      synced_offset_(0) {
+  setvbuf(fp_, nullptr, _IOFBF, kWriteBufferSize);
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  if (fp_) {
+    fclose(fp_);
+  }
+}
+
+Status SnapshotWriter::create(const std::string& path,
+                              const proto::SnapshotMetadata& meta,
+                              std::unique_ptr<SnapshotWriter>& writer,
+                              uint32_t codec) {
+  return create(path, meta, 0, codec, writer);
+}
+
+Status SnapshotWriter::create_delta(const std::string& path,
+                                    const proto::SnapshotMetadata& meta,
+                                    uint64_t base_index,
+                                    std::unique_ptr<SnapshotWriter>& writer) {
+  assert(base_index != 0);
+  return create(path, meta, base_index, kSnapshotCodecDefault, writer);
+}
+
+Status SnapshotWriter::create(const std::string& path,
+                              const proto::SnapshotMetadata& meta,
+                              uint64_t base_index,
+                              uint32_t codec,
+                              std::unique_ptr<SnapshotWriter>& writer) {
+  if (!snapshot_codec_supported(codec)) {
+    return Status::not_supported("snapshot codec not supported");
+  }
+  FILE* fp = fopen(path.c_str(), "w");
+  if (!fp) {
+    return Status::io_error(strerror(errno));
+  }
+  writer.reset(new SnapshotWriter(fp, codec));
+
+  msgpack::sbuffer sbuf;
+  msgpack::pack(sbuf, meta);
+
+  SnapshotFileHeader header;
+  header.magic = kSnapshotMagic;
+  header.version = kSnapshotVersion;
+  header.meta_len = static_cast<uint32_t>(sbuf.size());
+  header.codec = codec;
+  header.base_index = base_index;
+
+  writer->crc32_.process_bytes(&header, sizeof(header));
+  writer->crc32_.process_bytes(sbuf.data(), sbuf.size());
+  Status status = writer->write_raw(&header, sizeof(header));
+  if (!status.is_ok()) {
+    return status;
+  }
+  status = writer->write_raw(sbuf.data(), sbuf.size());
+  writer->data_offset_ = writer->offset_;
+  return status;
+}
+
+Status SnapshotWriter::write(const void* data, size_t len) {
+  const char* p = static_cast<const char*>(data);
+  while (len > 0) {
+    size_t n = std::min(len, kSnapshotRawChunk - raw_chunk_.size());
+    raw_chunk_.insert(raw_chunk_.end(), p, p + n);
+    p += n;
+    len -= n;
+    if (raw_chunk_.size() == kSnapshotRawChunk) {
+      Status status = flush_raw_chunk();
+      if (!status.is_ok()) {
+        return status;
+      }
+    }
+  }
+  return Status::ok();
+}
+
+Status SnapshotWriter::write_chunk(const void* data, size_t len, uint32_t count) {
+  if (len > UINT32_MAX) {
+    return Status::invalid_argument("snapshot chunk too large");
+  }
+  Status status = flush_raw_chunk();
+  if (!status.is_ok()) {
+    return status;
+  }
+  return add_chunk(data, len, count);
+}
+
+Status SnapshotWriter::flush_raw_chunk() {
+  if (raw_chunk_.empty()) {
+    return Status::ok();
+  }
+  Status status = add_chunk(raw_chunk_.data(), raw_chunk_.size(), 0);
+  raw_chunk_.clear();
+  return status;
+}
+
+Status SnapshotWriter::add_chunk(const void* data, size_t len, uint32_t count) {
+  if (codec_ != kSnapshotCodecNone) {
+    Status status = compress_chunk(codec_, data, len, compressed_);
+    if (!status.is_ok()) {
+      return status;
+    }
+    data = compressed_.data();
+    len = compressed_.size();
+    if (len > UINT32_MAX) {
+      return Status::invalid_argument("snapshot chunk too large");
+    }
+  }
+
+  SnapshotChunk chunk;
+  chunk.offset = offset_;
+  chunk.len = static_cast<uint32_t>(len);
+  chunk.count = count;
+  chunk.crc32 = chunk_crc32(data, len);
+  chunks_.push_back(chunk);
+
+  if (!limiter_) {
+    return write_raw(data, len);
+  }
+  limiter_->acquire(len);
+  Status status = write_raw(data, len);
+  if (!status.is_ok() || offset_ - synced_offset_ < kWritebackSize) {
+    return status;
+  }
+  // the dirty pages are written back in the background as the rate allows, so
+  // the fsync of finish does not flush the whole file at once
+  if (fflush(fp_) != 0) {
+    return Status::io_error(strerror(errno));
+  }
+  sync_file_range(fileno(fp_), synced_offset_, offset_ - synced_offset_, SYNC_FILE_RANGE_WRITE);
+  synced_offset_ = offset_;
+  return Status::ok();
+}
+
+Status SnapshotWriter::write_raw(const void* data, size_t len) {
+  if (len > 0 && fwrite(data, 1, len, fp_) != len) {
+    return Status::io_error(strerror(errno));
+  }
+  offset_ += len;
+  return Status::ok();
+}
+
+Status SnapshotWriter::finish() {
+  Status status = flush_raw_chunk();
+  if (!status.is_ok()) {
+    return status;
+  }
+
+  SnapshotFileFooter footer;
+  footer.index_offset = offset_;
+  footer.chunk_count = static_cast<uint32_t>(chunks_.size());
+  size_t index_len = chunks_.size() * sizeof(SnapshotChunk);
+  crc32_.process_bytes(chunks_.data(), index_len);
+  footer.crc32 = crc32_.checksum();
+  footer.magic = kSnapshotMagic;
+
+  status = write_raw(chunks_.data(), index_len);
+  if (!status.is_ok()) {
+    return status;
+  }
+  status = write_raw(&footer, sizeof(footer));
+  if (!status.is_ok()) {
+    return status;
+  }
+
+  if (fflush(fp_) != 0 || fsync(fileno(fp_)) != 0) {
+    return Status::io_error(strerror(errno));
+  }
+  fclose(fp_);
+  fp_ = nullptr;
+  return Status::ok();
+}
+
+SnapshotReader::SnapshotReader(int fd)
+    : fd_(fd),
+      codec_(kSnapshotCodecNone),
+      base_index_(0),
+      data_len_(0),
+      next_chunk_(0),
+      buffer_offset_(0) {
+}
+
+SnapshotReader::~SnapshotReader() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+}
+
+Status SnapshotReader::open(const std::string& path, std::unique_ptr<SnapshotReader>& reader) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return Status::io_error(strerror(errno));
+  }
+  reader.reset(new SnapshotReader(fd));
+
+  SnapshotFileHeader header;
+  Status status = pread_full(fd, &header, sizeof(header), 0);
+  if (!status.is_ok()) {
+    return Status::io_error("invalid snapshot header");
+  }
+  if (header.magic != kSnapshotMagic || header.version != kSnapshotVersion) {
+    return reader->open_v1();
+  }
+  if (!snapshot_codec_supported(header.codec)) {
+    return Status::not_supported("snapshot codec not supported");
+  }
+  reader->codec_ = header.codec;
+  reader->base_index_ = header.base_index;
+
+  std::vector<char> meta(header.meta_len);
+  if (!pread_full(fd, meta.data(), meta.size(), sizeof(header)).is_ok()) {
+    return Status::io_error("invalid snapshot metadata");
+  }
+
+  uint64_t data_offset = sizeof(header) + meta.size();
+  off_t size = lseek(fd, 0, SEEK_END);
+  SnapshotFileFooter footer;
+  if (size < 0
+      || static_cast<uint64_t>(size) < data_offset + sizeof(footer)
+      || !pread_full(fd, &footer, sizeof(footer), size - sizeof(footer)).is_ok()
+      || footer.magic != kSnapshotMagic
+      || footer.index_offset < data_offset
+      || footer.index_offset + uint64_t(footer.chunk_count) * sizeof(SnapshotChunk) + sizeof(footer) != uint64_t(size)) {
+    return Status::io_error("invalid snapshot footer");
+  }
+
+  std::vector<SnapshotChunk>& chunks = reader->chunks_;
+  chunks.resize(footer.chunk_count);
+  if (!pread_full(fd, chunks.data(), chunks.size() * sizeof(SnapshotChunk), footer.index_offset).is_ok()) {
+    return Status::io_error("invalid snapshot index");
+  }
+
+  boost::crc_32_type crc32;
+  crc32.process_bytes(&header, sizeof(header));
+  crc32.process_bytes(meta.data(), meta.size());
+  crc32.process_bytes(chunks.data(), chunks.size() * sizeof(SnapshotChunk));
+  if (crc32.checksum() != footer.crc32) {
+    return Status::io_error("snapshot crc mismatch");
+  }
+
+  uint64_t offset = data_offset;
+  for (const SnapshotChunk& chunk : chunks) {
+    if (chunk.offset != offset) {
+      return Status::io_error("invalid snapshot index");
+    }
+    offset += chunk.len;
+  }
+  if (offset != footer.index_offset) {
+    return Status::io_error("invalid snapshot index");
+  }
+
+  try {
+    msgpack::object_handle oh = msgpack::unpack(meta.data(), meta.size());
+    oh.get().convert(reader->meta_);
+  } catch (std::exception& e) {
+    return Status::io_error("invalid snapshot metadata");
+  }
+  reader->data_len_ = footer.index_offset - data_offset;
+  return Status::ok();
+}
+
+Status SnapshotReader::open_v1() {
+  struct SnapshotRecord {
+    uint32_t data_len;
+    uint32_t crc32;
+  } record;
+
+  if (!pread_full(fd_, &record, sizeof(record), 0).is_ok() || record.data_len == 0 || record.crc32 == 0) {
+    return Status::io_error("invalid snapshot record");
+  }
+
+  std::vector<char> data(record.data_len);
+  if (!pread_full(fd_, data.data(), data.size(), sizeof(record)).is_ok()) {
+    return Status::io_error("invalid snapshot record");
+  }
+  if (compute_crc32(data.data(), data.size()) != record.crc32) {
+    return Status::io_error("snapshot crc mismatch");
+  }
+
+  proto::Snapshot snapshot;
+  try {
+    msgpack::object_handle oh = msgpack::unpack(data.data(), data.size());
+    oh.get().convert(snapshot);
+  } catch (std::exception& e) {
+    return Status::io_error("invalid snapshot record");
+  }
+
+  meta_ = snapshot.metadata;
+  v1_data_.assign(snapshot.data.begin(), snapshot.data.end());
+  data_len_ = v1_data_.size();
+  if (data_len_ > 0) {
+    SnapshotChunk chunk;
+    chunk.offset = 0;
+    chunk.len = static_cast<uint32_t>(data_len_);
+    chunk.count = 0;
+    chunk.crc32 = 0;
+    chunks_.push_back(chunk);
+  }
+  return Status::ok();
+}
+
+Status SnapshotReader::read_chunk(size_t i, std::vector<char>& data) const {
+  const SnapshotChunk& chunk = chunks_[i];
+  if (!v1_data_.empty()) {
+    data = v1_data_;
+    return Status::ok();
+  }
+
+  std::vector<char> compressed;
+  std::vector<char>& buffer = codec_ == kSnapshotCodecNone ? data : compressed;
+  buffer.resize(chunk.len);
+  Status status = pread_full(fd_, buffer.data(), buffer.size(), chunk.offset);
+  if (!status.is_ok()) {
+    return status;
+  }
+  if (chunk_crc32(buffer.data(), buffer.size()) != chunk.crc32) {
+    return Status::io_error("snapshot chunk crc mismatch");
+  }
+  if (codec_ != kSnapshotCodecNone) {
+    return decompress_chunk(codec_, compressed, data);
+  }
+  return Status::ok();
+}
+
+Status SnapshotReader::read(void* buf, size_t len, size_t& n) {
+  n = 0;
+  while (buffer_offset_ == buffer_.size()) {
+    if (next_chunk_ == chunks_.size()) {
+      return Status::ok();
+    }
+    Status status = read_chunk(next_chunk_++, buffer_);
+    if (!status.is_ok()) {
+      return status;
+    }
+    buffer_offset_ = 0;
+  }
+
+  n = std::min(len, buffer_.size() - buffer_offset_);
+  memcpy(buf, buffer_.data() + buffer_offset_, n);
+  buffer_offset_ += n;
+  return Status::ok();
+}
+
+Status SnapshotReader::read_all(std::vector<uint8_t>& data) {
+  data.reserve(data.size() + data_len_);
+  data.insert(data.end(), buffer_.begin() + buffer_offset_, buffer_.end());
+  buffer_offset_ = buffer_.size();
+
+  std::vector<char> chunk;
+  while (next_chunk_ < chunks_.size()) {
+    Status status = read_chunk(next_chunk_++, chunk);
+    if (!status.is_ok()) {
+      return status;
+    }
+    data.insert(data.end(), chunk.begin(), chunk.end());
+  }
+  return Status::ok();
+}
+
+}
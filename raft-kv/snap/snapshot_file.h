@@ -0,0 +1,200 @@
+#pragma once
+#include <stdio.h>
+#include <string>
+#include <memory>
+#include <vector>
+#include <boost/crc.hpp>
+#include <raft-kv/raft/proto.h>
+#include <raft-kv/common/status.h>
+#include <raft-kv/common/rate_limiter.h>
+
+namespace kv {
+
+// A snapshot file is a header, the msgpack metadata, the data of the store cut into
+// chunks, an index of the chunks and a footer:
+//
+//   | SnapshotFileHeader | metadata | chunk 0 | ... | chunk n-1 | index | SnapshotFileFooter |
+//
+// Every chunk has its own crc32 in the index, so chunks are verified and decoded
+// independently, by several threads when loading. The footer locates the index and
+// holds the crc32 of the header, the metadata and the index.
+//
+// Chunks are compressed with the codec recorded in the header, a compressed chunk
+// starts with its uncompressed length as a little endian uint32. The crc32 of a
+// chunk covers its bytes on disk.
+//
+// A delta snapshot only holds the keys changed since the snapshot at base_index,
+// which is either a full snapshot or another delta.
+static const uint32_t kSnapshotMagic = 0x4e53564b; // "KVSN"
+static const uint32_t kSnapshotVersion = 2;
+
+static const uint32_t kSnapshotCodecNone = 0;
+static const uint32_t kSnapshotCodecLZ4 = 1;
+static const uint32_t kSnapshotCodecZstd = 2;
+
+// the codec of new snapshots, the fastest one the build links with
+#if defined(HAVE_LZ4)
+static const uint32_t kSnapshotCodecDefault = kSnapshotCodecLZ4;
+#elif defined(HAVE_ZSTD)
+static const uint32_t kSnapshotCodecDefault = kSnapshotCodecZstd;
+#else
+static const uint32_t kSnapshotCodecDefault = kSnapshotCodecNone;
+#endif
+
+// snapshot_codec_supported returns true if the build can read and write codec
+bool snapshot_codec_supported(uint32_t codec);
+
+#pragma pack(1)
+struct SnapshotFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t meta_len;
+  uint32_t codec;
+  uint64_t base_index; // 0 for a full snapshot
+};
+
+struct SnapshotChunk {
+  uint64_t offset;
+  uint32_t len;
+  uint32_t count; // the number of keys of a chunk written by write_chunk, 0 for raw data
+  uint32_t crc32;
+};
+
+struct SnapshotFileFooter {
+  uint64_t index_offset;
+  uint32_t chunk_count;
+  uint32_t crc32;
+  uint32_t magic;
+};
+#pragma pack()
+
+// SnapshotWriter streams a snapshot into a file
+class SnapshotWriter {
+ public:
+  static Status create(const std::string& path,
+                       const proto::SnapshotMetadata& meta,
+                       std::unique_ptr<SnapshotWriter>& writer,
+                       uint32_t codec = kSnapshotCodecDefault);
+
+  // create_delta creates a delta snapshot on top of the snapshot at base_index
+  static Status create_delta(const std::string& path,
+                             const proto::SnapshotMetadata& meta,
+                             uint64_t base_index,
+                             std::unique_ptr<SnapshotWriter>& writer);
+
+  ~SnapshotWriter();
+
+  // set_rate_limiter throttles the chunks written to the rate of limiter, their
+  // writeback is started as they are written instead of all at once by finish
+  void set_rate_limiter(RateLimiter* limiter) {
+    limiter_ = limiter;
+  }
+
+  // write appends raw data, it is cut into chunks of 1MB
+  Status write(const void* data, size_t len);
+
+  // write_chunk appends a chunk holding count keys that can be decoded on its own,
+  // a chunk is at most UINT32_MAX bytes
+  Status write_chunk(const void* data, size_t len, uint32_t count);
+
+  // finish writes the index and footer and syncs the file to disk
+  Status finish();
+
+  // data_len returns the length of the chunks on disk, after compression
+  uint64_t data_len() const {
+    return offset_ - data_offset_;
+  }
+
+ private:
+  explicit SnapshotWriter(FILE* fp, uint32_t codec);
+
+  static Status create(const std::string& path,
+                       const proto::SnapshotMetadata& meta,
+                       uint64_t base_index,
+                       uint32_t codec,
+                       std::unique_ptr<SnapshotWriter>& writer);
+
+  Status write_raw(const void* data, size_t len);
+
+  Status flush_raw_chunk();
+
+  Status add_chunk(const void* data, size_t len, uint32_t count);
+
+  FILE* fp_;
+  uint32_t codec_;
+  std::vector<char> compressed_;
+  uint64_t data_offset_;
+  uint64_t offset_;
+  std::vector<char> raw_chunk_;
+  std::vector<SnapshotChunk> chunks_;
+  boost::crc_32_type crc32_; // of the header, metadata and index
+  RateLimiter* limiter_;
+  uint64_t synced_offset_;   // the writeback started up to this offset
+};
+
+// SnapshotReader reads the chunks of a snapshot file, the crc of each chunk is
+// checked when it is read. read_chunk may be called from several threads.
+class SnapshotReader {
+ public:
+  // open checks the header, footer and index of the file and reads the metadata.
+  // Files of the first format, one crc checked record, are loaded at once as a
+  // single chunk.
+  static Status open(const std::string& path, std::unique_ptr<SnapshotReader>& reader);
+
+  ~SnapshotReader();
+
+  const proto::SnapshotMetadata& metadata() const {
+    return meta_;
+  }
+
+  // data_len returns the length of the chunks on disk, after compression
+  uint64_t data_len() const {
+    return data_len_;
+  }
+
+  size_t chunk_count() const {
+    return chunks_.size();
+  }
+
+  const SnapshotChunk& chunk(size_t i) const {
+    return chunks_[i];
+  }
+
+  uint32_t codec() const {
+    return codec_;
+  }
+
+  // base_index returns the index of the snapshot a delta applies on, 0 for a full snapshot
+  uint64_t base_index() const {
+    return base_index_;
+  }
+
+  // read_chunk reads the data of chunk i, checks its crc and decompresses it
+  Status read_chunk(size_t i, std::vector<char>& data) const;
+
+  // read reads at most len bytes of data into buf, n is 0 at the end of the data
+  Status read(void* buf, size_t len, size_t& n);
+
+  // read_all reads the remaining data
+  Status read_all(std::vector<uint8_t>& data);
+
+ private:
+  explicit SnapshotReader(int fd);
+
+  Status open_v1();
+
+  int fd_;
+  uint32_t codec_;
+  uint64_t base_index_;
+  proto::SnapshotMetadata meta_;
+  uint64_t data_len_;
+  std::vector<SnapshotChunk> chunks_;
+  std::vector<char> v1_data_; // data of a file of the first format
+
+  // position of read
+  size_t next_chunk_;
+  std::vector<char> buffer_;
+  size_t buffer_offset_;
+};
+
+}
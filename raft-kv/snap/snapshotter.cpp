@@ -2,22 +2,37 @@
 #include <boost/filesystem.hpp>
 #include <raft-kv/common/log.h>
 #include <msgpack.hpp>
-#include <raft-kv/raft/util.h>
+#include <raft-kv/snap/snapshot_file.h>
 #include <inttypes.h>
+#include <string.h>
+#include <algorithm>
 
 namespace kv {
 
-struct SnapshotRecord {
-  uint32_t data_len;
-  uint32_t crc32;
-  char data[0];
-};
+static const char* kSnapExtension = ".snap";
+static const char* kDeltaExtension = ".delta";
+static const char* kImageExtension = ".image";
+static const char* kReceivedExtension = ".recv";
+
+// parse_name parses the index of a snapshot file name
+static bool parse_name(const std::string& filename, uint64_t& index, bool& delta) {
+  uint64_t term;
+  char ext[16];
+  if (sscanf(filename.c_str(), "%16" SCNx64 "-%16" SCNx64 "%15s", &term, &index, ext) != 3) {
+    return false;
+  }
+  delta = strcmp(ext, kDeltaExtension) == 0;
+  return delta || strcmp(ext, kSnapExtension) == 0;
+}
 
 Status Snapshotter::load(proto::Snapshot& snapshot) {
   std::vector<std::string> names;
   get_snap_names(names);
 
   for (std::string& filename : names) {
+    if (boost::filesystem::path(filename).extension() != kSnapExtension) {
+      continue;
+    }
     Status status = load_snap(filename, snapshot);
     if (status.is_ok()) {
       return Status::ok();
@@ -29,105 +44,260 @@ Status Snapshotter::load(proto::Snapshot& snapshot) {
 
 std::string Snapshotter::snap_name(uint64_t term, uint64_t index) {
   char buffer[64];
-  snprintf(buffer, sizeof(buffer), "%016" PRIx64 "-%016" PRIx64 ".snap", term, index);
+  snprintf(buffer, sizeof(buffer), "%016" PRIx64 "-%016" PRIx64 "%s", term, index, kSnapExtension);
   return buffer;
 }
 
-Status Snapshotter::save_snap(const proto::Snapshot& snapshot) {
-  Status status;
-  msgpack::sbuffer sbuf;
-  msgpack::pack(sbuf, snapshot);
+std::string Snapshotter::delta_name(uint64_t term, uint64_t index) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%016" PRIx64 "-%016" PRIx64 "%s", term, index, kDeltaExtension);
+  return buffer;
+}
 
-  SnapshotRecord* record = (SnapshotRecord*) malloc(sbuf.size() + sizeof(SnapshotRecord));
-  record->data_len = sbuf.size();
-  record->crc32 = compute_crc32(sbuf.data(), sbuf.size());
-  memcpy(record->data, sbuf.data(), sbuf.size());
+Status Snapshotter::load_newest(proto::SnapshotMetadata& meta, std::vector<std::string>& paths) {
+  std::vector<std::string> names;
+  get_snap_names(names);
 
-  char save_path[128];
-  snprintf(save_path,
-           sizeof(save_path),
-           "%s/%s",
-           dir_.c_str(),
-           snap_name(snapshot.metadata.term, snapshot.metadata.index).c_str());
+  for (std::string& filename : names) {
+    Status status = resolve(names, filename, meta, paths);
+    if (status.is_ok()) {
+      return Status::ok();
+    }
+    LOG_INFO("snapshot %s is not usable, %s", filename.c_str(), status.to_string().c_str());
+    mark_broken(filename);
+  }
 
-  FILE* fp = fopen(save_path, "w");
-  if (!fp) {
-    free(record);
-    return Status::io_error(strerror(errno));
+  return Status::not_found("snap not found");
+}
+
+Status Snapshotter::files(const proto::SnapshotMetadata& meta, std::vector<std::string>& paths) {
+  std::vector<std::string> names;
+  get_snap_names(names);
+
+  for (const std::string& name : {snap_name(meta.term, meta.index), delta_name(meta.term, meta.index)}) {
+    if (std::find(names.begin(), names.end(), name) != names.end()) {
+      proto::SnapshotMetadata file_meta;
+      return resolve(names, name, file_meta, paths);
+    }
   }
+  return Status::not_found("snap not found");
+}
+
+Status Snapshotter::resolve(const std::vector<std::string>& names,
+                            const std::string& filename,
+                            proto::SnapshotMetadata& meta,
+                            std::vector<std::string>& paths) {
+  paths.clear();
+  std::string name = filename;
+  while (true) {
+    std::string path = (boost::filesystem::path(dir_) / name).string();
+    std::unique_ptr<SnapshotReader> reader;
+    Status status = SnapshotReader::open(path, reader);
+    if (!status.is_ok()) {
+      return status;
+    }
+    if (paths.empty()) {
+      meta = reader->metadata();
+    }
+    paths.insert(paths.begin(), path);
 
-  size_t bytes = sizeof(SnapshotRecord) + record->data_len;
-  if (fwrite((void*) record, 1, bytes, fp) != bytes) {
-    status = Status::io_error(strerror(errno));
+    uint64_t base_index = reader->base_index();
+    if (base_index == 0) {
+      return Status::ok();
+    }
+
+    name.clear();
+    for (const std::string& candidate : names) {
+      uint64_t index;
+      bool delta;
+      if (parse_name(candidate, index, delta) && index == base_index) {
+        name = candidate;
+        break;
+      }
+    }
+    if (name.empty()) {
+      return Status::not_found("base snapshot not found");
+    }
   }
-  free(record);
-  fclose(fp);
+}
 
-  return status;
+Status Snapshotter::load_data(const proto::SnapshotMetadata& meta, std::vector<uint8_t>& data) {
+  std::unique_ptr<SnapshotReader> reader;
+  Status status = SnapshotReader::open(snap_path(meta.term, meta.index), reader);
+  if (!status.is_ok()) {
+    return status;
+  }
+  return reader->read_all(data);
 }
 
-void Snapshotter::get_snap_names(std::vector<std::string>& names) {
-  using namespace boost;
+std::string Snapshotter::snap_path(uint64_t term, uint64_t index) const {
+  return (boost::filesystem::path(dir_) / snap_name(term, index)).string();
+}
 
-  filesystem::directory_iterator end;
-  for (boost::filesystem::directory_iterator it(dir_); it != end; it++) {
-    filesystem::path filename = (*it).path().filename();
-    filesystem::path extension = filename.extension();
-    if (extension != ".snap") {
-      continue;
-    }
-    names.push_back(filename.string());
+Status Snapshotter::save_snap(const proto::Snapshot& snapshot) {
+  std::unique_ptr<SnapshotWriter> writer;
+  Status status = SnapshotWriter::create(snap_path(snapshot.metadata.term, snapshot.metadata.index),
+                                         snapshot.metadata,
+                                         writer);
+  if (!status.is_ok()) {
+    return status;
   }
-  std::sort(names.begin(), names.end(), std::greater<std::string>());
+
+  status = writer->write(snapshot.data.data(), snapshot.data.size());
+  if (!status.is_ok()) {
+    return status;
+  }
+  return writer->finish();
 }
 
-Status Snapshotter::load_snap(const std::string& filename, proto::Snapshot& snapshot) {
+std::string Snapshotter::delta_path(uint64_t term, uint64_t index) const {
+  return (boost::filesystem::path(dir_) / delta_name(term, index)).string();
+}
+
+std::string Snapshotter::received_path(uint64_t term, uint64_t index) const {
+  return snap_path(term, index) + kReceivedExtension;
+}
+
+Status Snapshotter::install(const std::string& tmp_path, const proto::SnapshotMetadata& meta, bool delta) {
+  boost::system::error_code code;
+  std::string path = delta ? delta_path(meta.term, meta.index) : snap_path(meta.term, meta.index);
+  boost::filesystem::rename(tmp_path, path, code);
+  if (code) {
+    return Status::io_error(code.message().c_str());
+  }
+  return Status::ok();
+}
+
+std::string Snapshotter::image_path(const std::string& snap_path) {
+  return boost::filesystem::path(snap_path).replace_extension(kImageExtension).string();
+}
+
+Status Snapshotter::install_image(const std::string& tmp_path, const proto::SnapshotMetadata& meta) {
+  boost::system::error_code code;
+  boost::filesystem::rename(tmp_path, image_path(snap_path(meta.term, meta.index)), code);
+  if (code) {
+    return Status::io_error(code.message().c_str());
+  }
+  return Status::ok();
+}
+
+Status Snapshotter::install_received(const std::string& dir) {
   using namespace boost;
-  SnapshotRecord snap_hdr;
-  std::vector<char> data;
-  filesystem::path path = filesystem::path(dir_) / filename;
-  FILE* fp = fopen(path.c_str(), "r");
 
-  if (!fp) {
-    goto invalid_snap;
+  system::error_code code;
+  filesystem::directory_iterator end;
+  for (filesystem::directory_iterator it(dir, code); !code && it != end; it.increment(code)) {
+    filesystem::path path = (*it).path();
+    filesystem::rename(path, filesystem::path(dir_) / path.filename(), code);
+  }
+  if (code) {
+    return Status::io_error(code.message().c_str());
   }
+  filesystem::remove(dir, code);
+  return Status::ok();
+}
 
-  if (fread(&snap_hdr, 1, sizeof(SnapshotRecord), fp) != sizeof(SnapshotRecord)) {
-    goto invalid_snap;
+void Snapshotter::purge() {
+  std::vector<std::string> names;
+  get_snap_names(names);
+
+  // the chains of the two newest full snapshots are kept, older full
+  // snapshots are kept as before
+  uint64_t cutoff = 0;
+  std::string newest;
+  int full = 0;
+  for (const std::string& name : names) {
+    uint64_t index;
+    bool delta;
+    if (!parse_name(name, index, delta) || delta) {
+      continue;
+    }
+    if (++full == 1) {
+      newest = image_path(name);
+      purge_received(index);
+    } else {
+      cutoff = index;
+      break;
+    }
   }
 
-  if (snap_hdr.data_len == 0 || snap_hdr.crc32 == 0) {
-    goto invalid_snap;
+  boost::system::error_code code;
+  boost::filesystem::directory_iterator end;
+  for (boost::filesystem::directory_iterator it(dir_, code); !code && it != end; it.increment(code)) {
+    boost::filesystem::path filename = (*it).path().filename();
+    if (filename.extension() == kImageExtension && filename.string() != newest) {
+      boost::system::error_code remove_code;
+      boost::filesystem::remove((*it).path(), remove_code);
+      LOG_INFO("purged snapshot image %s", filename.string().c_str());
+    }
   }
 
-  data.resize(snap_hdr.data_len);
-  if (fread(data.data(), 1, snap_hdr.data_len, fp) != snap_hdr.data_len) {
-    goto invalid_snap;
+  for (const std::string& name : names) {
+    uint64_t index;
+    bool delta;
+    if (parse_name(name, index, delta) && delta && index < cutoff) {
+      boost::system::error_code code;
+      boost::filesystem::remove(boost::filesystem::path(dir_) / name, code);
+      LOG_INFO("purged snapshot %s", name.c_str());
+    }
   }
+}
 
-  fclose(fp);
-  fp = NULL;
-  if (compute_crc32(data.data(), data.size()) != snap_hdr.crc32) {
-    goto invalid_snap;
+void Snapshotter::purge_received(uint64_t index) {
+  boost::system::error_code code;
+  boost::filesystem::directory_iterator end;
+  for (boost::filesystem::directory_iterator it(dir_, code); !code && it != end; it.increment(code)) {
+    boost::filesystem::path filename = (*it).path().filename();
+    uint64_t received_index;
+    bool delta;
+    if (filename.extension() != kReceivedExtension
+        || !parse_name(filename.stem().string(), received_index, delta)
+        || received_index > index) {
+      continue;
+    }
+    boost::system::error_code remove_code;
+    boost::filesystem::remove_all((*it).path(), remove_code);
+    LOG_INFO("purged received snapshot %s", filename.string().c_str());
   }
+}
 
-  try {
+void Snapshotter::get_snap_names(std::vector<std::string>& names) {
+  using namespace boost;
 
-    msgpack::object_handle oh = msgpack::unpack((const char*) data.data(), data.size());
-    oh.get().convert(snapshot);
-    return Status::ok();
+  system::error_code code;
+  filesystem::directory_iterator end;
+  for (filesystem::directory_iterator it(dir_, code); !code && it != end; it.increment(code)) {
+    filesystem::path filename = (*it).path().filename();
+    filesystem::path extension = filename.extension();
+    if (extension != kSnapExtension && extension != kDeltaExtension) {
+      continue;
+    }
+    names.push_back(filename.string());
+  }
+  std::sort(names.begin(), names.end(), std::greater<std::string>());
+}
 
-  } catch (std::exception& e) {
-    goto invalid_snap;
+Status Snapshotter::load_snap(const std::string& filename, proto::Snapshot& snapshot) {
+  std::unique_ptr<SnapshotReader> reader;
+  Status status = SnapshotReader::open((boost::filesystem::path(dir_) / filename).string(), reader);
+  if (status.is_ok()) {
+    snapshot.metadata = reader->metadata();
+    snapshot.data.clear();
+    status = reader->read_all(snapshot.data);
   }
 
-invalid_snap:
-  if (fp) {
-    fclose(fp);
+  if (!status.is_ok()) {
+    mark_broken(filename);
+    return Status::io_error("unexpected empty snapshot");
   }
+  return Status::ok();
+}
+
+void Snapshotter::mark_broken(const std::string& filename) {
+  boost::filesystem::path path = boost::filesystem::path(dir_) / filename;
   LOG_INFO("broken snapshot %s", path.string().c_str());
-  filesystem::rename(path, path.string() + ".broken");
-  return Status::io_error("unexpected empty snapshot");
+  boost::system::error_code code;
+  boost::filesystem::rename(path, path.string() + ".broken", code);
 }
 
 }
@@ -6,6 +6,12 @@
 
 namespace kv {
 
+// Snapshotter keeps the snapshot files of a member. A snapshot is either a full
+// snapshot, term-index.snap, or a delta, term-index.delta, that applies on the
+// snapshot at its base index. The files of a snapshot are the full snapshot it
+// starts from followed by its deltas, in order. A full snapshot may come with an
+// image of the table of the store, term-index.image, which only serves to restart
+// this member and is never sent.
 class Snapshotter {
  public:
   explicit Snapshotter(const std::string& dir)
@@ -14,19 +20,69 @@ class Snapshotter {
 
   ~Snapshotter() = default;
 
+  // load loads the newest full snapshot at once
   Status load(proto::Snapshot& snapshot);
 
+  // load_newest finds the newest snapshot whose files are all valid, their data
+  // is left on disk to be streamed from paths.
+  Status load_newest(proto::SnapshotMetadata& meta, std::vector<std::string>& paths);
+
+  // files returns the files of the snapshot with the given metadata
+  Status files(const proto::SnapshotMetadata& meta, std::vector<std::string>& paths);
+
+  // load_data reads the data of the snapshot file with the given metadata
+  Status load_data(const proto::SnapshotMetadata& meta, std::vector<uint8_t>& data);
+
   Status save_snap(const proto::Snapshot& snapshot);
 
+  // install moves a snapshot file written to tmp_path to its place in the directory
+  Status install(const std::string& tmp_path, const proto::SnapshotMetadata& meta, bool delta = false);
+
+  // install_received moves the files of a snapshot received from the leader to the directory
+  Status install_received(const std::string& dir);
+
+  // install_image moves an image written to tmp_path along the full snapshot with
+  // the given metadata
+  Status install_image(const std::string& tmp_path, const proto::SnapshotMetadata& meta);
+
+  // purge removes the deltas older than the second newest full snapshot, the
+  // images of all but the newest one and the received directories not newer than it
+  void purge();
+
+  // purge_received removes the directories of received snapshots up to index, a
+  // snapshot raft did not accept is left there by the transport
+  void purge_received(uint64_t index);
+
+  std::string snap_path(uint64_t term, uint64_t index) const;
+
+  std::string delta_path(uint64_t term, uint64_t index) const;
+
+  // received_path returns the directory the files of a snapshot sent by the leader are received to
+  std::string received_path(uint64_t term, uint64_t index) const;
+
   static std::string snap_name(uint64_t term, uint64_t index);
 
+  static std::string delta_name(uint64_t term, uint64_t index);
+
+  // image_path returns the image of the full snapshot at snap_path
+  static std::string image_path(const std::string& snap_path);
+
  private:
+  // get_snap_names returns the names of full snapshots and deltas, newest first
   void get_snap_names(std::vector<std::string>& names);
 
   Status load_snap(const std::string& filename, proto::Snapshot& snapshot);
 
+  // resolve follows the base indexes from filename down to a full snapshot
+  Status resolve(const std::vector<std::string>& names,
+                 const std::string& filename,
+                 proto::SnapshotMetadata& meta,
+                 std::vector<std::string>& paths);
+
+  void mark_broken(const std::string& filename);
+
  private:
   std::string dir_;
 };
 
-}
\ No newline at end of file
+}
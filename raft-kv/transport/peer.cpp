@@ -4,6 +4,10 @@
 #include <raft-kv/common/bytebuffer.h>
 #include <raft-kv/transport/proto.h>
 #include <boost/asio.hpp>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 
 namespace kv {
 
@@ -78,10 +82,315 @@ class ClientSession {
   bool connected_;
 };
 
+// SnapshotSender streams the files of a snapshot to a peer, see TransportTypeSnapshot.
+// The chunks are sent with sendfile, so the files never pass through user space.
+// A chunk waits for the rate limiter shared by all the snapshots being sent.
+// A stream without progress for kSnapshotIdleTimeout fails, the peer may be gone.
+class SnapshotSender : public std::enable_shared_from_this<SnapshotSender> {
+ public:
+  explicit SnapshotSender(boost::asio::io_service& io_service,
+                          const boost::asio::ip::tcp::endpoint& endpoint,
+                          RaftServer* raft,
+                          RateLimiter* limiter,
+                          proto::MessagePtr msg)
+      : socket_(io_service),
+        timer_(io_service),
+        idle_timer_(io_service),
+        endpoint_(endpoint),
+        raft_(raft),
+        limiter_(limiter),
+        msg_(std::move(msg)),
+        size_(0),
+        sent_(0),
+        acked_(0),
+        current_(0),
+        file_offset_(0),
+        file_started_(false),
+        file_remaining_(0),
+        writing_(false),
+        done_(false) {
+  }
+
+  ~SnapshotSender() {
+    for (File& file : files_) {
+      ::close(file.fd);
+    }
+  }
+
+  void start() {
+    std::vector<std::string> paths;
+    Status status = raft_->snapshot_files(msg_->snapshot.metadata, paths);
+    if (!status.is_ok()) {
+      LOG_ERROR("snapshot files error %s", status.to_string().c_str());
+      finish(false);
+      return;
+    }
+
+    for (const std::string& path : paths) {
+      struct stat st;
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0 || fstat(fd, &st) != 0) {
+        LOG_ERROR("open snapshot %s error %s", path.c_str(), strerror(errno));
+        if (fd >= 0) {
+          ::close(fd);
+        }
+        finish(false);
+        return;
+      }
+      std::string name = path.substr(path.find_last_of('/') + 1);
+      files_.push_back(File{fd, static_cast<uint64_t>(st.st_size), name});
+      size_ += static_cast<uint64_t>(st.st_size);
+    }
+    LOG_INFO("sending snapshot %s, %lu files, %lu bytes to [%lu]",
+             paths.back().c_str(),
+             files_.size(),
+             size_,
+             msg_->to);
+
+    arm_idle_timer();
+    auto self = shared_from_this();
+    socket_.async_connect(endpoint_, [self](const boost::system::error_code& err) {
+      if (err) {
+        LOG_ERROR("connect [%lu] error %s", self->msg_->to, err.message().c_str());
+        self->finish(false);
+        return;
+      }
+      self->socket_.native_non_blocking(true);
+      self->send_begin();
+      self->start_read_ack();
+    });
+  }
+
+ private:
+  struct File {
+    int fd;
+    uint64_t size;
+    std::string name;
+  };
+
+  // arm_idle_timer restarts the idle timeout, on every write and ack
+  void arm_idle_timer() {
+    auto self = shared_from_this();
+    idle_timer_.expires_from_now(boost::posix_time::seconds(kSnapshotIdleTimeout));
+    idle_timer_.async_wait([self](const boost::system::error_code& error) {
+      if (error || self->done_) {
+        return;
+      }
+      LOG_ERROR("send snapshot to [%lu] timeout", self->msg_->to);
+      self->finish(false);
+    });
+  }
+
+  void send_begin() {
+    msgpack::sbuffer sbuf;
+    msgpack::pack(sbuf, *msg_);
+
+    SnapshotBegin begin;
+    begin.size = htobe64(size_);
+    begin.files = htonl(static_cast<uint32_t>(files_.size()));
+    frame_.resize(sizeof(TransportMeta) + sizeof(begin) + sbuf.size());
+    TransportMeta* meta = (TransportMeta*) frame_.data();
+    meta->type = TransportTypeSnapshot;
+    meta->len = htonl(static_cast<uint32_t>(sizeof(begin) + sbuf.size()));
+    memcpy(meta->data, &begin, sizeof(begin));
+    memcpy(meta->data + sizeof(begin), sbuf.data(), sbuf.size());
+    start_write();
+  }
+
+  // send_file_begin starts the next file
+  void send_file_begin() {
+    if (file_started_) {
+      ++current_;
+      file_offset_ = 0;
+    }
+    file_started_ = true;
+
+    const File& file = files_[current_];
+    SnapshotFile begin;
+    begin.size = htobe64(file.size);
+    frame_.resize(sizeof(TransportMeta) + sizeof(begin) + file.name.size());
+    TransportMeta* meta = (TransportMeta*) frame_.data();
+    meta->type = TransportTypeSnapshotFile;
+    meta->len = htonl(static_cast<uint32_t>(sizeof(begin) + file.name.size()));
+    memcpy(meta->data, &begin, sizeof(begin));
+    memcpy(meta->data + sizeof(begin), file.name.data(), file.name.size());
+    file_remaining_ = 0;
+    start_write();
+  }
+
+  // send_chunk sends the next chunk once the window allows it
+  void send_chunk() {
+    if (done_ || writing_ || sent_ == size_ || sent_ - acked_ >= kSnapshotWindow) {
+      return;
+    }
+    if (!file_started_ || file_offset_ == files_[current_].size) {
+      send_file_begin();
+      return;
+    }
+
+    uint64_t remaining = files_[current_].size - file_offset_;
+    uint32_t len = static_cast<uint32_t>(std::min<uint64_t>(kSnapshotChunkSize, remaining));
+    frame_.resize(sizeof(TransportMeta));
+    TransportMeta* meta = (TransportMeta*) frame_.data();
+    meta->type = TransportTypeSnapshotChunk;
+    meta->len = htonl(len);
+    file_remaining_ = len;
+
+    uint64_t wait = limiter_->reserve(len);
+    if (wait == 0) {
+      start_write();
+      return;
+    }
+    writing_ = true;
+    auto self = shared_from_this();
+    timer_.expires_from_now(boost::posix_time::microseconds(wait));
+    timer_.async_wait([self](const boost::system::error_code& error) {
+      if (error || self->done_) {
+        return;
+      }
+      self->start_write();
+    });
+  }
+
+  // start_write writes frame_, then the file_remaining_ bytes of the current file
+  void start_write() {
+    writing_ = true;
+    auto self = shared_from_this();
+    boost::asio::async_write(socket_,
+                             boost::asio::buffer(frame_),
+                             [self](const boost::system::error_code& error, std::size_t bytes) {
+                               if (error) {
+                                 LOG_ERROR("send snapshot to [%lu] error %s",
+                                           self->msg_->to,
+                                           error.message().c_str());
+                                 self->finish(false);
+                                 return;
+                               }
+                               self->arm_idle_timer();
+                               self->send_file();
+                             });
+  }
+
+  // send_file copies the file to the socket in the kernel
+  void send_file() {
+    while (file_remaining_ > 0) {
+      off_t offset = static_cast<off_t>(file_offset_);
+      ssize_t n = sendfile(socket_.native_handle(), files_[current_].fd, &offset, file_remaining_);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && errno == EAGAIN) {
+        auto self = shared_from_this();
+        socket_.async_write_some(boost::asio::null_buffers(),
+                                 [self](const boost::system::error_code& error, std::size_t) {
+                                   if (error) {
+                                     LOG_ERROR("send snapshot to [%lu] error %s",
+                                               self->msg_->to,
+                                               error.message().c_str());
+                                     self->finish(false);
+                                     return;
+                                   }
+                                   self->arm_idle_timer();
+                                   self->send_file();
+                                 });
+        return;
+      }
+      if (n <= 0) {
+        LOG_ERROR("send snapshot error %s", n < 0 ? strerror(errno) : "unexpected end of file");
+        finish(false);
+        return;
+      }
+      sent_ += n;
+      file_offset_ += n;
+      file_remaining_ -= n;
+    }
+
+    writing_ = false;
+    send_chunk();
+  }
+
+  void start_read_ack() {
+    auto self = shared_from_this();
+    boost::asio::async_read(socket_,
+                            boost::asio::buffer(&ack_, sizeof(ack_)),
+                            [self](const boost::system::error_code& error, std::size_t bytes) {
+                              if (error) {
+                                LOG_ERROR("read snapshot ack from [%lu] error %s",
+                                          self->msg_->to,
+                                          error.message().c_str());
+                                self->finish(false);
+                                return;
+                              }
+                              self->on_ack();
+                            });
+  }
+
+  void on_ack() {
+    arm_idle_timer();
+    switch (ack_.status) {
+      case SnapshotAckProgress: {
+        acked_ = be64toh(ack_.offset);
+        send_chunk();
+        start_read_ack();
+        break;
+      }
+      case SnapshotAckDone: {
+        LOG_INFO("sent snapshot, %lu files, %lu bytes to [%lu]", files_.size(), size_, msg_->to);
+        finish(true);
+        break;
+      }
+      default: {
+        LOG_ERROR("[%lu] failed to receive snapshot", msg_->to);
+        finish(false);
+        break;
+      }
+    }
+  }
+
+  void finish(bool ok) {
+    if (done_) {
+      return;
+    }
+    done_ = true;
+    raft_->report_snapshot(msg_->to, ok ? SnapshotFinish : SnapshotFailure);
+
+    boost::system::error_code code;
+    timer_.cancel(code);
+    idle_timer_.cancel(code);
+    socket_.close(code);
+  }
+
+  boost::asio::ip::tcp::socket socket_;
+  boost::asio::deadline_timer timer_;      // paces the chunks for the rate limiter
+  boost::asio::deadline_timer idle_timer_; // fails the stream without progress
+  boost::asio::ip::tcp::endpoint endpoint_;
+  RaftServer* raft_;
+  RateLimiter* limiter_;
+  proto::MessagePtr msg_;
+  std::vector<File> files_;
+  uint64_t size_;   // of all the files
+  uint64_t sent_;   // bytes of all the files sent
+  uint64_t acked_;
+  size_t current_;  // the file being sent
+  uint64_t file_offset_;
+  bool file_started_;
+  uint32_t file_remaining_; // bytes of the current chunk not yet sent
+  bool writing_;
+  bool done_;
+  std::vector<uint8_t> frame_;
+  SnapshotAck ack_;
+};
+
 class PeerImpl : public Peer {
  public:
-  explicit PeerImpl(boost::asio::io_service& io_service, uint64_t peer, const std::string& peer_str)
-      : peer_(peer),
+  explicit PeerImpl(boost::asio::io_service& io_service,
+                    RaftServer* raft,
+                    uint64_t peer,
+                    const std::string& peer_str,
+                    RateLimiter* snapshot_limiter)
+      : raft_(raft),
+        peer_(peer),
+        snapshot_limiter_(snapshot_limiter),
         io_service_(io_service),
         timer_(io_service) {
     std::vector<std::string> strs;
@@ -109,8 +418,8 @@ class PeerImpl : public Peer {
     do_send_data(TransportTypeStream, (const uint8_t*) sbuf.data(), (uint32_t) sbuf.size());
   }
 
-  void send_snap(proto::SnapshotPtr snap) final {
-    LOG_DEBUG("no impl yet");
+  void send_snap(proto::MessagePtr msg) final {
+    std::make_shared<SnapshotSender>(io_service_, endpoint_, raft_, snapshot_limiter_, std::move(msg))->start();
   }
 
   void update(const std::string& peer) final {
@@ -154,7 +463,9 @@ class PeerImpl : public Peer {
     do_send_data(TransportTypeDebug, (const uint8_t*) &dbg, sizeof(dbg));
   }
 
+  RaftServer* raft_;
   uint64_t peer_;
+  RateLimiter* snapshot_limiter_;
   boost::asio::io_service& io_service_;
   friend class ClientSession;
   std::shared_ptr<ClientSession> session_;
@@ -175,8 +486,16 @@ void ClientSession::close_session() {
   peer_->session_ = nullptr;
 }
 
-std::shared_ptr<Peer> Peer::creat(uint64_t peer, const std::string& peer_str, void* io_service) {
-  std::shared_ptr<PeerImpl> peer_ptr(new PeerImpl(*(boost::asio::io_service*) io_service, peer, peer_str));
+std::shared_ptr<Peer> Peer::creat(RaftServer* raft,
+                                  uint64_t peer,
+                                  const std::string& peer_str,
+                                  void* io_service,
+                                  RateLimiter* snapshot_limiter) {
+  std::shared_ptr<PeerImpl> peer_ptr(new PeerImpl(*(boost::asio::io_service*) io_service,
+                                                  raft,
+                                                  peer,
+                                                  peer_str,
+                                                  snapshot_limiter));
   return peer_ptr;
 }
 
@@ -1,6 +1,8 @@
 #pragma once
 #include <memory>
 #include <raft-kv/raft/proto.h>
+#include <raft-kv/transport/raft_server.h>
+#include <raft-kv/common/rate_limiter.h>
 
 namespace kv {
 
@@ -16,9 +18,10 @@ class Peer {
   // raft.
   virtual void send(proto::MessagePtr msg) = 0;
 
-  // sendSnap sends the merged snapshot message to the remote peer. Its behavior
-  // is similar to send.
-  virtual void send_snap(proto::SnapshotPtr snap) = 0;
+  // send_snap streams the snapshot file of a MsgSnap to the remote peer on a
+  // connection of its own. Its behavior is similar to send, the outcome is
+  // reported to raft with report_snapshot.
+  virtual void send_snap(proto::MessagePtr msg) = 0;
 
   // update updates the urls of remote peer.
   virtual void update(const std::string& peer) = 0;
@@ -31,7 +34,12 @@ class Peer {
   // elegantly
   virtual void stop() = 0;
 
-  static std::shared_ptr<Peer> creat(uint64_t peer, const std::string& peer_str, void* io_service);
+  // the snapshots sent to the peer are throttled by snapshot_limiter
+  static std::shared_ptr<Peer> creat(RaftServer* raft,
+                                     uint64_t peer,
+                                     const std::string& peer_str,
+                                     void* io_service,
+                                     RateLimiter* snapshot_limiter);
 };
 typedef std::shared_ptr<Peer> PeerPtr;
 
@@ -5,6 +5,27 @@ namespace kv {
 const uint8_t TransportTypeStream = 1;
 const uint8_t TransportTypePipeline = 3;
 const uint8_t TransportTypeDebug = 5;
+const uint8_t TransportTypeSnapshot = 7;
+const uint8_t TransportTypeSnapshotChunk = 9;
+const uint8_t TransportTypeSnapshotFile = 11;
+
+// The files of a snapshot, a full snapshot and its deltas, are streamed on a
+// connection of their own: a TransportTypeSnapshot frame holding SnapshotBegin
+// followed by the msgpack MsgSnap, then for each file a TransportTypeSnapshotFile
+// frame holding SnapshotFile followed by the file name, and the file in
+// TransportTypeSnapshotChunk frames of at most kSnapshotChunkSize bytes. The receiver
+// answers every chunk with a SnapshotAck and the sender keeps at most kSnapshotWindow
+// bytes unacknowledged, so neither side buffers more than a few chunks.
+const uint32_t kSnapshotChunkSize = 1024 * 1024;
+const uint64_t kSnapshotWindow = 8 * kSnapshotChunkSize;
+
+// Either side gives up on a snapshot stream that made no progress for
+// kSnapshotIdleTimeout seconds, long enough for the receiver to sync a file
+const long kSnapshotIdleTimeout = 10;
+
+const uint8_t SnapshotAckProgress = 0;
+const uint8_t SnapshotAckDone = 1;
+const uint8_t SnapshotAckFailure = 2;
 
 #pragma pack(1)
 struct TransportMeta {
@@ -21,4 +42,20 @@ struct DebugMessage {
 };
 #pragma pack()
 
+#pragma pack(1)
+struct SnapshotBegin {
+  uint64_t size;  // big endian, of all the files
+  uint32_t files; // big endian
+};
+
+struct SnapshotFile {
+  uint64_t size; // big endian
+};
+
+struct SnapshotAck {
+  uint64_t offset; // big endian, the bytes of all the files written by the receiver
+  uint8_t status;
+};
+#pragma pack()
+
 }
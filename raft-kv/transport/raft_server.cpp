@@ -4,6 +4,11 @@
 #include <raft-kv/transport/proto.h>
 #include <raft-kv/transport/transport.h>
 #include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <endian.h>
+#include <unistd.h>
+#include <raft-kv/snap/snapshot_file.h>
 
 namespace kv {
 
@@ -12,10 +17,36 @@ class ServerSession : public std::enable_shared_from_this<ServerSession> {
  public:
   explicit ServerSession(boost::asio::io_service& io_service, AsioServer* server)
       : socket(io_service),
-        server_(server) {
+        idle_timer_(io_service),
+        server_(server),
+        snapshot_fd_(-1),
+        snapshot_size_(0),
+        snapshot_offset_(0),
+        snapshot_files_(0),
+        files_received_(0),
+        file_size_(0),
+        file_offset_(0),
+        splice_remaining_(0),
+        ack_writing_(false),
+        ack_pending_(false) {
 
   }
 
+  ~ServerSession() {
+    if (pipe_[0] >= 0) {
+      ::close(pipe_[0]);
+      ::close(pipe_[1]);
+    }
+    if (snapshot_fd_ >= 0) {
+      ::close(snapshot_fd_);
+    }
+    if (snapshot_msg_) {
+      // the connection closed before the whole snapshot was received
+      boost::system::error_code code;
+      boost::filesystem::remove_all(snapshot_dir_, code);
+    }
+  }
+
   void start_read_meta() {
     assert(sizeof(meta_) == 5);
     meta_.type = 0;
@@ -35,7 +66,11 @@ class ServerSession : public std::enable_shared_from_this<ServerSession> {
         LOG_DEBUG("invalid data len %lu", bytes);
         return;
       }
-      self->start_read_message();
+      if (self->meta_.type == TransportTypeSnapshotChunk) {
+        self->start_receive_snapshot_chunk();
+      } else {
+        self->start_read_message();
+      }
     };
 
     boost::asio::async_read(socket, buffer, boost::asio::transfer_exactly(sizeof(meta_)), handler);
@@ -90,6 +125,18 @@ class ServerSession : public std::enable_shared_from_this<ServerSession> {
         on_receive_stream_message(std::move(msg));
         break;
       }
+      case TransportTypeSnapshot: {
+        if (!on_receive_snapshot(len)) {
+          return;
+        }
+        break;
+      }
+      case TransportTypeSnapshotFile: {
+        if (!on_receive_snapshot_file(len)) {
+          return;
+        }
+        break;
+      }
       default: {
         LOG_DEBUG("unknown msg type %d, len = %d", meta_.type, ntohl(meta_.len));
         return;
@@ -101,11 +148,93 @@ class ServerSession : public std::enable_shared_from_this<ServerSession> {
 
   void on_receive_stream_message(proto::MessagePtr msg);
 
+  // on_receive_snapshot creates the directory the files of a snapshot are streamed
+  // to, returns false to close the connection
+  bool on_receive_snapshot(uint32_t len);
+
+  // on_receive_snapshot_file opens the next file of the snapshot
+  bool on_receive_snapshot_file(uint32_t len);
+
+  // close_snapshot_file syncs and closes the file being received
+  bool close_snapshot_file();
+
+  // start_receive_snapshot_chunk splices a chunk from the socket into the snapshot
+  // file through a pipe, the data never enters user space
+  void start_receive_snapshot_chunk();
+
+  void splice_snapshot_chunk();
+
+  // finish_snapshot checks the received files and hands the MsgSnap to raft
+  bool finish_snapshot();
+
+  // arm_idle_timer restarts the idle timeout of the snapshot being received, the
+  // connection is closed and the received files removed if the leader goes quiet
+  void arm_idle_timer() {
+    auto self = shared_from_this();
+    idle_timer_.expires_from_now(boost::posix_time::seconds(kSnapshotIdleTimeout));
+    idle_timer_.async_wait([self](const boost::system::error_code& error) {
+      if (error || !self->snapshot_msg_) {
+        return;
+      }
+      LOG_ERROR("receive snapshot %s timeout", self->snapshot_dir_.c_str());
+      boost::system::error_code code;
+      self->socket.close(code);
+    });
+  }
+
+  void send_snapshot_ack(uint8_t status) {
+    pending_ack_.offset = htobe64(snapshot_offset_);
+    pending_ack_.status = status;
+    ack_pending_ = true;
+    if (!ack_writing_) {
+      start_write_ack();
+    }
+  }
+
+  void start_write_ack() {
+    ack_ = pending_ack_;
+    ack_pending_ = false;
+    ack_writing_ = true;
+
+    auto self = shared_from_this();
+    auto buffer = boost::asio::buffer(&ack_, sizeof(ack_));
+    boost::asio::async_write(socket, buffer, [self](const boost::system::error_code& error, std::size_t bytes) {
+      self->ack_writing_ = false;
+      if (error) {
+        LOG_DEBUG("write ack error %s", error.message().c_str());
+        return;
+      }
+      if (self->ack_pending_) {
+        self->start_write_ack();
+      }
+    });
+  }
+
   boost::asio::ip::tcp::socket socket;
  private:
+  boost::asio::deadline_timer idle_timer_;
   AsioServer* server_;
   TransportMeta meta_;
   std::vector<uint8_t> buffer_;
+
+  // the snapshot being received
+  proto::MessagePtr snapshot_msg_;
+  std::string snapshot_dir_;
+  std::string snapshot_path_; // the file being received
+  int snapshot_fd_;
+  uint64_t snapshot_size_;    // of all the files
+  uint64_t snapshot_offset_;  // bytes of all the files received
+  uint32_t snapshot_files_;
+  uint32_t files_received_;
+  uint64_t file_size_;
+  uint64_t file_offset_;
+  uint32_t splice_remaining_; // bytes of the current chunk not yet spliced
+  int pipe_[2] = {-1, -1};
+
+  SnapshotAck ack_;         // being written
+  SnapshotAck pending_ack_; // latest ack to write
+  bool ack_writing_;
+  bool ack_pending_;
 };
 typedef std::shared_ptr<ServerSession> ServerSessionPtr;
 
@@ -155,6 +284,10 @@ class AsioServer : public IoServer {
 
   }
 
+  RaftServer* raft() const {
+    return raft_;
+  }
+
   void on_message(proto::MessagePtr msg) {
     raft_->process(std::move(msg), [](const Status& status) {
       if (!status.is_ok()) {
@@ -173,6 +306,200 @@ void ServerSession::on_receive_stream_message(proto::MessagePtr msg) {
   server_->on_message(std::move(msg));
 }
 
+bool ServerSession::on_receive_snapshot(uint32_t len) {
+  if (snapshot_msg_ || len < sizeof(SnapshotBegin)) {
+    LOG_ERROR("invalid snapshot frame, len = %u", len);
+    return false;
+  }
+
+  proto::MessagePtr msg(new proto::Message());
+  try {
+    msgpack::object_handle oh = msgpack::unpack((const char*) buffer_.data() + sizeof(SnapshotBegin),
+                                                len - sizeof(SnapshotBegin));
+    oh.get().convert(*msg);
+  }
+  catch (std::exception& e) {
+    LOG_ERROR("bad snapshot message %s", e.what());
+    return false;
+  }
+  if (msg->type != proto::MsgSnap) {
+    LOG_ERROR("bad snapshot message type %s", proto::msg_type_to_string(msg->type));
+    return false;
+  }
+
+  snapshot_dir_ = server_->raft()->received_snapshot_path(msg->snapshot.metadata);
+  boost::system::error_code code;
+  boost::filesystem::remove_all(snapshot_dir_, code);
+  boost::filesystem::create_directories(snapshot_dir_, code);
+  if (code) {
+    LOG_ERROR("create %s error %s", snapshot_dir_.c_str(), code.message().c_str());
+    send_snapshot_ack(SnapshotAckFailure);
+    return false;
+  }
+
+  const SnapshotBegin* begin = (const SnapshotBegin*) buffer_.data();
+  snapshot_size_ = be64toh(begin->size);
+  snapshot_files_ = ntohl(begin->files);
+  snapshot_offset_ = 0;
+  files_received_ = 0;
+  snapshot_msg_ = std::move(msg);
+  arm_idle_timer();
+  LOG_INFO("receiving snapshot %s, %u files, %lu bytes from [%lu]",
+           snapshot_dir_.c_str(),
+           snapshot_files_,
+           snapshot_size_,
+           snapshot_msg_->from);
+
+  if (snapshot_files_ == 0) {
+    LOG_ERROR("empty snapshot");
+    send_snapshot_ack(SnapshotAckFailure);
+    return false;
+  }
+  return true;
+}
+
+bool ServerSession::on_receive_snapshot_file(uint32_t len) {
+  if (!snapshot_msg_ || snapshot_fd_ >= 0 || files_received_ == snapshot_files_ || len < sizeof(SnapshotFile)) {
+    LOG_ERROR("invalid snapshot file frame, len = %u", len);
+    return false;
+  }
+
+  // the name comes from the network, it must stay within the directory
+  std::string name((const char*) buffer_.data() + sizeof(SnapshotFile), len - sizeof(SnapshotFile));
+  if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos) {
+    LOG_ERROR("invalid snapshot file name %s", name.c_str());
+    send_snapshot_ack(SnapshotAckFailure);
+    return false;
+  }
+
+  snapshot_path_ = snapshot_dir_ + "/" + name;
+  snapshot_fd_ = ::open(snapshot_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (snapshot_fd_ < 0) {
+    LOG_ERROR("open %s error %s", snapshot_path_.c_str(), strerror(errno));
+    send_snapshot_ack(SnapshotAckFailure);
+    return false;
+  }
+  file_size_ = be64toh(((const SnapshotFile*) buffer_.data())->size);
+  file_offset_ = 0;
+  arm_idle_timer();
+  ++files_received_;
+  if (file_size_ == 0 || snapshot_offset_ + file_size_ > snapshot_size_) {
+    LOG_ERROR("invalid snapshot file size %lu", file_size_);
+    send_snapshot_ack(SnapshotAckFailure);
+    return false;
+  }
+  return true;
+}
+
+bool ServerSession::close_snapshot_file() {
+  bool ok = fsync(snapshot_fd_) == 0;
+  ::close(snapshot_fd_);
+  snapshot_fd_ = -1;
+  if (!ok) {
+    LOG_ERROR("sync %s error %s", snapshot_path_.c_str(), strerror(errno));
+    send_snapshot_ack(SnapshotAckFailure);
+  }
+  return ok;
+}
+
+void ServerSession::start_receive_snapshot_chunk() {
+  uint32_t len = ntohl(meta_.len);
+  if (snapshot_fd_ < 0 || file_offset_ + len > file_size_) {
+    LOG_ERROR("unexpected snapshot chunk, len = %u", len);
+    return;
+  }
+
+  if (pipe_[0] < 0) {
+    if (pipe2(pipe_, O_CLOEXEC) != 0) {
+      LOG_ERROR("pipe error %s", strerror(errno));
+      pipe_[0] = pipe_[1] = -1;
+      send_snapshot_ack(SnapshotAckFailure);
+      return;
+    }
+    // best effort, a larger pipe moves a chunk in fewer calls
+    fcntl(pipe_[1], F_SETPIPE_SZ, kSnapshotChunkSize);
+    socket.native_non_blocking(true);
+  }
+  splice_remaining_ = len;
+  splice_snapshot_chunk();
+}
+
+void ServerSession::splice_snapshot_chunk() {
+  while (splice_remaining_ > 0) {
+    ssize_t n = splice(socket.native_handle(), nullptr, pipe_[1], nullptr, splice_remaining_,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      auto self = shared_from_this();
+      socket.async_read_some(boost::asio::null_buffers(), [self](const boost::system::error_code& error, std::size_t) {
+        if (error) {
+          LOG_DEBUG("read error %s", error.message().c_str());
+          return;
+        }
+        self->splice_snapshot_chunk();
+      });
+      return;
+    }
+    if (n <= 0) {
+      LOG_DEBUG("splice error %s", n == 0 ? "connection closed" : strerror(errno));
+      return;
+    }
+
+    // drain the pipe into the file
+    while (n > 0) {
+      ssize_t m = splice(pipe_[0], nullptr, snapshot_fd_, nullptr, n, SPLICE_F_MOVE);
+      if (m < 0 && errno == EINTR) {
+        continue;
+      }
+      if (m <= 0) {
+        LOG_ERROR("write %s error %s", snapshot_path_.c_str(), strerror(errno));
+        send_snapshot_ack(SnapshotAckFailure);
+        return;
+      }
+      n -= m;
+      splice_remaining_ -= m;
+      file_offset_ += m;
+      snapshot_offset_ += m;
+    }
+    arm_idle_timer();
+  }
+
+  if (file_offset_ == file_size_ && !close_snapshot_file()) {
+    return;
+  }
+  if (snapshot_offset_ == snapshot_size_ && files_received_ == snapshot_files_) {
+    if (!finish_snapshot()) {
+      return;
+    }
+  } else {
+    send_snapshot_ack(SnapshotAckProgress);
+  }
+  start_read_meta();
+}
+
+bool ServerSession::finish_snapshot() {
+  boost::system::error_code code;
+  boost::filesystem::directory_iterator end;
+  for (boost::filesystem::directory_iterator it(snapshot_dir_, code); !code && it != end; it.increment(code)) {
+    std::string path = (*it).path().string();
+    std::unique_ptr<SnapshotReader> reader;
+    Status status = SnapshotReader::open(path, reader);
+    if (!status.is_ok()) {
+      LOG_ERROR("received invalid snapshot %s, %s", path.c_str(), status.to_string().c_str());
+      send_snapshot_ack(SnapshotAckFailure);
+      return false;
+    }
+  }
+
+  LOG_INFO("received snapshot %s", snapshot_dir_.c_str());
+  idle_timer_.cancel(code);
+  server_->on_message(std::move(snapshot_msg_));
+  send_snapshot_ack(SnapshotAckDone);
+  return true;
+}
+
 std::shared_ptr<IoServer> IoServer::create(void* io_service,
                                            const std::string& host,
                                            RaftServer* raft) {
@@ -1,5 +1,7 @@
 #pragma once
 #include <memory>
+#include <string>
+#include <vector>
 #include <raft-kv/raft/proto.h>
 #include <raft-kv/raft/node.h>
 #include <raft-kv/common/status.h>
@@ -18,6 +20,14 @@ class RaftServer {
 
   virtual void report_snapshot(uint64_t id, SnapshotStatus status) = 0;
 
+  // snapshot_files returns the files of a local snapshot, a full snapshot followed
+  // by its deltas, streamed to the followers that fell behind the compacted log
+  virtual Status snapshot_files(const proto::SnapshotMetadata& meta, std::vector<std::string>& paths) const = 0;
+
+  // received_snapshot_path returns the directory the files of a snapshot received
+  // from the leader are streamed to, they are installed once raft accepts the snapshot
+  virtual std::string received_snapshot_path(const proto::SnapshotMetadata& meta) const = 0;
+
   virtual uint64_t node_id() const = 0;
 };
 typedef std::shared_ptr<RaftServer> RaftServerPtr;
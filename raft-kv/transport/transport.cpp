@@ -8,9 +8,10 @@ namespace kv {
 class TransportImpl : public Transport {
 
  public:
-  explicit TransportImpl(RaftServer* raft, uint64_t id)
+  explicit TransportImpl(RaftServer* raft, uint64_t id, uint64_t snapshot_rate)
       : raft_(raft),
-        id_(id) {
+        id_(id),
+        snapshot_limiter_(snapshot_rate) {
   }
 
   ~TransportImpl() final {
@@ -39,7 +40,7 @@ class TransportImpl : public Transport {
       return;
     }
 
-    PeerPtr p = Peer::creat(id, peer, (void*) &io_service_);
+    PeerPtr p = Peer::creat(raft_, id, peer, (void*) &io_service_, &snapshot_limiter_);
     p->start();
     peers_[id] = p;
   }
@@ -58,7 +59,11 @@ class TransportImpl : public Transport {
 
         auto it = peers_.find(msg->to);
         if (it != peers_.end()) {
-          it->second->send(msg);
+          if (msg->type == proto::MsgSnap) {
+            it->second->send_snap(msg);
+          } else {
+            it->second->send(msg);
+          }
           continue;
         }
         LOG_DEBUG("ignored message %d (sent to unknown peer %lu)", msg->type, msg->to);
@@ -74,6 +79,7 @@ class TransportImpl : public Transport {
  private:
   RaftServer* raft_;
   uint64_t id_;
+  RateLimiter snapshot_limiter_; // shared by the snapshots sent to all the peers
 
   std::thread io_thread_;
   boost::asio::io_service io_service_;
@@ -84,8 +90,8 @@ class TransportImpl : public Transport {
   IoServerPtr server_;
 };
 
-std::shared_ptr<Transport> Transport::create(RaftServer* raft, uint64_t id) {
-  std::shared_ptr<TransportImpl> impl(new TransportImpl(raft, id));
+std::shared_ptr<Transport> Transport::create(RaftServer* raft, uint64_t id, uint64_t snapshot_rate) {
+  std::shared_ptr<TransportImpl> impl(new TransportImpl(raft, id, snapshot_rate));
   return impl;
 }
 
@@ -7,6 +7,7 @@
 #include <raft-kv/transport/raft_server.h>
 #include <raft-kv/transport/transport.h>
 #include <raft-kv/common/status.h>
+#include <raft-kv/common/rate_limiter.h>
 #include <raft-kv/raft/proto.h>
 #include <raft-kv/raft/node.h>
 
@@ -31,7 +32,9 @@ class Transport {
 
   virtual void remove_peer(uint64_t id) = 0;
 
-  static std::shared_ptr<Transport> create(RaftServer* raft, uint64_t id);
+  // create creates the transport of member id, the snapshots it sends to all the
+  // peers take at most snapshot_rate bytes a second together, if not 0
+  static std::shared_ptr<Transport> create(RaftServer* raft, uint64_t id, uint64_t snapshot_rate = 0);
 };
 typedef std::shared_ptr<Transport> TransporterPtr;
 
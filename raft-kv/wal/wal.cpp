@@ -307,6 +307,14 @@ Status WAL::save(proto::HardState hs, const std::vector<proto::EntryPtr>& ents)
   return cut();
 }
 
+uint64_t WAL::size() const {
+  uint64_t size = 0;
+  for (const std::shared_ptr<WAL_File>& file : files_) {
+    size += file->file_size;
+  }
+  return size;
+}
+
 Status WAL::cut() {
   files_.back()->sync();
   return Status::ok();
@@ -61,6 +61,9 @@ class WAL {
 
   Status cut();
 
+  // size returns the bytes of the WAL files
+  uint64_t size() const;
+
   // release_to releases the wal file, which has smaller index than the given index
   // except the largest one among them.
   // For example, if WAL is holding lock 1,2,3,4,5,6, release_to(4) will release
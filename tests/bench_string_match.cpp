@@ -0,0 +1,45 @@
+#include <chrono>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <raft-kv/common/glob.h>
+using namespace kv;
+
+// compares string_match_len with the compiled GlobMatcher over a key space shaped like "user:<id>:<field>"
+int main(int argc, char* argv[]) {
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  static const char* fields[] = {"profile", "session", "settings", "followers"};
+
+  std::vector<std::string> keys;
+  keys.reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    keys.push_back("user:" + std::to_string(i * 7919 % n) + ":" + fields[i % 4]);
+  }
+
+  static const char* patterns[] = {"user:12*", "*:profile", "*9999*", "user:*:se?sion", "user:[0-4]*:f*s", "*a*b*c*d*e*"};
+  for (const char* pattern : patterns) {
+    int len = static_cast<int>(strlen(pattern));
+
+    auto start = std::chrono::steady_clock::now();
+    size_t interpreted = 0;
+    for (const std::string& key : keys) {
+      interpreted += string_match_len(pattern, len, key.data(), static_cast<int>(key.size()), 0);
+    }
+    auto middle = std::chrono::steady_clock::now();
+
+    GlobMatcher matcher(pattern, len);
+    size_t compiled = 0;
+    for (const std::string& key : keys) {
+      compiled += matcher.match(key);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double interpreted_ns = std::chrono::duration<double, std::nano>(middle - start).count() / n;
+    double compiled_ns = std::chrono::duration<double, std::nano>(end - middle).count() / n;
+    fprintf(stderr, "%-18s matches %8lu, string_match_len %6.1f ns/key, GlobMatcher %6.1f ns/key, %.1fx%s\n",
+            pattern, compiled, interpreted_ns, compiled_ns, interpreted_ns / compiled_ns,
+            interpreted == compiled ? "" : " MISMATCH");
+  }
+  return 0;
+}
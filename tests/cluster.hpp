@@ -0,0 +1,245 @@
+#pragma once
+#include <gtest/gtest.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <hiredis/hiredis.h>
+#include <raft-kv/server/raft_node.h>
+
+using namespace kv;
+
+// each test process takes its own range of ports, below the ephemeral ports the
+// clients connect from
+static uint16_t next_test_port() {
+  static uint16_t port = static_cast<uint16_t>(20000 + (getpid() % 120) * 100);
+  return port++;
+}
+
+// TestDir runs a test in an empty directory of its own, the members keep
+// their data in node_<id> below the working directory
+class TestDir {
+ public:
+  explicit TestDir(const std::string& name) {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "_test_cluster/%s_%d_%d", name.c_str(), (int) time(NULL), getpid());
+    cwd_ = boost::filesystem::current_path();
+    path_ = boost::filesystem::absolute(buffer);
+    boost::filesystem::create_directories(path_);
+    boost::filesystem::current_path(path_);
+  }
+
+  ~TestDir() {
+    boost::filesystem::current_path(cwd_);
+    boost::filesystem::remove_all(path_);
+  }
+
+  std::string path() const {
+    return path_.string();
+  }
+
+ private:
+  boost::filesystem::path cwd_;
+  boost::filesystem::path path_;
+};
+
+// Client is a blocking redis client, replies are returned as strings:
+// +status, -error, :integer, "nil", a bulk string as is, and arrays as
+// [a,b,c]
+class Client {
+ public:
+  explicit Client(uint16_t port)
+      : ctx_(redisConnect("127.0.0.1", port)) {
+    // a reply that never comes fails the test instead of hanging it
+    struct timeval timeout = {10, 0};
+    redisSetTimeout(ctx_, timeout);
+  }
+
+  ~Client() {
+    redisFree(ctx_);
+  }
+
+  bool connected() const {
+    return ctx_ && ctx_->err == 0;
+  }
+
+  std::string cmd(const std::vector<std::string>& args) {
+    append(args);
+    return get_reply();
+  }
+
+  // append sends a command without waiting for its reply, to pipeline commands
+  void append(const std::vector<std::string>& args) {
+    std::vector<const char*> argv;
+    std::vector<size_t> lens;
+    for (const std::string& arg : args) {
+      argv.push_back(arg.data());
+      lens.push_back(arg.size());
+    }
+    redisAppendCommandArgv(ctx_, static_cast<int>(argv.size()), argv.data(), lens.data());
+  }
+
+  std::string get_reply() {
+    void* reply = nullptr;
+    if (redisGetReply(ctx_, &reply) != REDIS_OK || !reply) {
+      return "-connection error";
+    }
+    std::string str = to_string(static_cast<redisReply*>(reply));
+    freeReplyObject(reply);
+    return str;
+  }
+
+  static std::string to_string(const redisReply* reply) {
+    switch (reply->type) {
+      case REDIS_REPLY_STATUS:
+        return "+" + std::string(reply->str, reply->len);
+      case REDIS_REPLY_ERROR:
+        return "-" + std::string(reply->str, reply->len);
+      case REDIS_REPLY_INTEGER:
+        return ":" + std::to_string(reply->integer);
+      case REDIS_REPLY_NIL:
+        return "nil";
+      case REDIS_REPLY_STRING:
+        return std::string(reply->str, reply->len);
+      case REDIS_REPLY_ARRAY: {
+        std::string str = "[";
+        for (size_t i = 0; i < reply->elements; ++i) {
+          if (i > 0) {
+            str += ",";
+          }
+          str += to_string(reply->element[i]);
+        }
+        return str + "]";
+      }
+      default:
+        return "?";
+    }
+  }
+
+ private:
+  redisContext* ctx_;
+};
+
+// token_index returns the index of a "+OK <index>" reply, 0 if it has none
+static uint64_t token_index(const std::string& reply) {
+  if (reply.compare(0, 4, "+OK ") != 0) {
+    return 0;
+  }
+  return std::stoull(reply.substr(4));
+}
+
+// Cluster runs the members of a cluster in the test process, each on a
+// thread of its own
+class Cluster {
+ public:
+  explicit Cluster(size_t size, bool redirect = false, bool ordered_index = false)
+      : redirect_(redirect),
+        ordered_index_(ordered_index),
+        nodes_(size),
+        threads_(size) {
+    // a client writing to a stopped member gets an error instead
+    signal(SIGPIPE, SIG_IGN);
+    for (size_t i = 0; i < size; ++i) {
+      std::string peer = "127.0.0.1:" + std::to_string(next_test_port());
+      std::string address = "127.0.0.1:" + std::to_string(next_test_port());
+      ports_.push_back(static_cast<uint16_t>(std::stoi(address.substr(address.find(':') + 1))));
+      cluster_ += (i > 0 ? "," : "") + peer;
+      redirect_peers_ += (i > 0 ? "," : "") + address;
+    }
+  }
+
+  ~Cluster() {
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      stop(i + 1);
+    }
+  }
+
+  void start_all() {
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      start(i + 1);
+    }
+  }
+
+  void start(uint64_t id) {
+    ASSERT_FALSE(nodes_[id - 1]);
+    std::shared_ptr<RaftNode> node = std::make_shared<RaftNode>(id,
+                                                                cluster_,
+                                                                ports_[id - 1],
+                                                                redirect_ ? redirect_peers_ : "",
+                                                                ordered_index_,
+                                                                false,
+                                                                policy_,
+                                                                "");
+    nodes_[id - 1] = node;
+    threads_[id - 1] = std::thread([node]() {
+      node->schedule();
+    });
+  }
+
+  void stop(uint64_t id) {
+    if (!nodes_[id - 1]) {
+      return;
+    }
+    nodes_[id - 1]->stop();
+    threads_[id - 1].join();
+    nodes_[id - 1] = nullptr;
+  }
+
+  // wait_leader returns the id of the leader once every running member knows it
+  // and it accepts writes, 0 on timeout
+  uint64_t wait_leader() {
+    for (int i = 0; i < 100; ++i) {
+      uint64_t lead = 0;
+      for (size_t j = 0; j < nodes_.size(); ++j) {
+        if (!nodes_[j]) {
+          continue;
+        }
+        if (lead == 0) {
+          lead = nodes_[j]->lead();
+        }
+        if (nodes_[j]->lead() == 0 || nodes_[j]->lead() != lead) {
+          lead = 0;
+          break;
+        }
+      }
+      if (lead != 0 && nodes_[lead - 1]) {
+        Client client(ports_[lead - 1]);
+        if (client.connected() && client.cmd({"set", "__leader", std::to_string(lead)}) == "+OK") {
+          return lead;
+        }
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return 0;
+  }
+
+  RaftNode* node(uint64_t id) {
+    return nodes_[id - 1].get();
+  }
+
+  uint16_t port(uint64_t id) const {
+    return ports_[id - 1];
+  }
+
+  std::string address(uint64_t id) const {
+    return "127.0.0.1:" + std::to_string(ports_[id - 1]);
+  }
+
+  SnapshotPolicy& policy() {
+    return policy_;
+  }
+
+ private:
+  bool redirect_;
+  bool ordered_index_;
+  std::string cluster_;
+  std::string redirect_peers_;
+  std::vector<uint16_t> ports_;
+  SnapshotPolicy policy_;
+  std::vector<std::shared_ptr<RaftNode>> nodes_;
+  std::vector<std::thread> threads_;
+};
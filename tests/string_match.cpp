@@ -1,6 +1,6 @@
-#include <regex>
+#include <random>
 #include <gtest/gtest.h>
-#include <raft-kv/server/redis_store.h>
+#include <raft-kv/common/glob.h>
 using namespace kv;
 
 TEST(match, match) {
@@ -19,11 +19,59 @@ TEST(match, match) {
   tests.push_back(Test{.pattern = "*a", .key = "abc", .match = 0});
   tests.push_back(Test{.pattern = "*b*", .key = "abc", .match = 1});
   tests.push_back(Test{.pattern = "", .key = "abc", .match = 0});
+  tests.push_back(Test{.pattern = "a?c", .key = "abc", .match = 1});
+  tests.push_back(Test{.pattern = "[a-c]b[^a]", .key = "abc", .match = 1});
+  tests.push_back(Test{.pattern = "a\\*c", .key = "a*c", .match = 1});
+  tests.push_back(Test{.pattern = "a\\*c", .key = "abc", .match = 0});
+  tests.push_back(Test{.pattern = "*", .key = "", .match = 0});
+  tests.push_back(Test{.pattern = "", .key = "", .match = 1});
 
   for (Test& t :  tests) {
     int match = string_match_len(t.pattern.data(), t.pattern.size(), t.key.data(), t.key.size(), 0);
     ASSERT_TRUE(match == t.match);
 
+    GlobMatcher matcher(t.pattern);
+    ASSERT_TRUE(matcher.match(t.key) == (t.match == 1));
+  }
+}
+
+TEST(match, prefix) {
+  ASSERT_TRUE(GlobMatcher("user:1*").prefix() == "user:1");
+  ASSERT_TRUE(GlobMatcher("user:\\*?").prefix() == "user:*");
+  ASSERT_TRUE(GlobMatcher("*user").prefix() == "");
+  ASSERT_TRUE(GlobMatcher("ab[c]d").prefix() == "abcd");
+}
+
+// the compiled matcher agrees with string_match_len on random patterns and keys
+TEST(match, differential) {
+  static const char pattern_bytes[] = "ab-*?[]^\\";
+  static const char key_bytes[] = "ab-*?[]^\\";
+  std::mt19937 rng(42);
+
+  auto random_string = [&rng](const char* bytes, size_t n, size_t max_len) {
+    std::string str;
+    size_t len = rng() % (max_len + 1);
+    for (size_t i = 0; i < len; ++i) {
+      str.push_back(bytes[rng() % n]);
+    }
+    return str;
+  };
+
+  for (int i = 0; i < 200000; ++i) {
+    std::string pattern = random_string(pattern_bytes, sizeof(pattern_bytes) - 1, 8);
+    std::string key = random_string(key_bytes, sizeof(key_bytes) - 1, 10);
+    int nocase = i % 2;
+    if (nocase) {
+      for (char& c : key) {
+        if (rng() % 2) {
+          c = static_cast<char>(toupper(c));
+        }
+      }
+    }
+
+    int expected = string_match_len(pattern.c_str(), pattern.size(), key.c_str(), key.size(), nocase);
+    GlobMatcher matcher(pattern, nocase != 0);
+    ASSERT_EQ(expected == 1, matcher.match(key)) << "pattern " << pattern << " key " << key;
   }
 }
 
@@ -0,0 +1,343 @@
+#include <gtest/gtest.h>
+#include <set>
+#include <stdio.h>
+#include <unistd.h>
+#include <raft-kv/common/dict.h>
+
+using namespace kv;
+
+TEST(test_dict, test_dict) {
+  Dict dict;
+  ASSERT_TRUE(dict.empty());
+  ASSERT_TRUE(dict.find("a") == nullptr);
+  ASSERT_FALSE(dict.erase("a"));
+
+  auto ret = dict.emplace("a", "1");
+  ASSERT_TRUE(ret.second);
+  ASSERT_TRUE(*ret.first == "1");
+
+  ret = dict.emplace("a", "2");
+  ASSERT_FALSE(ret.second);
+  ASSERT_TRUE(*ret.first == "1");
+
+  dict["b"] = "2";
+  dict["a"].append("1");
+  ASSERT_TRUE(dict.size() == 2);
+  ASSERT_TRUE(*dict.find("a") == "11");
+  ASSERT_TRUE(*dict.find("b") == "2");
+
+  ASSERT_TRUE(dict.erase("a"));
+  ASSERT_TRUE(dict.find("a") == nullptr);
+  ASSERT_TRUE(dict.size() == 1);
+
+  for (int i = 0; i < 1000; ++i) {
+    dict[std::to_string(i)] = std::to_string(i * 2);
+  }
+  ASSERT_TRUE(dict.size() == 1001);
+  ASSERT_TRUE(dict.bucket_count() >= dict.size());
+  ASSERT_TRUE((dict.bucket_count() & (dict.bucket_count() - 1)) == 0);
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_TRUE(*dict.find(std::to_string(i)) == std::to_string(i * 2));
+  }
+
+  size_t count = 0;
+  dict.for_each([&count](const std::string& key, const std::string& value) {
+    count++;
+  });
+  ASSERT_TRUE(count == 1001);
+
+  Dict other;
+  other.swap(dict);
+  ASSERT_TRUE(dict.empty());
+  ASSERT_TRUE(other.size() == 1001);
+  other.clear();
+  ASSERT_TRUE(other.empty());
+  ASSERT_TRUE(other.find("b") == nullptr);
+}
+
+TEST(test_dict, test_scan) {
+  Dict dict;
+  ASSERT_TRUE(dict.scan(0, 10, [](const std::string& key, const std::string& value) {}) == 0);
+
+  for (int i = 0; i < 1000; ++i) {
+    dict[std::to_string(i)] = "";
+  }
+
+  // a full iteration without modifications visits every key exactly once
+  std::multiset<std::string> keys;
+  uint64_t cursor = 0;
+  do {
+    cursor = dict.scan(cursor, 10, [&keys](const std::string& key, const std::string& value) {
+      keys.insert(key);
+    });
+  } while (cursor != 0);
+  ASSERT_TRUE(keys.size() == 1000);
+  ASSERT_TRUE(std::set<std::string>(keys.begin(), keys.end()).size() == 1000);
+}
+
+TEST(test_dict, test_scan_resize) {
+  Dict dict;
+  for (int i = 0; i < 100; ++i) {
+    dict[std::to_string(i)] = "";
+  }
+
+  // keys present during the whole iteration are visited although the table grows
+  std::set<std::string> keys;
+  uint64_t cursor = 0;
+  int next = 100;
+  do {
+    cursor = dict.scan(cursor, 5, [&keys](const std::string& key, const std::string& value) {
+      keys.insert(key);
+    });
+    for (int i = 0; i < 50; ++i, ++next) {
+      dict[std::to_string(next)] = "";
+    }
+  } while (cursor != 0);
+
+  ASSERT_TRUE(dict.bucket_count() > 128);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(keys.count(std::to_string(i)) == 1);
+  }
+}
+
+TEST(test_dict, test_load) {
+  for (size_t parts : {1, 3, 4, 64}) {
+    Dict dict;
+    dict.reserve(10000);
+    std::vector<Dict::Batch> batches(10);
+    for (Dict::Batch& batch : batches) {
+      dict.prepare_batch(batch, parts);
+    }
+    for (int i = 0; i < 10000; ++i) {
+      batches[i % batches.size()].add(std::to_string(i), std::to_string(i * 2));
+    }
+    dict.load(batches);
+
+    ASSERT_TRUE(dict.size() == 10000);
+    for (int i = 0; i < 10000; ++i) {
+      ASSERT_TRUE(*dict.find(std::to_string(i)) == std::to_string(i * 2));
+    }
+    size_t count = 0;
+    dict.for_each([&count](const std::string& key, const std::string& value) {
+      count++;
+    });
+    ASSERT_TRUE(count == 10000);
+
+    dict["a"] = "b";
+    ASSERT_TRUE(dict.erase("0"));
+    ASSERT_TRUE(dict.size() == 10000);
+  }
+}
+
+TEST(test_dict, test_release) {
+  Dict dict;
+  for (int i = 0; i < 10000; ++i) {
+    dict[std::to_string(i)] = std::to_string(i);
+  }
+
+  uint64_t cursor = dict.release(0, 1000);
+  ASSERT_TRUE(cursor != 0);
+  ASSERT_TRUE(dict.size() <= 9000);
+  size_t count = 0;
+  dict.for_each([&count](const std::string& key, const std::string& value) {
+    count++;
+  });
+  ASSERT_TRUE(count == dict.size());
+
+  size_t calls = 1;
+  while (cursor != 0) {
+    cursor = dict.release(cursor, 1000);
+    calls++;
+  }
+  ASSERT_TRUE(calls > 5);
+  ASSERT_TRUE(dict.empty());
+  ASSERT_TRUE(dict.bucket_count() == 0);
+
+  ASSERT_TRUE(dict.release(0, 1000) == 0);
+  dict["a"] = "b";
+  ASSERT_TRUE(*dict.find("a") == "b");
+}
+
+TEST(test_dict, test_image) {
+  std::string path = "_test_dict_image_" + std::to_string(getpid());
+  {
+    Dict dict;
+    for (int i = 0; i < 1000; ++i) {
+      dict[std::to_string(i)] = std::to_string(i * 2);
+    }
+    ASSERT_TRUE(dict.save_image(path).is_ok());
+  }
+
+  Dict dict;
+  ASSERT_TRUE(dict.load_image(path).is_ok());
+  ASSERT_TRUE(dict.size() == 1000);
+  ASSERT_TRUE(dict.image_size() == 1000);
+  ASSERT_TRUE(*dict.find("10") == "20");
+  ASSERT_TRUE(dict.find("a") == nullptr);
+  ASSERT_TRUE(dict.image_size() == 999);
+
+  // modifications copy the entries to the heap
+  dict["11"] = "x";
+  dict["a"] = "b";
+  ASSERT_TRUE(dict.erase("12"));
+  ASSERT_FALSE(dict.erase("12"));
+  ASSERT_TRUE(dict.size() == 1000);
+  ASSERT_TRUE(dict.image_size() == 997);
+  ASSERT_TRUE(*dict.find("11") == "x");
+  ASSERT_TRUE(dict.find("12") == nullptr);
+
+  // the table grows beyond the buckets of the image
+  for (int i = 0; i < 2000; ++i) {
+    dict["n" + std::to_string(i)] = "";
+  }
+
+  std::multiset<std::string> keys;
+  uint64_t cursor = 0;
+  do {
+    cursor = dict.scan(cursor, 10, [&keys](const std::string& key, const std::string& value) {
+      keys.insert(key);
+    });
+  } while (cursor != 0);
+  ASSERT_TRUE(keys.size() == 3000);
+  ASSERT_TRUE(std::set<std::string>(keys.begin(), keys.end()).size() == 3000);
+
+  size_t count = 0;
+  dict.for_each([&count](const std::string& key, const std::string& value) {
+    count++;
+  });
+  ASSERT_TRUE(count == 3000);
+
+  // an image of a table backed by an image holds the entries of both
+  std::string copy_path = path + "_copy";
+  ASSERT_TRUE(dict.save_image(copy_path).is_ok());
+  Dict copy;
+  ASSERT_TRUE(copy.load_image(copy_path).is_ok());
+  ASSERT_TRUE(copy.size() == 3000);
+  ASSERT_TRUE(*copy.find("11") == "x");
+  ASSERT_TRUE(*copy.find("999") == "1998");
+  ASSERT_TRUE(copy.find("12") == nullptr);
+
+  // so is a corrupted one
+  FILE* fp = fopen(copy_path.c_str(), "r+");
+  ASSERT_TRUE(fp != nullptr);
+  fseek(fp, 100, SEEK_SET);
+  int c = fgetc(fp);
+  fseek(fp, 100, SEEK_SET);
+  fputc(c ^ 0xff, fp);
+  fclose(fp);
+  Dict corrupted;
+  ASSERT_FALSE(corrupted.load_image(copy_path).is_ok());
+  ASSERT_TRUE(corrupted.empty());
+
+  // a truncated image is rejected
+  ASSERT_TRUE(truncate(copy_path.c_str(), 100) == 0);
+  Dict truncated;
+  ASSERT_FALSE(truncated.load_image(copy_path).is_ok());
+
+  unlink(path.c_str());
+  unlink(copy_path.c_str());
+}
+
+TEST(test_dict, test_incremental_rehash) {
+  Dict dict;
+  for (int i = 0; i < 1024; ++i) {
+    dict[std::to_string(i)] = std::to_string(i);
+  }
+  ASSERT_FALSE(dict.rehashing());
+  ASSERT_TRUE(dict.bucket_count() == 1024);
+
+  // the insertion that fills the table starts moving it, a bucket at a time
+  dict["1024"] = "1024";
+  ASSERT_TRUE(dict.rehashing());
+  ASSERT_TRUE(dict.bucket_count() == 2048);
+
+  int next = 1025;
+  bool erased = false;
+  while (dict.rehashing()) {
+    for (int i = 0; i < next; i += 7) {
+      const std::string* value = dict.find(std::to_string(i));
+      ASSERT_TRUE(value && *value == std::to_string(i)) << i;
+    }
+    if (!erased) {
+      ASSERT_TRUE(dict.erase("1"));
+      ASSERT_FALSE(dict.erase("1"));
+      ASSERT_TRUE(dict.find("1") == nullptr);
+      dict["1"] = "1";
+      erased = true;
+    }
+    dict[std::to_string(next)] = std::to_string(next);
+    ++next;
+  }
+
+  // the old table was emptied well before the new one fills up
+  ASSERT_TRUE(next < 2048);
+  ASSERT_TRUE(dict.size() == size_t(next));
+  for (int i = 0; i < next; ++i) {
+    ASSERT_TRUE(*dict.find(std::to_string(i)) == std::to_string(i));
+  }
+}
+
+TEST(test_dict, test_rehashing_table) {
+  std::string path = "_test_dict_rehash_" + std::to_string(getpid());
+  Dict dict;
+  for (int i = 0; i < 1025; ++i) {
+    dict[std::to_string(i)] = std::to_string(i);
+  }
+  ASSERT_TRUE(dict.rehashing());
+
+  // a scan started before the table grows sees every key once it grew
+  std::multiset<std::string> keys;
+  uint64_t cursor = dict.scan(0, 10, [&keys](const std::string& key, const std::string& value) {
+    keys.insert(key);
+  });
+  while (cursor != 0) {
+    cursor = dict.scan(cursor, 10, [&keys](const std::string& key, const std::string& value) {
+      keys.insert(key);
+    });
+  }
+  ASSERT_TRUE(std::set<std::string>(keys.begin(), keys.end()).size() == 1025);
+  ASSERT_TRUE(keys.size() == 1025);
+
+  size_t count = 0;
+  dict.for_each([&count](const std::string& key, const std::string& value) {
+    count++;
+  });
+  ASSERT_TRUE(count == 1025);
+
+  // the image of a table in the middle of growing holds both tables
+  ASSERT_TRUE(dict.save_image(path).is_ok());
+  Dict image;
+  ASSERT_TRUE(image.load_image(path).is_ok());
+  ASSERT_TRUE(image.size() == 1025);
+  for (int i = 0; i < 1025; ++i) {
+    ASSERT_TRUE(*image.find(std::to_string(i)) == std::to_string(i));
+  }
+  unlink(path.c_str());
+
+  // reserve finishes growing first
+  Dict reserved;
+  reserved.swap(dict);
+  ASSERT_TRUE(reserved.rehashing());
+  reserved.reserve(4096);
+  ASSERT_FALSE(reserved.rehashing());
+  ASSERT_TRUE(reserved.bucket_count() == 4096);
+  ASSERT_TRUE(*reserved.find("1000") == "1000");
+
+  // release frees both tables
+  for (int i = 0; i < 4097; ++i) {
+    dict[std::to_string(i)] = "";
+  }
+  ASSERT_TRUE(dict.rehashing());
+  cursor = dict.release(0, 100);
+  while (cursor != 0) {
+    cursor = dict.release(cursor, 100);
+  }
+  ASSERT_TRUE(dict.empty());
+  ASSERT_FALSE(dict.rehashing());
+  ASSERT_TRUE(dict.bucket_count() == 0);
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,41 @@
+#include <gtest/gtest.h>
+#include <raft-kv/common/rate_limiter.h>
+
+using namespace kv;
+
+TEST(test_rate_limiter, test_unlimited) {
+  RateLimiter limiter(0);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(limiter.reserve(1 << 30) == 0);
+  }
+}
+
+TEST(test_rate_limiter, test_reserve) {
+  RateLimiter limiter(1000000);
+
+  // the bucket starts full
+  ASSERT_TRUE(limiter.reserve(1000000) == 0);
+
+  // the debt is repaid at the rate
+  uint64_t wait = limiter.reserve(500000);
+  ASSERT_TRUE(wait > 400000 && wait <= 500000);
+  wait = limiter.reserve(500000);
+  ASSERT_TRUE(wait > 900000 && wait <= 1000000);
+}
+
+TEST(test_rate_limiter, test_acquire) {
+  RateLimiter limiter(10 * 1024 * 1024);
+  limiter.acquire(10 * 1024 * 1024);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 10; ++i) {
+    limiter.acquire(100 * 1024);
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  ASSERT_TRUE(elapsed.count() >= 80);
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
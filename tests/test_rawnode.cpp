@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 #include <raft-kv/raft/node.h>
 #include <raft-kv/raft/util.h>
+#include <raft-kv/server/snapshot_policy.h>
 #include "network.hpp"
 
 using namespace kv;
@@ -498,6 +499,95 @@ TEST(test_rawnode, RawNodeBoundedLogGrowthWithPartition) {
   checkUncommitted(0);
 }
 
+TEST(test_rawnode, RawNodeStatus) {
+  MemoryStoragePtr s(new MemoryStorage());
+  auto c = newTestConfig(1, std::vector<uint64_t>{1, 2, 3}, 10, 1, s);
+  RawNode rawNode(c, std::vector<PeerContext>());
+
+  RaftStatusPtr status = rawNode.raft_status();
+  ASSERT_TRUE(status->id == 1);
+  ASSERT_TRUE(status->raft_state == RaftState::Follower);
+  ASSERT_TRUE(status->progress.empty());
+
+  rawNode.raft_->become_candidate();
+  rawNode.raft_->become_leader();
+  uint64_t last_index = rawNode.raft_->raft_log_->last_index();
+
+  proto::MessagePtr msg(new proto::Message());
+  msg->from = 2;
+  msg->to = 1;
+  msg->type = proto::MsgAppResp;
+  msg->term = rawNode.raft_->term_;
+  msg->index = last_index;
+  ASSERT_TRUE(rawNode.step(msg).is_ok());
+
+  status = rawNode.raft_status();
+  ASSERT_TRUE(status->lead == 1);
+  ASSERT_TRUE(status->raft_state == RaftState::Leader);
+  ASSERT_TRUE(status->progress.size() == 2);
+  ASSERT_TRUE(status->progress[2].match == last_index);
+  ASSERT_TRUE(status->progress[2].state == ProgressStateReplicate);
+  ASSERT_TRUE(status->progress[2].recent_active);
+  ASSERT_TRUE(status->progress[3].match == 0);
+  ASSERT_TRUE(status->progress[3].state == ProgressStateProbe);
+}
+
+TEST(test_rawnode, RawNodeRecentActive) {
+  MemoryStoragePtr s(new MemoryStorage());
+  auto c = newTestConfig(1, std::vector<uint64_t>{1, 2, 3}, 10, 1, s);
+  RawNode rawNode(c, std::vector<PeerContext>());
+  rawNode.raft_->become_candidate();
+  rawNode.raft_->become_leader();
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(rawNode.propose(std::vector<uint8_t>{'a'}).is_ok());
+  }
+  uint64_t last_index = rawNode.raft_->raft_log_->last_index();
+
+  auto append_resp = [&rawNode](uint64_t from, uint64_t index) {
+    proto::MessagePtr msg(new proto::Message());
+    msg->from = from;
+    msg->to = 1;
+    msg->type = proto::MsgAppResp;
+    msg->term = rawNode.raft_->term_;
+    msg->index = index;
+    ASSERT_TRUE(rawNode.step(msg).is_ok());
+  };
+  auto check_quorum = [&rawNode]() {
+    proto::MessagePtr msg(new proto::Message());
+    msg->from = 1;
+    msg->type = proto::MsgCheckQuorum;
+    ASSERT_TRUE(rawNode.raft_->step(msg).is_ok());
+  };
+
+  // 3 lags behind, the log is kept for it
+  append_resp(2, last_index);
+  append_resp(3, 1);
+  ASSERT_TRUE(SnapshotPolicy::slowest_match(*rawNode.raft_status()) == 1);
+
+  // every check of the quorum forgets the followers heard of before it
+  check_quorum();
+  ASSERT_TRUE(rawNode.raft_->state_ == RaftState::Leader);
+  RaftStatusPtr status = rawNode.raft_status();
+  ASSERT_FALSE(status->progress[2].recent_active);
+  ASSERT_FALSE(status->progress[3].recent_active);
+
+  // 3 goes silent, the log is no longer kept for it
+  append_resp(2, last_index);
+  status = rawNode.raft_status();
+  ASSERT_TRUE(status->progress[2].recent_active);
+  ASSERT_FALSE(status->progress[3].recent_active);
+  ASSERT_TRUE(status->progress[3].match == 1);
+  ASSERT_TRUE(SnapshotPolicy::slowest_match(*status) == last_index);
+
+  // 2 is still a quorum with the leader
+  check_quorum();
+  ASSERT_TRUE(rawNode.raft_->state_ == RaftState::Leader);
+
+  // with neither the leader steps down
+  check_quorum();
+  ASSERT_TRUE(rawNode.raft_->state_ == RaftState::Follower);
+}
+
 int main(int argc, char* argv[]) {
   //testing::GTEST_FLAG(filter) = "raft.OldMessages";
   testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,429 @@
+#include <gtest/gtest.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "cluster.hpp"
+
+using namespace kv;
+
+TEST(session, ClientToken) {
+  TestDir dir("token");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  Client client(cluster.port(1));
+  ASSERT_EQ(client.cmd({"set", "a", "1"}), "+OK");
+
+  ASSERT_EQ(client.cmd({"client", "token", "on"}), "+OK");
+  uint64_t set_index = token_index(client.cmd({"set", "a", "2"}));
+  ASSERT_GT(set_index, 0);
+  uint64_t del_index = token_index(client.cmd({"del", "a"}));
+  ASSERT_GT(del_index, set_index);
+  // only SET and DEL answer with a token
+  ASSERT_EQ(client.cmd({"incr", "b"}), ":1");
+
+  ASSERT_EQ(client.cmd({"client", "token", "off"}), "+OK");
+  ASSERT_EQ(client.cmd({"set", "a", "3"}), "+OK");
+
+  ASSERT_EQ(client.cmd({"client", "token", "maybe"}), "-ERR syntax error");
+  ASSERT_EQ(client.cmd({"client", "minindex", "x1"}), "-ERR syntax error");
+  ASSERT_EQ(client.cmd({"client", "foo", "bar"}), "-ERR unknown subcommand");
+  ASSERT_EQ(client.cmd({"client", "token"}), "-ERR wrong number of arguments for 'client' command");
+}
+
+TEST(session, ClientMinIndexWaits) {
+  TestDir dir("minindex");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  Client writer(cluster.port(1));
+  Client reader(cluster.port(1));
+  ASSERT_EQ(writer.cmd({"client", "token", "on"}), "+OK");
+  uint64_t index = token_index(writer.cmd({"set", "a", "1"}));
+  ASSERT_GT(index, 0);
+
+  // the read waits for the next write, made while it is waiting
+  ASSERT_EQ(reader.cmd({"client", "minindex", std::to_string(index + 1)}), "+OK");
+  std::thread write([&writer]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    writer.cmd({"set", "a", "2"});
+  });
+  ASSERT_EQ(reader.cmd({"get", "a"}), "2");
+  write.join();
+
+  // a token already applied does not hold the read
+  Client other(cluster.port(1));
+  ASSERT_EQ(other.cmd({"client", "minindex", std::to_string(index)}), "+OK");
+  ASSERT_EQ(other.cmd({"get", "a"}), "2");
+}
+
+TEST(session, ClientMinIndexTimeout) {
+  TestDir dir("minindex_timeout");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  Client client(cluster.port(1));
+  ASSERT_EQ(client.cmd({"client", "token", "on"}), "+OK");
+  uint64_t index = token_index(client.cmd({"set", "a", "1"}));
+  ASSERT_GT(index, 0);
+
+  ASSERT_EQ(client.cmd({"client", "minindex", std::to_string(index + 1000)}), "+OK");
+  std::string reply = client.cmd({"get", "a"});
+  ASSERT_EQ(reply.compare(0, 24, "-TRYAGAIN applied index "), 0) << reply;
+  ASSERT_NE(reply.find(" is behind " + std::to_string(index + 1000)), std::string::npos) << reply;
+
+  // the token does not hold the writes of the session
+  ASSERT_EQ(client.cmd({"client", "token", "off"}), "+OK");
+  ASSERT_EQ(client.cmd({"set", "a", "2"}), "+OK");
+}
+
+TEST(session, ReadYourWritesWhileApplyStalls) {
+  TestDir dir("read_your_writes");
+  Cluster cluster(1, false, true);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  // applying a large MSET holds back the writes committed after it for longer
+  // than a MININDEX wait, the reads after them wait however long it takes
+  std::atomic<bool> done(false);
+  std::thread stall([&cluster, &done]() {
+    Client client(cluster.port(1));
+    for (int round = 0; round < 3; ++round) {
+      std::vector<std::string> mset = {"mset"};
+      for (int i = 0; i < 300000; ++i) {
+        mset.push_back("stall:" + std::to_string(round) + ":" + std::to_string(i));
+        mset.push_back("");
+      }
+      client.cmd(mset);
+    }
+    done = true;
+  });
+
+  Client client(cluster.port(1));
+  std::string failed;
+  for (int i = 0; failed.empty() && (!done || i < 100); ++i) {
+    std::string value = std::to_string(i);
+    std::string reply = client.cmd({"set", "a", value});
+    if (reply == "+OK") {
+      reply = client.cmd({"get", "a"});
+    }
+    if (reply != "+OK" && reply != value) {
+      failed = value + ": " + reply;
+    }
+  }
+  stall.join();
+  ASSERT_TRUE(failed.empty()) << failed;
+}
+
+TEST(session, PipelinedRepliesInOrder) {
+  TestDir dir("pipeline");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  // blind writes are answered at commit and the others once applied, the
+  // replies still come in the order of the commands, and a read sees the
+  // writes sent before it
+  Client client(cluster.port(1));
+  const int n = 1000;
+  for (int i = 1; i <= n; ++i) {
+    client.append({"incr", "counter"});
+    client.append({"set", "key", std::to_string(i)});
+    client.append({"get", "key"});
+    client.append({"get", "counter"});
+  }
+  for (int i = 1; i <= n; ++i) {
+    ASSERT_EQ(client.get_reply(), ":" + std::to_string(i));
+    ASSERT_EQ(client.get_reply(), "+OK");
+    int key = std::stoi(client.get_reply());
+    ASSERT_GE(key, i);
+    ASSERT_LE(key, n);
+    int counter = std::stoi(client.get_reply());
+    ASSERT_GE(counter, i);
+    ASSERT_LE(counter, n);
+  }
+  ASSERT_EQ(client.cmd({"get", "key"}), std::to_string(n));
+}
+
+TEST(session, ConcurrentClients) {
+  TestDir dir("concurrent");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  const int clients = 4;
+  const int n = 500;
+  std::vector<std::thread> threads;
+  std::vector<int> ordered(clients, 0);
+  for (int c = 0; c < clients; ++c) {
+    threads.emplace_back([&cluster, &ordered, c, n]() {
+      Client client(cluster.port(1));
+      std::string key = "key" + std::to_string(c);
+      for (int i = 1; i <= n; ++i) {
+        client.append({"incr", "counter"});
+        client.append({"append", key, "x"});
+      }
+      int64_t last = 0;
+      bool ok = true;
+      for (int i = 1; i <= n; ++i) {
+        int64_t counter = std::stoll(client.get_reply().substr(1));
+        ok = ok && counter > last;
+        last = counter;
+        ok = ok && client.get_reply() == ":" + std::to_string(i);
+      }
+      ordered[c] = ok;
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  for (int c = 0; c < clients; ++c) {
+    ASSERT_TRUE(ordered[c]) << "client " << c;
+  }
+  Client client(cluster.port(1));
+  ASSERT_EQ(client.cmd({"get", "counter"}), std::to_string(clients * n));
+  ASSERT_EQ(client.cmd({"get", "key0"}), std::string(n, 'x'));
+}
+
+TEST(session, FollowerRedirectsWrites) {
+  TestDir dir("redirect");
+  Cluster cluster(3, true);
+  cluster.start_all();
+  uint64_t lead = cluster.wait_leader();
+  ASSERT_NE(lead, 0);
+  uint64_t follower = lead % 3 + 1;
+
+  Client leader(cluster.port(lead));
+  ASSERT_EQ(leader.cmd({"client", "token", "on"}), "+OK");
+  uint64_t index = token_index(leader.cmd({"set", "a", "1"}));
+  ASSERT_GT(index, 0);
+
+  Client client(cluster.port(follower));
+  std::string moved = "-MOVED " + std::to_string(lead) + " " + cluster.address(lead);
+  ASSERT_EQ(client.cmd({"set", "a", "2"}), moved);
+  ASSERT_EQ(client.cmd({"incr", "b"}), moved);
+  ASSERT_EQ(client.cmd({"mset", "a", "2", "b", "3"}), moved);
+
+  // inside MULTI the writes are queued and EXEC is redirected
+  ASSERT_EQ(client.cmd({"multi"}), "+OK");
+  ASSERT_EQ(client.cmd({"set", "a", "2"}), "+QUEUED");
+  ASSERT_EQ(client.cmd({"exec"}), moved);
+
+  // reads are served by the follower
+  ASSERT_EQ(client.cmd({"client", "minindex", std::to_string(index)}), "+OK");
+  ASSERT_EQ(client.cmd({"get", "a"}), "1");
+  ASSERT_EQ(client.cmd({"mget", "a", "b"}), "[1,nil]");
+}
+
+TEST(session, FollowerForwardsWithoutRedirect) {
+  TestDir dir("forward");
+  Cluster cluster(3);
+  cluster.start_all();
+  ASSERT_NE(cluster.wait_leader(), 0);
+
+  // without redirection every member takes writes
+  for (uint64_t id = 1; id <= 3; ++id) {
+    Client client(cluster.port(id));
+    ASSERT_EQ(client.cmd({"set", "a", std::to_string(id)}), "+OK");
+    ASSERT_EQ(client.cmd({"get", "a"}), std::to_string(id));
+  }
+}
+
+TEST(session, MultiKeyCommands) {
+  TestDir dir("multikey");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  Client client(cluster.port(1));
+  ASSERT_EQ(client.cmd({"mset", "a", "1", "b", "2"}), "+OK");
+  ASSERT_EQ(client.cmd({"mget", "a", "b", "c"}), "[1,2,nil]");
+  ASSERT_EQ(client.cmd({"mget", "c"}), "[nil]");
+
+  // MSETNX sets none of the keys if any of them exists
+  ASSERT_EQ(client.cmd({"msetnx", "a", "3", "d", "4"}), ":0");
+  ASSERT_EQ(client.cmd({"mget", "a", "d"}), "[1,nil]");
+  ASSERT_EQ(client.cmd({"msetnx", "d", "4", "e", "5"}), ":1");
+  ASSERT_EQ(client.cmd({"mget", "d", "e", "a"}), "[4,5,1]");
+
+  // a key repeated in MSET takes its last value
+  ASSERT_EQ(client.cmd({"mset", "f", "1", "f", "2"}), "+OK");
+  ASSERT_EQ(client.cmd({"mget", "f", "f"}), "[2,2]");
+
+  ASSERT_EQ(client.cmd({"mget"}), "-ERR wrong number of arguments for 'mget' command");
+  ASSERT_EQ(client.cmd({"mset", "a"}), "-ERR wrong number of arguments for 'mset' command");
+  ASSERT_EQ(client.cmd({"mset", "a", "1", "b"}), "-ERR wrong number of arguments for 'mset' command");
+  ASSERT_EQ(client.cmd({"msetnx", "a"}), "-ERR wrong number of arguments for 'msetnx' command");
+}
+
+TEST(session, MgetManyKeys) {
+  TestDir dir("mget");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  // more keys than the prefetch distance, every other one missing
+  Client client(cluster.port(1));
+  std::vector<std::string> mset = {"mset"};
+  std::vector<std::string> mget = {"mget"};
+  std::string expected = "[";
+  for (int i = 0; i < 100; ++i) {
+    if (i % 2 == 0) {
+      mset.push_back("key" + std::to_string(i));
+      mset.push_back(std::to_string(i));
+    }
+    mget.push_back("key" + std::to_string(i));
+    expected += (i > 0 ? "," : "") + (i % 2 == 0 ? std::to_string(i) : "nil");
+  }
+  ASSERT_EQ(client.cmd(mset), "+OK");
+  ASSERT_EQ(client.cmd(mget), expected + "]");
+}
+
+TEST(session, IntegerCommands) {
+  TestDir dir("integer");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  std::string not_integer = "-ERR value is not an integer or out of range";
+  Client client(cluster.port(1));
+  ASSERT_EQ(client.cmd({"incr", "a"}), ":1");
+  ASSERT_EQ(client.cmd({"incrby", "a", "10"}), ":11");
+  ASSERT_EQ(client.cmd({"decr", "a"}), ":10");
+  ASSERT_EQ(client.cmd({"decrby", "a", "-5"}), ":15");
+  ASSERT_EQ(client.cmd({"incrby", "a", "-20"}), ":-5");
+  ASSERT_EQ(client.cmd({"get", "a"}), "-5");
+
+  // the increments are parsed as redis does
+  ASSERT_EQ(client.cmd({"incrby", "a", "+1"}), not_integer);
+  ASSERT_EQ(client.cmd({"incrby", "a", "01"}), not_integer);
+  ASSERT_EQ(client.cmd({"incrby", "a", "-0"}), not_integer);
+  ASSERT_EQ(client.cmd({"incrby", "a", "1.5"}), not_integer);
+  ASSERT_EQ(client.cmd({"incrby", "a", " 1"}), not_integer);
+  ASSERT_EQ(client.cmd({"decrby", "a", "-9223372036854775808"}), not_integer);
+  ASSERT_EQ(client.cmd({"get", "a"}), "-5");
+
+  // and so are the values
+  for (const char* value : {"abc", "+1", "007", "-0", "1 ", "", "9223372036854775808"}) {
+    ASSERT_EQ(client.cmd({"set", "b", value}), "+OK");
+    std::string reply = client.cmd({"incr", "b"});
+    ASSERT_EQ(reply.compare(0, 5, "-ERR "), 0) << value << " " << reply;
+    ASSERT_EQ(client.cmd({"get", "b"}), value);
+  }
+
+  ASSERT_EQ(client.cmd({"set", "c", "9223372036854775806"}), "+OK");
+  ASSERT_EQ(client.cmd({"incr", "c"}), ":9223372036854775807");
+  ASSERT_EQ(client.cmd({"incr", "c"}), "-ERR invalid argument:increment or decrement would overflow");
+  ASSERT_EQ(client.cmd({"set", "c", "-9223372036854775807"}), "+OK");
+  ASSERT_EQ(client.cmd({"decr", "c"}), ":-9223372036854775808");
+  ASSERT_EQ(client.cmd({"decr", "c"}), "-ERR invalid argument:increment or decrement would overflow");
+  ASSERT_EQ(client.cmd({"get", "c"}), "-9223372036854775808");
+
+  ASSERT_EQ(client.cmd({"incr"}), "-ERR wrong number of arguments for 'incr' command");
+  ASSERT_EQ(client.cmd({"incrby", "a"}), "-ERR wrong number of arguments for 'incrby' command");
+}
+
+TEST(session, StringCommands) {
+  TestDir dir("string");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  Client client(cluster.port(1));
+  ASSERT_EQ(client.cmd({"append", "a", "hello"}), ":5");
+  ASSERT_EQ(client.cmd({"append", "a", " world"}), ":11");
+  ASSERT_EQ(client.cmd({"get", "a"}), "hello world");
+
+  ASSERT_EQ(client.cmd({"getset", "b", "1"}), "nil");
+  ASSERT_EQ(client.cmd({"getset", "b", "2"}), "1");
+  ASSERT_EQ(client.cmd({"get", "b"}), "2");
+
+  ASSERT_EQ(client.cmd({"setnx", "c", "1"}), ":1");
+  ASSERT_EQ(client.cmd({"setnx", "c", "2"}), ":0");
+  ASSERT_EQ(client.cmd({"get", "c"}), "1");
+
+  ASSERT_EQ(client.cmd({"cas", "c", "2", "3"}), ":0");
+  ASSERT_EQ(client.cmd({"get", "c"}), "1");
+  ASSERT_EQ(client.cmd({"cas", "c", "1", "3"}), ":1");
+  ASSERT_EQ(client.cmd({"get", "c"}), "3");
+  ASSERT_EQ(client.cmd({"cas", "d", "", "1"}), ":0");
+  ASSERT_EQ(client.cmd({"get", "d"}), "nil");
+
+  ASSERT_EQ(client.cmd({"cas", "c", "3"}), "-ERR wrong number of arguments for 'cas' command");
+  ASSERT_EQ(client.cmd({"getset", "b"}), "-ERR wrong number of arguments for 'getset' command");
+}
+
+TEST(session, MultiExec) {
+  TestDir dir("multi");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  Client client(cluster.port(1));
+  ASSERT_EQ(client.cmd({"set", "a", "1"}), "+OK");
+  ASSERT_EQ(client.cmd({"exec"}), "-ERR EXEC without MULTI");
+  ASSERT_EQ(client.cmd({"discard"}), "-ERR DISCARD without MULTI");
+
+  ASSERT_EQ(client.cmd({"multi"}), "+OK");
+  ASSERT_EQ(client.cmd({"multi"}), "-ERR MULTI calls can not be nested");
+  ASSERT_EQ(client.cmd({"get", "a"}), "+QUEUED");
+  ASSERT_EQ(client.cmd({"incr", "a"}), "+QUEUED");
+  ASSERT_EQ(client.cmd({"set", "b", "x"}), "+QUEUED");
+  ASSERT_EQ(client.cmd({"incr", "b"}), "+QUEUED");
+  ASSERT_EQ(client.cmd({"getset", "b", "y"}), "+QUEUED");
+  ASSERT_EQ(client.cmd({"get", "c"}), "+QUEUED");
+  // a command failing at EXEC does not stop the others
+  ASSERT_EQ(client.cmd({"exec"}),
+            "[1,:2,+OK,-ERR invalid argument:value is not an integer or out of range,x,nil]");
+  ASSERT_EQ(client.cmd({"mget", "a", "b"}), "[2,y]");
+
+  ASSERT_EQ(client.cmd({"multi"}), "+OK");
+  ASSERT_EQ(client.cmd({"exec"}), "[]");
+
+  ASSERT_EQ(client.cmd({"multi"}), "+OK");
+  ASSERT_EQ(client.cmd({"set", "a", "3"}), "+QUEUED");
+  ASSERT_EQ(client.cmd({"discard"}), "+OK");
+  ASSERT_EQ(client.cmd({"get", "a"}), "2");
+}
+
+TEST(session, MultiAbort) {
+  TestDir dir("multi_abort");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  std::string exec_abort = "-EXECABORT Transaction discarded because of previous errors.";
+  struct {
+    std::vector<std::string> command;
+    std::string reply;
+  } tests[] = {
+      {{"set", "a"}, "-ERR wrong number of arguments for 'set' command"},
+      {{"get"}, "-ERR wrong number of arguments for 'get' command"},
+      {{"del"}, "-ERR wrong number of arguments for 'del' command"},
+      {{"mset", "a", "1", "b"}, "-ERR wrong number of arguments for 'mset' command"},
+      {{"incrby", "a", "x"}, "-ERR value is not an integer or out of range"},
+      {{"decrby", "a", "+1"}, "-ERR value is not an integer or out of range"},
+      {{"nosuchcommand"}, "-ERR unknown command `nosuchcommand`"},
+      {{"keys", "*"}, "-ERR command not allowed in a transaction"},
+  };
+
+  Client client(cluster.port(1));
+  for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+    ASSERT_EQ(client.cmd({"multi"}), "+OK");
+    ASSERT_EQ(client.cmd({"set", "a", "1"}), "+QUEUED");
+    ASSERT_EQ(client.cmd(tests[i].command), tests[i].reply) << "#" << i;
+    ASSERT_EQ(client.cmd({"set", "b", "1"}), "+QUEUED");
+    ASSERT_EQ(client.cmd({"exec"}), exec_abort) << "#" << i;
+    ASSERT_EQ(client.cmd({"mget", "a", "b"}), "[nil,nil]") << "#" << i;
+  }
+
+  // the error does not outlive the transaction
+  ASSERT_EQ(client.cmd({"multi"}), "+OK");
+  ASSERT_EQ(client.cmd({"set", "a", "1"}), "+QUEUED");
+  ASSERT_EQ(client.cmd({"exec"}), "[+OK]");
+  ASSERT_EQ(client.cmd({"get", "a"}), "1");
+}
@@ -0,0 +1,610 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <msgpack.hpp>
+#include <raft-kv/server/redis_store.h>
+#include <raft-kv/snap/snapshot_file.h>
+#include "cluster.hpp"
+
+using namespace kv;
+
+TEST(store, StringToInt64) {
+  struct {
+    std::string str;
+    bool ok;
+    int64_t value;
+  } tests[] = {
+      {"0", true, 0},
+      {"1", true, 1},
+      {"-1", true, -1},
+      {"1234567890", true, 1234567890},
+      {"9223372036854775807", true, INT64_MAX},
+      {"-9223372036854775808", true, INT64_MIN},
+      {"9223372036854775808", false, 0},
+      {"-9223372036854775809", false, 0},
+      {"18446744073709551616", false, 0},
+      {"99999999999999999999", false, 0},
+      {"123456789012345678901", false, 0},
+      {"", false, 0},
+      {"-", false, 0},
+      {"+1", false, 0},
+      {"-0", false, 0},
+      {"00", false, 0},
+      {"01", false, 0},
+      {"-01", false, 0},
+      {" 1", false, 0},
+      {"1 ", false, 0},
+      {"1a", false, 0},
+      {"0x10", false, 0},
+      {"1.5", false, 0},
+      {std::string("1\0", 2), false, 0},
+  };
+
+  for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+    int64_t value = 0;
+    ASSERT_EQ(string_to_int64(tests[i].str, value), tests[i].ok) << "#" << i << " " << tests[i].str;
+    if (tests[i].ok) {
+      ASSERT_EQ(value, tests[i].value) << "#" << i;
+    }
+  }
+}
+
+// the fields of the commits written before batch was added
+struct RaftCommitNoBatch {
+  uint32_t node_id;
+  uint32_t commit_id;
+  RedisCommitData redis_data;
+  MSGPACK_DEFINE (node_id, commit_id, redis_data);
+};
+
+TEST(store, DecodeCommitWithoutBatch) {
+  RaftCommitNoBatch old;
+  old.node_id = 1;
+  old.commit_id = 2;
+  old.redis_data.type = RedisCommitData::kCommitSet;
+  old.redis_data.strs = {"key", "value"};
+
+  msgpack::sbuffer sbuf;
+  msgpack::pack(sbuf, old);
+  msgpack::object_handle oh = msgpack::unpack(sbuf.data(), sbuf.size());
+  RaftCommit commit;
+  oh.get().convert(commit);
+
+  ASSERT_EQ(commit.node_id, 1);
+  ASSERT_EQ(commit.commit_id, 2);
+  ASSERT_EQ(static_cast<int>(commit.redis_data.type), static_cast<int>(RedisCommitData::kCommitSet));
+  ASSERT_EQ(commit.redis_data.strs, std::vector<std::string>({"key", "value"}));
+  ASSERT_TRUE(commit.batch.empty());
+}
+
+// scan_all returns the keys of a full SCAN with pattern, in the order returned
+static std::string scan_all(Client& client, const std::string& pattern, size_t count, size_t& calls) {
+  std::string keys;
+  std::string cursor = "0";
+  calls = 0;
+  do {
+    std::string reply = client.cmd({"scan", cursor, "match", pattern, "count", std::to_string(count)});
+    ++calls;
+    size_t comma = reply.find(',');
+    if (reply.empty() || reply[0] != '[' || comma == std::string::npos) {
+      return reply;
+    }
+    cursor = reply.substr(1, comma - 1);
+    std::string page = reply.substr(comma + 2, reply.size() - comma - 4);
+    if (!page.empty()) {
+      keys += (keys.empty() ? "" : ",") + page;
+    }
+  } while (cursor != "0" && calls < 1000);
+  return keys;
+}
+
+TEST(store, OrderedIndex) {
+  TestDir dir("ordered");
+  Cluster cluster(1, false, true);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  Client client(cluster.port(1));
+  ASSERT_EQ(client.cmd({"mset", "user:1", "a", "user:2", "b", "user:10", "c", "user:3", "d", "other", "e"}), "+OK");
+  ASSERT_EQ(client.cmd({"range", "user:1", "user:2"}), "[user:1,a,user:10,c]");
+  ASSERT_EQ(client.cmd({"range", "user:1", "", "count", "3"}), "[user:1,a,user:10,c,user:2,b]");
+  ASSERT_EQ(client.cmd({"range", "user:4", ""}), "[]");
+  ASSERT_EQ(client.cmd({"keys", "user:1*"}), "[user:1,user:10]");
+  ASSERT_EQ(client.cmd({"keys", "user:*"}), "[user:1,user:10,user:2,user:3]");
+
+  // the index follows the modifications of the key space
+  ASSERT_EQ(client.cmd({"del", "user:10", "nokey"}), "+OK");
+  ASSERT_EQ(client.cmd({"set", "user:1", "x"}), "+OK");
+  ASSERT_EQ(client.cmd({"setnx", "user:4", "y"}), ":1");
+  ASSERT_EQ(client.cmd({"incr", "user:0"}), ":1");
+  ASSERT_EQ(client.cmd({"range", "user:", ""}), "[user:0,1,user:1,x,user:2,b,user:3,d,user:4,y]");
+  ASSERT_EQ(client.cmd({"keys", "user:*"}), "[user:0,user:1,user:2,user:3,user:4]");
+
+  ASSERT_EQ(client.cmd({"range", "a"}), "-ERR wrong number of arguments for 'range' command");
+  ASSERT_EQ(client.cmd({"range", "a", "b", "count", "-1"}), "-ERR value is not an integer or out of range");
+}
+
+TEST(store, RangeWithoutOrderedIndex) {
+  TestDir dir("unordered");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  Client client(cluster.port(1));
+  ASSERT_EQ(client.cmd({"range", "a", "b"}), "-ERR ordered index is disabled");
+  ASSERT_EQ(client.cmd({"set", "user:1", "a"}), "+OK");
+  ASSERT_EQ(client.cmd({"keys", "user:*"}), "[user:1]");
+}
+
+TEST(store, PrefixScan) {
+  TestDir dir("prefix_scan");
+  Cluster cluster(1, false, true);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  Client client(cluster.port(1));
+  std::vector<std::string> mset = {"mset", "a", "", "z", ""};
+  std::string expected;
+  for (int i = 10; i < 60; ++i) {
+    mset.push_back("user:" + std::to_string(i));
+    mset.push_back("");
+    expected += (expected.empty() ? "" : ",") + ("user:" + std::to_string(i));
+  }
+  ASSERT_EQ(client.cmd(mset), "+OK");
+
+  // COUNT keys of the prefix are visited per call, in order and each once
+  size_t calls;
+  ASSERT_EQ(scan_all(client, "user:*", 7, calls), expected);
+  ASSERT_EQ(calls, 8);
+  ASSERT_EQ(scan_all(client, "user:*", 50, calls), expected);
+  ASSERT_EQ(calls, 1);
+  ASSERT_EQ(scan_all(client, "user:2*", 3, calls), "user:20,user:21,user:22,user:23,user:24,user:25,user:26,user:27,user:28,user:29");
+  ASSERT_EQ(scan_all(client, "user:*5", 10, calls), "user:15,user:25,user:35,user:45,user:55");
+  ASSERT_EQ(calls, 5);
+  ASSERT_EQ(scan_all(client, "nouser:*", 10, calls), "");
+
+  // the scan resumes after the last key visited, the keys modified behind it are
+  // not seen and those ahead of it are
+  std::string reply = client.cmd({"scan", "0", "match", "user:*", "count", "5"});
+  ASSERT_EQ(reply.substr(reply.find(',')), ",[user:10,user:11,user:12,user:13,user:14]]");
+  std::string cursor = reply.substr(1, reply.find(',') - 1);
+  ASSERT_EQ(client.cmd({"del", "user:14", "user:15"}), "+OK");
+  ASSERT_EQ(client.cmd({"mset", "user:0", "", "user:145", ""}), "+OK");
+  reply = client.cmd({"scan", cursor, "match", "user:*", "count", "3"});
+  ASSERT_EQ(reply.substr(reply.find(',')), ",[user:145,user:16,user:17]]");
+
+  // a cursor the member does not know is refused rather than starting over
+  ASSERT_EQ(client.cmd({"scan", "123456", "match", "user:*", "count", "2"}), "-ERR invalid cursor");
+  reply = client.cmd({"scan", "0", "match", "user:*", "count", "2"});
+  ASSERT_EQ(reply.substr(reply.find(',')), ",[user:0,user:10]]");
+  cursor = reply.substr(1, reply.find(',') - 1);
+  ASSERT_EQ(client.cmd({"scan", cursor, "match", "other:*", "count", "2"}), "-ERR invalid cursor");
+
+  // so is a cursor forgotten for newer ones
+  for (int i = 0; i < 1024; ++i) {
+    reply = client.cmd({"scan", "0", "match", "user:*", "count", "1"});
+    ASSERT_NE(reply.substr(1, reply.find(',') - 1), "0");
+  }
+  ASSERT_EQ(client.cmd({"scan", cursor, "match", "user:*", "count", "2"}), "-ERR invalid cursor");
+  cursor = reply.substr(1, reply.find(',') - 1);
+  reply = client.cmd({"scan", cursor, "match", "user:*", "count", "1"});
+  ASSERT_EQ(reply.substr(reply.find(',')), ",[user:10]]");
+}
+
+// wait_range polls RANGE on the member at port until it returns expected, the
+// member may not be listening yet
+static bool wait_range(uint16_t port, const std::string& expected) {
+  for (int i = 0; i < 100; ++i) {
+    Client client(port);
+    if (client.connected() && client.cmd({"range", "key:", ""}) == expected) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  return false;
+}
+
+TEST(store, OrderedIndexAfterRestart) {
+  TestDir dir("ordered_restart");
+  Cluster cluster(1, false, true);
+  cluster.policy().min_entries = 10;
+  cluster.policy().max_entries = 20;
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  std::string expected;
+  {
+    Client client(cluster.port(1));
+    for (int i = 0; i < 100; ++i) {
+      ASSERT_EQ(client.cmd({"set", "key:" + std::to_string(i), std::to_string(i)}), "+OK");
+      if (i % 3 == 0) {
+        ASSERT_EQ(client.cmd({"del", "key:" + std::to_string(i / 3)}), "+OK");
+      }
+    }
+    expected = client.cmd({"range", "key:", ""});
+    ASSERT_NE(expected, "[]");
+  }
+
+  // the index is built from the snapshots and the entries after them
+  cluster.stop(1);
+  cluster.start(1);
+  ASSERT_EQ(cluster.wait_leader(), 1);
+  ASSERT_TRUE(wait_range(cluster.port(1), expected));
+}
+
+TEST(store, OrderedIndexFromLeaderSnapshot) {
+  TestDir dir("ordered_recover");
+  Cluster cluster(3, false, true);
+  cluster.policy().min_entries = 10;
+  cluster.policy().max_entries = 20;
+  cluster.policy().min_catch_up_entries = 5;
+  cluster.policy().max_catch_up_entries = 10;
+  cluster.policy().checkpoint_entries = 0;
+  cluster.start_all();
+  uint64_t lead = cluster.wait_leader();
+  ASSERT_NE(lead, 0);
+  uint64_t follower = lead % 3 + 1;
+
+  Client client(cluster.port(lead));
+  ASSERT_EQ(client.cmd({"set", "key:old", "1"}), "+OK");
+  cluster.stop(follower);
+
+  // the follower misses more entries than the leader keeps, it is sent a snapshot
+  for (int i = 0; i < 200; ++i) {
+    ASSERT_EQ(client.cmd({"set", "key:" + std::to_string(i), std::to_string(i)}), "+OK");
+  }
+  ASSERT_EQ(client.cmd({"del", "key:old", "key:7"}), "+OK");
+  std::string expected = client.cmd({"range", "key:", ""});
+
+  cluster.start(follower);
+  ASSERT_TRUE(wait_range(cluster.port(follower), expected));
+  Client recovered(cluster.port(follower));
+  ASSERT_EQ(recovered.cmd({"keys", "key:o*"}), "[]");
+}
+
+TEST(store, SnapshotChunksBoundedByBytes) {
+  TestDir dir("chunk_bytes");
+  Cluster cluster(1);
+  cluster.policy().min_entries = 10;
+  cluster.policy().max_entries = 20;
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  // far fewer keys than a batch, but too many bytes for a single chunk
+  Client client(cluster.port(1));
+  for (int i = 0; i < 30; ++i) {
+    ASSERT_EQ(client.cmd({"set", "key:" + std::to_string(i), std::string(1024 * 1024, char('a' + i))}), "+OK");
+  }
+
+  std::unique_ptr<SnapshotReader> reader;
+  for (int i = 0; i < 100 && !reader; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    boost::filesystem::directory_iterator end;
+    for (boost::filesystem::directory_iterator it("node_1/snap"); it != end; ++it) {
+      if (it->path().extension() == ".snap") {
+        ASSERT_TRUE(SnapshotReader::open(it->path().string(), reader).is_ok());
+        break;
+      }
+    }
+  }
+  ASSERT_TRUE(reader);
+  ASSERT_EQ(reader->base_index(), 0u);
+
+  uint32_t keys = 0;
+  for (size_t i = 0; i < reader->chunk_count(); ++i) {
+    ASSERT_LE(reader->chunk(i).count, 5u);
+    keys += reader->chunk(i).count;
+  }
+  ASSERT_GE(keys, 15u);
+  ASSERT_GE(reader->chunk_count(), 3u);
+}
+
+TEST(store, BackupRestore) {
+  TestDir dir("backup");
+  std::string backup_path;
+  uint64_t backup_index = 0;
+  std::vector<uint64_t> write_index; // of every key w:<i> written
+  {
+    Cluster cluster(1);
+    cluster.start_all();
+    ASSERT_EQ(cluster.wait_leader(), 1);
+    Client client(cluster.port(1));
+    for (int i = 0; i < 100; ++i) {
+      ASSERT_EQ(client.cmd({"set", "k:" + std::to_string(i), std::to_string(i)}), "+OK");
+    }
+
+    // clients only name a file of the backup directory
+    ASSERT_EQ(client.cmd({"backup", "../kvd.snap"}).compare(0, 4, "-ERR"), 0);
+    ASSERT_EQ(client.cmd({"backup", "dir/kvd.snap"}).compare(0, 4, "-ERR"), 0);
+    ASSERT_EQ(client.cmd({"backup", ".."}).compare(0, 4, "-ERR"), 0);
+    ASSERT_EQ(client.cmd({"backup", ""}).compare(0, 4, "-ERR"), 0);
+
+    // the backup is taken while a client keeps writing
+    std::atomic<bool> stop(false);
+    std::thread writer([&cluster, &stop, &write_index]() {
+      Client client(cluster.port(1));
+      ASSERT_EQ(client.cmd({"client", "token", "on"}), "+OK");
+      for (int i = 0; !stop; ++i) {
+        uint64_t index = token_index(client.cmd({"set", "w:" + std::to_string(i), std::to_string(i)}));
+        ASSERT_GT(index, 0);
+        write_index.push_back(index);
+      }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    backup_index = token_index(client.cmd({"backup", "kvd.snap"}));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    stop = true;
+    writer.join();
+    ASSERT_GT(backup_index, 0);
+    ASSERT_LT(write_index.front(), backup_index);
+    ASSERT_GT(write_index.back(), backup_index);
+    backup_path = boost::filesystem::absolute("node_1/backup/kvd.snap").string();
+  }
+
+  // a member of a new cluster is seeded with the backup
+  TestDir restored("restored");
+  ASSERT_TRUE(RaftNode::restore(1, backup_path).is_ok());
+  ASSERT_FALSE(RaftNode::restore(1, backup_path).is_ok());
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+  Client client(cluster.port(1));
+  ASSERT_EQ(client.cmd({"client", "token", "on"}), "+OK");
+  ASSERT_GT(token_index(client.cmd({"set", "a", "1"})), backup_index);
+
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(client.cmd({"get", "k:" + std::to_string(i)}), std::to_string(i));
+  }
+  // the backup holds exactly the writes applied up to its index
+  for (size_t i = 0; i < write_index.size(); ++i) {
+    std::string expected = write_index[i] <= backup_index ? std::to_string(i) : "nil";
+    ASSERT_EQ(client.cmd({"get", "w:" + std::to_string(i)}), expected) << i;
+  }
+}
+
+// import_entries imports name on the member at port and returns the number of
+// entries it took, the reply of IMPORT is set to reply
+static uint64_t import_entries(Client& client, const std::string& name, std::string& reply) {
+  uint64_t before = token_index(client.cmd({"set", "before", "1"}));
+  reply = client.cmd({"import", name});
+  uint64_t after = token_index(client.cmd({"set", "after", "1"}));
+  return after - before - 1;
+}
+
+TEST(store, Import) {
+  TestDir dir("import");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+  Client client(cluster.port(1));
+  ASSERT_EQ(client.cmd({"client", "token", "on"}), "+OK");
+
+  // the small keys of two chunks of the file fit in an entry, a large value takes one of its own
+  std::vector<std::string> keys;
+  for (int i = 0; i < 2000; ++i) {
+    keys.push_back("k:" + std::to_string(i));
+    ASSERT_GT(token_index(client.cmd({"set", keys.back(), std::to_string(i)})), 0);
+  }
+  for (int i = 0; i < 3; ++i) {
+    keys.push_back("large:" + std::to_string(i));
+    ASSERT_GT(token_index(client.cmd({"set", keys.back(), std::string(1536 * 1024, char('a' + i))})), 0);
+  }
+  ASSERT_GT(token_index(client.cmd({"backup", "kvd.snap"})), 0);
+
+  // the paths are confined to the backup directory
+  ASSERT_EQ(client.cmd({"import", "../node_1/backup/kvd.snap"}).compare(0, 4, "-ERR"), 0);
+  ASSERT_EQ(client.cmd({"import", boost::filesystem::absolute("node_1/backup/kvd.snap").string()}).compare(0, 4, "-ERR"), 0);
+  ASSERT_EQ(client.cmd({"import", "missing.snap"}).compare(0, 4, "-ERR"), 0);
+
+  std::vector<std::string> del = {"del"};
+  del.insert(del.end(), keys.begin(), keys.end());
+  ASSERT_GT(token_index(client.cmd(del)), 0);
+  ASSERT_EQ(client.cmd({"get", "k:0"}), "nil");
+
+  std::string reply;
+  uint64_t entries = import_entries(client, "kvd.snap", reply);
+  // the keys written by the test and __leader
+  ASSERT_EQ(reply, ":" + std::to_string(keys.size() + 1));
+  ASSERT_GE(entries, 3u);
+  ASSERT_LE(entries, 4u);
+  ASSERT_EQ(client.cmd({"get", "k:1999"}), "1999");
+  ASSERT_EQ(client.cmd({"get", "large:2"}), std::string(1536 * 1024, 'c'));
+}
+
+TEST(store, ImportPartialFailure) {
+  TestDir dir("import_partial");
+  Cluster cluster(1);
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+  Client client(cluster.port(1));
+  ASSERT_EQ(client.cmd({"client", "token", "on"}), "+OK");
+
+  // 120 keys of 100KB, cut into chunks of about 4MB and entries of about 1MB
+  std::vector<std::string> del = {"del"};
+  for (int i = 0; i < 120; ++i) {
+    del.push_back("k:" + std::to_string(i));
+    ASSERT_GT(token_index(client.cmd({"set", del.back(), std::string(100 * 1024, 'x')})), 0);
+  }
+  ASSERT_GT(token_index(client.cmd({"backup", "kvd.snap"})), 0);
+  ASSERT_GT(token_index(client.cmd(del)), 0);
+
+  // the last chunk is corrupted, the entries of the chunks before it are applied
+  std::string path = "node_1/backup/kvd.snap";
+  std::unique_ptr<SnapshotReader> reader;
+  ASSERT_TRUE(SnapshotReader::open(path, reader).is_ok());
+  ASSERT_GE(reader->chunk_count(), 3u);
+  uint64_t offset = reader->chunk(reader->chunk_count() - 1).offset;
+  reader.reset();
+  FILE* fp = fopen(path.c_str(), "r+");
+  ASSERT_TRUE(fp != nullptr);
+  fseek(fp, offset + 16, SEEK_SET);
+  fputc('!', fp);
+  fclose(fp);
+
+  std::string reply;
+  uint64_t entries = import_entries(client, "kvd.snap", reply);
+  ASSERT_EQ(reply.compare(0, 4, "-ERR"), 0);
+  ASSERT_GT(entries, 0u);
+
+  int imported = 0;
+  for (size_t i = 1; i < del.size(); ++i) {
+    std::string value = client.cmd({"get", del[i]});
+    if (value != "nil") {
+      ASSERT_EQ(value.size(), 100u * 1024);
+      ++imported;
+    }
+  }
+  ASSERT_GT(imported, 0);
+  ASSERT_LT(imported, 120);
+}
+
+static proto::EntryPtr make_entry(uint64_t index, uint64_t term, proto::EntryType type = proto::EntryNormal) {
+  proto::EntryPtr entry(new proto::Entry());
+  entry->index = index;
+  entry->term = term;
+  entry->type = type;
+  return entry;
+}
+
+static proto::SnapshotMetadata make_meta(uint64_t index, uint64_t term) {
+  proto::SnapshotMetadata meta;
+  meta.index = index;
+  meta.term = term;
+  return meta;
+}
+
+TEST(store, CheckpointApplies) {
+  // entries 1 to 10 of term 1, 11 to 15 of term 2, committed up to 12
+  std::vector<proto::EntryPtr> ents;
+  for (uint64_t i = 1; i <= 15; ++i) {
+    ents.push_back(make_entry(i, i <= 10 ? 1 : 2));
+  }
+  MemoryStorage storage;
+  ASSERT_TRUE(storage.append(ents).is_ok());
+  proto::HardState hs;
+  hs.term = 2;
+  hs.commit = 12;
+
+  ASSERT_TRUE(RaftNode::checkpoint_applies(make_meta(12, 2), hs, ents, storage));
+  ASSERT_TRUE(RaftNode::checkpoint_applies(make_meta(8, 1), hs, ents, storage));
+  // the entry at the index of the checkpoint is of another term
+  ASSERT_FALSE(RaftNode::checkpoint_applies(make_meta(12, 1), hs, ents, storage));
+  ASSERT_FALSE(RaftNode::checkpoint_applies(make_meta(8, 2), hs, ents, storage));
+  // the entries up to the checkpoint are not committed
+  ASSERT_FALSE(RaftNode::checkpoint_applies(make_meta(14, 2), hs, ents, storage));
+  // beyond the log
+  ASSERT_FALSE(RaftNode::checkpoint_applies(make_meta(20, 2), hs, ents, storage));
+
+  // a configuration change before the checkpoint is applied again, one after it does not matter
+  ents[4]->type = proto::EntryConfChange;
+  ASSERT_FALSE(RaftNode::checkpoint_applies(make_meta(12, 2), hs, ents, storage));
+  ASSERT_TRUE(RaftNode::checkpoint_applies(make_meta(4, 1), hs, ents, storage));
+  ents[4]->type = proto::EntryNormal;
+  ents[12]->type = proto::EntryConfChange;
+  ASSERT_TRUE(RaftNode::checkpoint_applies(make_meta(12, 2), hs, ents, storage));
+}
+
+static void write_checkpoint(const std::string& path, const proto::SnapshotMetadata& meta, uint64_t base_index) {
+  std::unique_ptr<SnapshotWriter> writer;
+  if (base_index == 0) {
+    ASSERT_TRUE(SnapshotWriter::create(path, meta, writer).is_ok());
+  } else {
+    ASSERT_TRUE(SnapshotWriter::create_delta(path, meta, base_index, writer).is_ok());
+  }
+  std::map<std::string, std::string> keys = {{"a", "1"}};
+  msgpack::sbuffer sbuf;
+  msgpack::pack(sbuf, keys);
+  ASSERT_TRUE(writer->write_chunk(sbuf.data(), sbuf.size(), 1).is_ok());
+  ASSERT_TRUE(writer->finish().is_ok());
+}
+
+TEST(store, ReadCheckpoint) {
+  TestDir dir("read_checkpoint");
+  proto::SnapshotMetadata meta;
+  ASSERT_TRUE(RaftNode::read_checkpoint("checkpoint", 10, meta).is_not_found());
+
+  ASSERT_NO_FATAL_FAILURE(write_checkpoint("checkpoint", make_meta(20, 3), 10));
+  ASSERT_TRUE(RaftNode::read_checkpoint("checkpoint", 10, meta).is_ok());
+  ASSERT_EQ(meta.index, 20u);
+  ASSERT_EQ(meta.term, 3u);
+  // a delta on top of another snapshot than the newest one
+  ASSERT_FALSE(RaftNode::read_checkpoint("checkpoint", 15, meta).is_ok());
+  ASSERT_FALSE(RaftNode::read_checkpoint("checkpoint", 5, meta).is_ok());
+
+  // a full snapshot is not a checkpoint
+  ASSERT_NO_FATAL_FAILURE(write_checkpoint("checkpoint", make_meta(20, 3), 0));
+  ASSERT_FALSE(RaftNode::read_checkpoint("checkpoint", 10, meta).is_ok());
+
+  // nor is a delta that does not go beyond its snapshot
+  ASSERT_NO_FATAL_FAILURE(write_checkpoint("checkpoint", make_meta(10, 3), 10));
+  ASSERT_FALSE(RaftNode::read_checkpoint("checkpoint", 10, meta).is_ok());
+}
+
+// forge_checkpoint rewrites the checkpoint at path with meta, adding the key forged
+static void forge_checkpoint(const std::string& path, const proto::SnapshotMetadata& meta, const std::string& forged) {
+  std::unique_ptr<SnapshotReader> reader;
+  ASSERT_TRUE(SnapshotReader::open(path, reader).is_ok());
+  std::unique_ptr<SnapshotWriter> writer;
+  ASSERT_TRUE(SnapshotWriter::create_delta(path + ".forged", meta, reader->base_index(), writer).is_ok());
+  std::vector<char> data;
+  for (size_t i = 0; i < reader->chunk_count(); ++i) {
+    ASSERT_TRUE(reader->read_chunk(i, data).is_ok());
+    ASSERT_TRUE(writer->write_chunk(data.data(), data.size(), reader->chunk(i).count).is_ok());
+  }
+  std::map<std::string, std::string> keys = {{forged, "1"}};
+  msgpack::sbuffer sbuf;
+  msgpack::pack(sbuf, keys);
+  ASSERT_TRUE(writer->write_chunk(sbuf.data(), sbuf.size(), 1).is_ok());
+  ASSERT_TRUE(writer->finish().is_ok());
+  ASSERT_EQ(rename((path + ".forged").c_str(), path.c_str()), 0);
+}
+
+TEST(store, CheckpointReload) {
+  TestDir dir("checkpoint_reload");
+  Cluster cluster(1);
+  cluster.policy().min_entries = 10;
+  cluster.policy().max_entries = 20;
+  cluster.policy().checkpoint_entries = 5;
+  cluster.start_all();
+  ASSERT_EQ(cluster.wait_leader(), 1);
+
+  // writes until a checkpoint is taken after a snapshot
+  std::string path = "node_1/snap/checkpoint";
+  int count = 0;
+  {
+    Client client(cluster.port(1));
+    for (; count < 200 && !boost::filesystem::exists(path); ++count) {
+      ASSERT_EQ(client.cmd({"set", "key:" + std::to_string(count), std::to_string(count)}), "+OK");
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  cluster.stop(1);
+  ASSERT_TRUE(boost::filesystem::exists(path));
+  std::unique_ptr<SnapshotReader> reader;
+  ASSERT_TRUE(SnapshotReader::open(path, reader).is_ok());
+  proto::SnapshotMetadata meta = reader->metadata();
+  reader.reset();
+
+  auto check_keys = [&cluster, count]() {
+    Client client(cluster.port(1));
+    for (int i = 0; i < count; ++i) {
+      ASSERT_EQ(client.cmd({"get", "key:" + std::to_string(i)}), std::to_string(i));
+    }
+  };
+
+  // the store is loaded with the checkpoint, the key only it holds shows that
+  ASSERT_NO_FATAL_FAILURE(forge_checkpoint(path, meta, "forged:applied"));
+  cluster.start(1);
+  ASSERT_EQ(cluster.wait_leader(), 1);
+  ASSERT_NO_FATAL_FAILURE(check_keys());
+  ASSERT_EQ(Client(cluster.port(1)).cmd({"get", "forged:applied"}), "1");
+  cluster.stop(1);
+
+  // a checkpoint of another term is ignored and the entries up to it are applied again
+  proto::SnapshotMetadata other_term = meta;
+  other_term.term += 1;
+  ASSERT_NO_FATAL_FAILURE(forge_checkpoint(path, other_term, "forged:term"));
+  cluster.start(1);
+  ASSERT_EQ(cluster.wait_leader(), 1);
+  ASSERT_NO_FATAL_FAILURE(check_keys());
+  ASSERT_EQ(Client(cluster.port(1)).cmd({"get", "forged:term"}), "nil");
+}
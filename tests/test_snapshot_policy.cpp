@@ -0,0 +1,89 @@
+#include <gtest/gtest.h>
+#include <raft-kv/server/snapshot_policy.h>
+
+using namespace kv;
+
+TEST(test_snapshot_policy, test_parse) {
+  SnapshotPolicy policy;
+  ASSERT_TRUE(policy.parse("max_entries=5000,max_log_bytes=32m,max_rss_bytes=2g,min_catch_up_entries=10k").is_ok());
+  ASSERT_TRUE(policy.max_entries == 5000);
+  ASSERT_TRUE(policy.max_log_bytes == 32ULL << 20);
+  ASSERT_TRUE(policy.max_rss_bytes == 2ULL << 30);
+  ASSERT_TRUE(policy.min_catch_up_entries == 10ULL << 10);
+  ASSERT_TRUE(policy.max_wal_bytes == 256ULL << 20);
+  ASSERT_TRUE(policy.max_write_rate == 0);
+
+  ASSERT_TRUE(policy.parse("max_write_rate=100m,max_send_rate=50m").is_ok());
+  ASSERT_TRUE(policy.max_write_rate == 100ULL << 20);
+  ASSERT_TRUE(policy.max_send_rate == 50ULL << 20);
+  ASSERT_TRUE(policy.checkpoint_entries == 10000);
+
+  ASSERT_TRUE(policy.parse("checkpoint_entries=0").is_ok());
+  ASSERT_FALSE(policy.should_checkpoint(1000000));
+  ASSERT_TRUE(policy.parse("checkpoint_entries=2k").is_ok());
+  ASSERT_FALSE(policy.should_checkpoint(0));
+  ASSERT_FALSE(policy.should_checkpoint(2047));
+  ASSERT_TRUE(policy.should_checkpoint(2048));
+
+  ASSERT_TRUE(policy.parse("").is_ok());
+  ASSERT_FALSE(SnapshotPolicy().parse("max_entries").is_ok());
+  ASSERT_FALSE(SnapshotPolicy().parse("max_entries=").is_ok());
+  ASSERT_FALSE(SnapshotPolicy().parse("max_entries=10x").is_ok());
+  ASSERT_FALSE(SnapshotPolicy().parse("max_entrie=10").is_ok());
+  ASSERT_FALSE(SnapshotPolicy().parse("max_log_bytes=99999999999999g").is_ok());
+  ASSERT_FALSE(SnapshotPolicy().parse("min_entries=10,max_entries=5").is_ok());
+}
+
+TEST(test_snapshot_policy, test_should_snapshot) {
+  SnapshotPolicy policy;
+  ASSERT_TRUE(policy.parse("min_entries=10,max_entries=100,max_log_bytes=1k,max_wal_bytes=4k,max_rss_bytes=1m").is_ok());
+
+  SnapshotStats stats;
+  ASSERT_FALSE(policy.should_snapshot(stats));
+
+  stats.entries = 50;
+  ASSERT_FALSE(policy.should_snapshot(stats));
+  stats.entries = 100;
+  ASSERT_TRUE(policy.should_snapshot(stats));
+
+  // a few large entries
+  stats.entries = 10;
+  stats.log_bytes = 1024;
+  ASSERT_TRUE(policy.should_snapshot(stats));
+  stats.entries = 9;
+  ASSERT_FALSE(policy.should_snapshot(stats));
+
+  stats.entries = 10;
+  stats.log_bytes = 0;
+  stats.wal_bytes = 4096;
+  ASSERT_TRUE(policy.should_snapshot(stats));
+
+  stats.wal_bytes = 0;
+  stats.rss_bytes = 1 << 20;
+  ASSERT_TRUE(policy.should_snapshot(stats));
+  policy.max_rss_bytes = 0;
+  ASSERT_FALSE(policy.should_snapshot(stats));
+}
+
+TEST(test_snapshot_policy, test_compact_index) {
+  SnapshotPolicy policy;
+  ASSERT_TRUE(policy.parse("min_catch_up_entries=100,max_catch_up_entries=1000").is_ok());
+
+  // no follower known, the fewest entries are kept
+  ASSERT_TRUE(policy.compact_index(10000, 0, 0) == 9900);
+  ASSERT_TRUE(policy.compact_index(50, 0, 0) == 1);
+
+  // the entries the slowest follower misses are kept, within bounds
+  ASSERT_TRUE(policy.compact_index(10000, 0, 9500) == 9500);
+  ASSERT_TRUE(policy.compact_index(10000, 0, 100) == 9000);
+  ASSERT_TRUE(policy.compact_index(10000, 0, 9990) == 9900);
+
+  // the bytes bound wins over the entries
+  ASSERT_TRUE(policy.compact_index(10000, 9701, 9500) == 9700);
+  ASSERT_TRUE(policy.compact_index(10000, 9951, 9500) == 9950);
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -4,6 +4,7 @@
 #include <raft-kv/raft/proto.h>
 #include <boost/filesystem.hpp>
 #include <raft-kv/snap/snapshotter.h>
+#include <raft-kv/snap/snapshot_file.h>
 
 using namespace kv;
 
@@ -70,6 +71,272 @@ TEST(snap, Failback) {
   ASSERT_TRUE(boost::filesystem::exists(broken));
 }
 
+// the codecs the build supports
+static std::vector<uint32_t> test_codecs() {
+  std::vector<uint32_t> codecs;
+  for (uint32_t codec : {kSnapshotCodecNone, kSnapshotCodecLZ4, kSnapshotCodecZstd}) {
+    if (snapshot_codec_supported(codec)) {
+      codecs.push_back(codec);
+    }
+  }
+  return codecs;
+}
+
+static void test_stream(uint32_t codec) {
+  std::string dir = get_tmp_snapshot_dir() + "_" + std::to_string(codec);
+  boost::filesystem::create_directories(dir);
+  Snapshotter snap(dir);
+  proto::Snapshot& s = get_test_snap();
+
+  std::string tmp = dir + "/stream.tmp";
+  std::unique_ptr<SnapshotWriter> writer;
+  Status status = SnapshotWriter::create(tmp, s.metadata, writer, codec);
+  ASSERT_TRUE(status.is_ok());
+  std::string data;
+  for (int i = 0; i < 100000; ++i) {
+    std::string chunk = std::to_string(i);
+    data += chunk;
+    ASSERT_TRUE(writer->write(chunk.data(), chunk.size()).is_ok());
+  }
+  ASSERT_TRUE(writer->finish().is_ok());
+  ASSERT_TRUE(snap.install(tmp, s.metadata).is_ok());
+
+  proto::SnapshotMetadata meta;
+  std::vector<std::string> paths;
+  status = snap.load_newest(meta, paths);
+  ASSERT_TRUE(status.is_ok());
+  ASSERT_EQ(paths.size(), 1u);
+  ASSERT_EQ(paths[0], snap.snap_path(s.metadata.term, s.metadata.index));
+  ASSERT_EQ(meta.index, s.metadata.index);
+  std::string path = paths[0];
+
+  std::unique_ptr<SnapshotReader> reader;
+  ASSERT_TRUE(SnapshotReader::open(path, reader).is_ok());
+  ASSERT_EQ(reader->codec(), codec);
+  if (codec == kSnapshotCodecNone) {
+    ASSERT_EQ(reader->data_len(), data.size());
+  } else {
+    ASSERT_LT(reader->data_len(), data.size());
+  }
+  std::string read;
+  char buffer[4096];
+  size_t n;
+  do {
+    ASSERT_TRUE(reader->read(buffer, sizeof(buffer), n).is_ok());
+    read.append(buffer, n);
+  } while (n > 0);
+  ASSERT_EQ(read, data);
+
+  std::vector<uint8_t> all;
+  ASSERT_TRUE(snap.load_data(meta, all).is_ok());
+  ASSERT_EQ(std::string(all.begin(), all.end()), data);
+
+  // flip a byte of the data
+  FILE* fp = fopen(path.c_str(), "r+");
+  fseek(fp, -100, SEEK_END);
+  fputc('x', fp);
+  fclose(fp);
+  ASSERT_TRUE(SnapshotReader::open(path, reader).is_ok());
+  ASSERT_FALSE(reader->read_all(all).is_ok());
+}
+
+TEST(snap, Stream) {
+  for (uint32_t codec : test_codecs()) {
+    SCOPED_TRACE(codec);
+    ASSERT_NO_FATAL_FAILURE(test_stream(codec));
+  }
+}
+
+static void test_chunks(uint32_t codec) {
+  std::string dir = get_tmp_snapshot_dir() + "_" + std::to_string(codec);
+  boost::filesystem::create_directories(dir);
+  proto::Snapshot& s = get_test_snap();
+
+  std::string path = dir + "/chunks.snap";
+  std::unique_ptr<SnapshotWriter> writer;
+  ASSERT_TRUE(SnapshotWriter::create(path, s.metadata, writer, codec).is_ok());
+  for (uint32_t i = 0; i < 100; ++i) {
+    std::string chunk(i * 10 + 1, char('a' + i % 26));
+    ASSERT_TRUE(writer->write_chunk(chunk.data(), chunk.size(), i + 1).is_ok());
+  }
+  ASSERT_TRUE(writer->write("raw", 3).is_ok());
+  ASSERT_TRUE(writer->finish().is_ok());
+
+  std::unique_ptr<SnapshotReader> reader;
+  ASSERT_TRUE(SnapshotReader::open(path, reader).is_ok());
+  ASSERT_EQ(reader->chunk_count(), 101u);
+  ASSERT_EQ(reader->chunk(100).count, 0u);
+  std::vector<char> data;
+  for (uint32_t i = 0; i < 100; ++i) {
+    ASSERT_EQ(reader->chunk(i).count, i + 1);
+    ASSERT_TRUE(reader->read_chunk(i, data).is_ok());
+    ASSERT_EQ(std::string(data.begin(), data.end()), std::string(i * 10 + 1, char('a' + i % 26)));
+  }
+
+  // a corrupted chunk fails alone
+  FILE* fp = fopen(path.c_str(), "r+");
+  fseek(fp, reader->chunk(50).offset, SEEK_SET);
+  fputc('x', fp);
+  fclose(fp);
+  ASSERT_TRUE(SnapshotReader::open(path, reader).is_ok());
+  ASSERT_FALSE(reader->read_chunk(50, data).is_ok());
+  ASSERT_TRUE(reader->read_chunk(49, data).is_ok());
+  ASSERT_TRUE(reader->read_chunk(51, data).is_ok());
+
+  // so does a corrupted index
+  fp = fopen(path.c_str(), "r+");
+  fseek(fp, -(long) (sizeof(SnapshotFileFooter) + 1), SEEK_END);
+  fputc('x', fp);
+  fclose(fp);
+  ASSERT_FALSE(SnapshotReader::open(path, reader).is_ok());
+}
+
+TEST(snap, Chunks) {
+  for (uint32_t codec : test_codecs()) {
+    SCOPED_TRACE(codec);
+    ASSERT_NO_FATAL_FAILURE(test_chunks(codec));
+  }
+}
+
+TEST(snap, ChunkTooLarge) {
+  std::string dir = get_tmp_snapshot_dir() + "_too_large";
+  boost::filesystem::create_directories(dir);
+  proto::Snapshot& s = get_test_snap();
+
+  std::string path = dir + "/too_large.snap";
+  std::unique_ptr<SnapshotWriter> writer;
+  ASSERT_TRUE(SnapshotWriter::create(path, s.metadata, writer, kSnapshotCodecNone).is_ok());
+
+  // the length of a chunk is a uint32 in the index, a longer one is refused before it is read
+  char data = 'a';
+  ASSERT_FALSE(writer->write_chunk(&data, uint64_t(UINT32_MAX) + 1, 1).is_ok());
+  ASSERT_TRUE(writer->write_chunk(&data, 1, 1).is_ok());
+  ASSERT_TRUE(writer->finish().is_ok());
+
+  std::unique_ptr<SnapshotReader> reader;
+  ASSERT_TRUE(SnapshotReader::open(path, reader).is_ok());
+  ASSERT_EQ(reader->chunk_count(), 1u);
+}
+
+TEST(snap, Throttled) {
+  std::string dir = get_tmp_snapshot_dir() + "_throttled";
+  boost::filesystem::create_directories(dir);
+  proto::Snapshot& s = get_test_snap();
+
+  std::string path = dir + "/throttled.snap";
+  std::unique_ptr<SnapshotWriter> writer;
+  ASSERT_TRUE(SnapshotWriter::create(path, s.metadata, writer, kSnapshotCodecNone).is_ok());
+  RateLimiter limiter(16 * 1024 * 1024);
+  writer->set_rate_limiter(&limiter);
+
+  // the bucket holds 16MB, the last 4MB wait for it
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < 20; ++i) {
+    std::string chunk(1024 * 1024, char('a' + i));
+    ASSERT_TRUE(writer->write_chunk(chunk.data(), chunk.size(), 1).is_ok());
+  }
+  ASSERT_TRUE(writer->finish().is_ok());
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  ASSERT_GE(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(), 150);
+
+  std::unique_ptr<SnapshotReader> reader;
+  ASSERT_TRUE(SnapshotReader::open(path, reader).is_ok());
+  ASSERT_EQ(reader->chunk_count(), 20u);
+  std::vector<char> data;
+  ASSERT_TRUE(reader->read_chunk(19, data).is_ok());
+  ASSERT_EQ(std::string(data.begin(), data.end()), std::string(1024 * 1024, 't'));
+}
+
+static void write_snap(Snapshotter& snap, uint64_t index, uint64_t base_index) {
+  proto::SnapshotMetadata meta = get_test_snap().metadata;
+  meta.index = index;
+
+  std::string tmp = snap.snap_path(meta.term, meta.index) + ".tmp";
+  std::unique_ptr<SnapshotWriter> writer;
+  if (base_index == 0) {
+    ASSERT_TRUE(SnapshotWriter::create(tmp, meta, writer).is_ok());
+  } else {
+    ASSERT_TRUE(SnapshotWriter::create_delta(tmp, meta, base_index, writer).is_ok());
+  }
+  std::string data = std::to_string(index);
+  ASSERT_TRUE(writer->write_chunk(data.data(), data.size(), 1).is_ok());
+  ASSERT_TRUE(writer->finish().is_ok());
+  ASSERT_TRUE(snap.install(tmp, meta, base_index != 0).is_ok());
+}
+
+TEST(snap, Deltas) {
+  std::string dir = get_tmp_snapshot_dir() + "_deltas";
+  boost::filesystem::create_directories(dir);
+  Snapshotter snap(dir);
+
+  ASSERT_NO_FATAL_FAILURE(write_snap(snap, 1, 0));
+  ASSERT_NO_FATAL_FAILURE(write_snap(snap, 2, 1));
+  ASSERT_NO_FATAL_FAILURE(write_snap(snap, 3, 2));
+
+  proto::SnapshotMetadata meta;
+  std::vector<std::string> paths;
+  ASSERT_TRUE(snap.load_newest(meta, paths).is_ok());
+  ASSERT_EQ(meta.index, 3u);
+  ASSERT_EQ(paths.size(), 3u);
+  ASSERT_EQ(paths[0], snap.snap_path(1, 1));
+  ASSERT_EQ(paths[1], snap.delta_path(1, 2));
+  ASSERT_EQ(paths[2], snap.delta_path(1, 3));
+
+  std::unique_ptr<SnapshotReader> reader;
+  ASSERT_TRUE(SnapshotReader::open(paths[2], reader).is_ok());
+  ASSERT_EQ(reader->base_index(), 2u);
+
+  // the deltas older than the second newest full snapshot are purged
+  ASSERT_NO_FATAL_FAILURE(write_snap(snap, 4, 0));
+  ASSERT_NO_FATAL_FAILURE(write_snap(snap, 5, 4));
+  ASSERT_NO_FATAL_FAILURE(write_snap(snap, 6, 0));
+  snap.purge();
+  ASSERT_FALSE(boost::filesystem::exists(snap.delta_path(1, 2)));
+  ASSERT_FALSE(boost::filesystem::exists(snap.delta_path(1, 3)));
+  ASSERT_TRUE(boost::filesystem::exists(snap.snap_path(1, 1)));
+
+  meta = get_test_snap().metadata;
+  meta.index = 5;
+  ASSERT_TRUE(snap.files(meta, paths).is_ok());
+  ASSERT_EQ(paths.size(), 2u);
+  ASSERT_EQ(paths[0], snap.snap_path(1, 4));
+  ASSERT_EQ(paths[1], snap.delta_path(1, 5));
+
+  // a snapshot on top of a broken delta is skipped
+  boost::filesystem::remove(snap.snap_path(1, 6));
+  FILE* fp = fopen(snap.delta_path(1, 5).c_str(), "r+");
+  fputc('x', fp);
+  fclose(fp);
+  ASSERT_TRUE(snap.load_newest(meta, paths).is_ok());
+  ASSERT_EQ(meta.index, 4u);
+  ASSERT_EQ(paths.size(), 1u);
+}
+
+TEST(snap, PurgeReceived) {
+  std::string dir = get_tmp_snapshot_dir() + "_received";
+  boost::filesystem::create_directories(dir);
+  Snapshotter snap(dir);
+
+  // snapshots streamed by the leader that raft did not install
+  for (uint64_t index : {2, 3, 5}) {
+    boost::filesystem::create_directories(snap.received_path(1, index));
+    FILE* fp = fopen((snap.received_path(1, index) + "/" + Snapshotter::snap_name(1, index)).c_str(), "w");
+    fclose(fp);
+  }
+
+  // those not newer than the newest full snapshot are purged with it
+  ASSERT_NO_FATAL_FAILURE(write_snap(snap, 3, 0));
+  snap.purge();
+  ASSERT_FALSE(boost::filesystem::exists(snap.received_path(1, 2)));
+  ASSERT_FALSE(boost::filesystem::exists(snap.received_path(1, 3)));
+  ASSERT_TRUE(boost::filesystem::exists(snap.received_path(1, 5)));
+  ASSERT_TRUE(boost::filesystem::exists(snap.snap_path(1, 3)));
+
+  snap.purge_received(UINT64_MAX);
+  ASSERT_FALSE(boost::filesystem::exists(snap.received_path(1, 5)));
+  ASSERT_TRUE(boost::filesystem::exists(snap.snap_path(1, 3)));
+}
+
 int main(int argc, char* argv[]) {
   boost::system::error_code code;
   boost::filesystem::create_directories("_test_snapshot");
@@ -495,6 +495,30 @@ TEST(storage, apply) {
   ASSERT_FALSE(status.is_ok());
 }
 
+TEST(storage, retained_index) {
+  MemoryStorage m;
+  m.entries_.clear();
+  m.entries_.push_back(newMemoryStorage(3, 3));
+  for (uint64_t i = 4; i <= 6; ++i) {
+    proto::EntryPtr entry = newMemoryStorage(i, i);
+    entry->data.resize(100);
+    m.entries_.push_back(entry);
+  }
+
+  uint64_t index = 0;
+  ASSERT_TRUE(m.retained_index(6, 1000, index).is_ok());
+  ASSERT_TRUE(index == 4);
+  ASSERT_TRUE(m.retained_index(6, 200, index).is_ok());
+  ASSERT_TRUE(index == 5);
+  ASSERT_TRUE(m.retained_index(5, 199, index).is_ok());
+  ASSERT_TRUE(index == 5);
+  ASSERT_TRUE(m.retained_index(6, 99, index).is_ok());
+  ASSERT_TRUE(index == 7);
+
+  ASSERT_FALSE(m.retained_index(3, 1000, index).is_ok());
+  ASSERT_FALSE(m.retained_index(7, 1000, index).is_ok());
+}
+
 TEST(storage, entry) {
   MemoryStorage m;
   m.entries_.clear();
@@ -0,0 +1,309 @@
+#include <gtest/gtest.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <condition_variable>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <boost/filesystem.hpp>
+#include <raft-kv/transport/transport.h>
+#include <raft-kv/transport/proto.h>
+#include <raft-kv/snap/snapshotter.h>
+#include <raft-kv/snap/snapshot_file.h>
+
+using namespace kv;
+
+class TestRaftServer : public RaftServer {
+ public:
+  explicit TestRaftServer(uint64_t id, const std::string& dir)
+      : id_(id),
+        dir_(dir),
+        reported_(false),
+        status_(SnapshotFailure) {
+  }
+
+  void process(proto::MessagePtr msg, const std::function<void(const Status&)>& callback) final {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (msg->type == proto::MsgSnap) {
+      snap_msg_ = msg;
+      cond_.notify_all();
+    }
+    callback(Status::ok());
+  }
+
+  void is_id_removed(uint64_t id, const std::function<void(bool)>& callback) final {
+    callback(false);
+  }
+
+  void report_unreachable(uint64_t id) final {
+  }
+
+  void report_snapshot(uint64_t id, SnapshotStatus status) final {
+    std::lock_guard<std::mutex> guard(mutex_);
+    reported_ = true;
+    status_ = status;
+    cond_.notify_all();
+  }
+
+  Status snapshot_files(const proto::SnapshotMetadata& meta, std::vector<std::string>& paths) const final {
+    Snapshotter snapshotter(dir_);
+    return snapshotter.files(meta, paths);
+  }
+
+  std::string received_snapshot_path(const proto::SnapshotMetadata& meta) const final {
+    return Snapshotter(dir_).received_path(meta.term, meta.index);
+  }
+
+  uint64_t node_id() const final {
+    return id_;
+  }
+
+  bool wait_report(SnapshotStatus& status, int seconds = 10) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait_for(lock, std::chrono::seconds(seconds), [this] { return reported_; });
+    status = status_;
+    return reported_;
+  }
+
+  proto::MessagePtr wait_snap_msg() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait_for(lock, std::chrono::seconds(10), [this] { return snap_msg_ != nullptr; });
+    return snap_msg_;
+  }
+
+ private:
+  uint64_t id_;
+  std::string dir_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool reported_;
+  SnapshotStatus status_;
+  proto::MessagePtr snap_msg_;
+};
+
+static std::string read_file(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  std::stringstream ss;
+  ss << in.rdbuf();
+  return ss.str();
+}
+
+TEST(transport, SendSnapshot) {
+  char dir[128];
+  snprintf(dir, sizeof(dir), "_test_transport/%d_%d", (int) time(NULL), getpid());
+  std::string leader_dir = std::string(dir) + "/1";
+  std::string follower_dir = std::string(dir) + "/2";
+  boost::filesystem::create_directories(leader_dir);
+  boost::filesystem::create_directories(follower_dir);
+
+  TestRaftServer leader(1, leader_dir);
+  TestRaftServer follower(2, follower_dir);
+
+  proto::SnapshotMetadata base;
+  base.index = 5;
+  base.term = 2;
+  base.conf_state.nodes.push_back(1);
+  base.conf_state.nodes.push_back(2);
+
+  proto::SnapshotMetadata meta = base;
+  meta.index = 10;
+
+  // the full snapshot is larger than the send window, the delta is sent after it
+  Snapshotter snapshotter(leader_dir);
+  std::unique_ptr<SnapshotWriter> writer;
+  ASSERT_TRUE(SnapshotWriter::create(snapshotter.snap_path(base.term, base.index), base, writer).is_ok());
+  std::string data(3 * kSnapshotWindow + 12345, 'x');
+  for (size_t i = 0; i < data.size(); i += 4096) {
+    data[i] = char(i / 4096);
+  }
+  ASSERT_TRUE(writer->write(data.data(), data.size()).is_ok());
+  ASSERT_TRUE(writer->finish().is_ok());
+
+  ASSERT_TRUE(SnapshotWriter::create_delta(snapshotter.delta_path(meta.term, meta.index), meta, base.index, writer).is_ok());
+  ASSERT_TRUE(writer->write(data.data(), 12345).is_ok());
+  ASSERT_TRUE(writer->finish().is_ok());
+
+  std::vector<std::string> paths;
+  ASSERT_TRUE(leader.snapshot_files(meta, paths).is_ok());
+  ASSERT_EQ(paths.size(), 2u);
+
+  TransporterPtr t1 = Transport::create(&leader, 1);
+  TransporterPtr t2 = Transport::create(&follower, 2);
+  t1->start("127.0.0.1:19401");
+  t2->start("127.0.0.1:19402");
+  t1->add_peer(2, "127.0.0.1:19402");
+
+  proto::MessagePtr msg(new proto::Message());
+  msg->type = proto::MsgSnap;
+  msg->from = 1;
+  msg->to = 2;
+  msg->term = 2;
+  msg->snapshot.metadata = meta;
+  t1->send({msg});
+
+  SnapshotStatus status;
+  bool reported = leader.wait_report(status);
+  proto::MessagePtr received = follower.wait_snap_msg();
+  t1->stop();
+  t2->stop();
+
+  ASSERT_TRUE(reported);
+  ASSERT_EQ(status, SnapshotFinish);
+  ASSERT_TRUE(received != nullptr);
+  ASSERT_EQ(received->snapshot.metadata.index, meta.index);
+  for (const std::string& path : paths) {
+    std::string name = boost::filesystem::path(path).filename().string();
+    ASSERT_EQ(read_file(follower.received_snapshot_path(received->snapshot.metadata) + "/" + name), read_file(path));
+  }
+}
+
+TEST(transport, SendMissingSnapshot) {
+  TestRaftServer leader(1, "_test_transport/missing");
+  TransporterPtr t1 = Transport::create(&leader, 1);
+  t1->start("127.0.0.1:19403");
+  t1->add_peer(2, "127.0.0.1:19404");
+
+  proto::MessagePtr msg(new proto::Message());
+  msg->type = proto::MsgSnap;
+  msg->from = 1;
+  msg->to = 2;
+  msg->snapshot.metadata.index = 10;
+  msg->snapshot.metadata.term = 2;
+  t1->send({msg});
+
+  SnapshotStatus status;
+  bool reported = leader.wait_report(status);
+  t1->stop();
+
+  ASSERT_TRUE(reported);
+  ASSERT_EQ(status, SnapshotFailure);
+}
+
+// listen_silent listens on port without ever accepting, the connections stay in the backlog
+static int listen_silent(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+TEST(transport, SendSnapshotToSilentPeer) {
+  char dir[128];
+  snprintf(dir, sizeof(dir), "_test_transport/silent_%d_%d", (int) time(NULL), getpid());
+  boost::filesystem::create_directories(dir);
+  TestRaftServer leader(1, dir);
+
+  proto::SnapshotMetadata meta;
+  meta.index = 5;
+  meta.term = 2;
+  Snapshotter snapshotter(dir);
+  std::unique_ptr<SnapshotWriter> writer;
+  ASSERT_TRUE(SnapshotWriter::create(snapshotter.snap_path(meta.term, meta.index), meta, writer).is_ok());
+  std::string data(2 * kSnapshotWindow, 'x');
+  ASSERT_TRUE(writer->write(data.data(), data.size()).is_ok());
+  ASSERT_TRUE(writer->finish().is_ok());
+
+  int fd = listen_silent(19406);
+  ASSERT_GE(fd, 0);
+  TransporterPtr t1 = Transport::create(&leader, 1);
+  t1->start("127.0.0.1:19405");
+  t1->add_peer(2, "127.0.0.1:19406");
+
+  proto::MessagePtr msg(new proto::Message());
+  msg->type = proto::MsgSnap;
+  msg->from = 1;
+  msg->to = 2;
+  msg->snapshot.metadata = meta;
+  t1->send({msg});
+
+  // no ack ever comes, the stream fails once idle
+  SnapshotStatus status;
+  bool reported = leader.wait_report(status, 3 * kSnapshotIdleTimeout);
+  t1->stop();
+  close(fd);
+
+  ASSERT_TRUE(reported);
+  ASSERT_EQ(status, SnapshotFailure);
+}
+
+TEST(transport, ReceiveSnapshotFromSilentLeader) {
+  char dir[128];
+  snprintf(dir, sizeof(dir), "_test_transport/silent_leader_%d_%d", (int) time(NULL), getpid());
+  boost::filesystem::create_directories(dir);
+  TestRaftServer follower(2, dir);
+  TransporterPtr t2 = Transport::create(&follower, 2);
+  t2->start("127.0.0.1:19407");
+
+  proto::MessagePtr msg(new proto::Message());
+  msg->type = proto::MsgSnap;
+  msg->from = 1;
+  msg->to = 2;
+  msg->snapshot.metadata.index = 5;
+  msg->snapshot.metadata.term = 2;
+  msgpack::sbuffer sbuf;
+  msgpack::pack(sbuf, *msg);
+
+  // the leader announces a snapshot and sends nothing more
+  SnapshotBegin begin;
+  begin.size = htobe64(1024);
+  begin.files = htonl(1);
+  std::vector<uint8_t> frame(sizeof(TransportMeta) + sizeof(begin) + sbuf.size());
+  TransportMeta* meta = (TransportMeta*) frame.data();
+  meta->type = TransportTypeSnapshot;
+  meta->len = htonl(static_cast<uint32_t>(sizeof(begin) + sbuf.size()));
+  memcpy(meta->data, &begin, sizeof(begin));
+  memcpy(meta->data + sizeof(begin), sbuf.data(), sbuf.size());
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(19407);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  ASSERT_EQ(connect(fd, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  struct timeval timeout = {3 * kSnapshotIdleTimeout, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  ASSERT_EQ(write(fd, frame.data(), frame.size()), static_cast<ssize_t>(frame.size()));
+
+  std::string recv_dir = follower.received_snapshot_path(msg->snapshot.metadata);
+  for (int i = 0; i < 50 && !boost::filesystem::exists(recv_dir); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  ASSERT_TRUE(boost::filesystem::exists(recv_dir));
+
+  // the follower closes the connection once idle and removes what it received
+  char c;
+  ssize_t n = read(fd, &c, 1);
+  for (int i = 0; i < 50 && boost::filesystem::exists(recv_dir); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  bool removed = !boost::filesystem::exists(recv_dir);
+  close(fd);
+  t2->stop();
+
+  ASSERT_EQ(n, 0);
+  ASSERT_TRUE(removed);
+}
+
+int main(int argc, char* argv[]) {
+  boost::system::error_code code;
+  boost::filesystem::create_directories("_test_transport");
+
+  testing::InitGoogleTest(&argc, argv);
+  int ret = RUN_ALL_TESTS();
+
+  boost::filesystem::remove_all("_test_transport", code);
+  return ret;
+}